@@ -0,0 +1,103 @@
+/*
+ * arena.c - Per-request memory
+ *
+ * The strings a request is parsed into are taken from an arena kept with
+ * the connection's request, and released together when the request is
+ * reset for the next one on the connection. Most requests fit in the
+ * arena's own storage and cost no malloc() at all; larger ones chain
+ * extra blocks, which are freed on reset.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+
+#define ROUND_UP(n) (((n) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1))
+
+void
+arena_init(struct arena *a) {
+
+	a->ptr = a->first;
+	a->end = a->first + sizeof(a->first);
+	a->blocks = NULL;
+}
+
+/*
+ * Return size bytes from the arena, or NULL if memory runs out.
+ */
+void*
+arena_alloc(struct arena *a, size_t size) {
+
+	struct arena_block *b;
+	size_t len;
+	char *p;
+
+	size = ROUND_UP(size);
+	if ((size_t)(a->end - a->ptr) >= size) {
+		p = a->ptr;
+		a->ptr += size;
+		return p;
+	}
+
+	/* A new block, at least as large as the arena's own storage */
+	len = ROUND_UP(sizeof(struct arena_block))
+		+ (size > ARENA_SIZE ? size : ARENA_SIZE);
+	if ((b = malloc(len)) == NULL) {
+		fprintf(stderr, "malloc error\n");
+		return NULL;
+	}
+	b->next = a->blocks;
+	b->end = (char*)b + len;
+	a->blocks = b;
+
+	p = (char*)b + ROUND_UP(sizeof(struct arena_block));
+	a->ptr = p + size;
+	a->end = b->end;
+
+	return p;
+}
+
+void*
+arena_calloc(struct arena *a, size_t size) {
+
+	void *p;
+
+	if ((p = arena_alloc(a, size)) != NULL)
+		memset(p, 0, size);
+	return p;
+}
+
+char*
+arena_strndup(struct arena *a, const char *s, size_t len) {
+
+	char *p;
+
+	if ((p = arena_alloc(a, len + 1)) != NULL) {
+		memcpy(p, s, len);
+		p[len] = '\0';
+	}
+	return p;
+}
+
+char*
+arena_strdup(struct arena *a, const char *s) {
+
+	return arena_strndup(a, s, strlen(s));
+}
+
+/*
+ * Release everything allocated from the arena. Without extra blocks this
+ * only rewinds the arena's pointer.
+ */
+void
+arena_reset(struct arena *a) {
+
+	struct arena_block *b, *next;
+
+	for (b = a->blocks; b != NULL; b = next) {
+		next = b->next;
+		free(b);
+	}
+	arena_init(a);
+}
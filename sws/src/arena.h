@@ -0,0 +1,36 @@
+#ifndef _ARENA_H_
+#define _ARENA_H_
+
+#include <stddef.h>
+
+/* Room in an arena before it needs to allocate, enough for most requests */
+#define ARENA_SIZE 4096
+
+/* Alignment of every allocation */
+#define ARENA_ALIGN 16
+
+/* Storage for allocations that did not fit in the arena's own */
+struct arena_block {
+	struct arena_block *next;
+	char *end;
+};
+
+/*
+ * Bump allocator for data that lives as long as one request. Nothing is
+ * freed on its own; arena_reset() releases everything at once.
+ */
+struct arena {
+	char *ptr;
+	char *end;
+	struct arena_block *blocks;
+	char first[ARENA_SIZE] __attribute__((aligned(ARENA_ALIGN)));
+};
+
+void arena_init(struct arena*);
+void* arena_alloc(struct arena*, size_t);
+void* arena_calloc(struct arena*, size_t);
+char* arena_strdup(struct arena*, const char*);
+char* arena_strndup(struct arena*, const char*, size_t);
+void arena_reset(struct arena*);
+
+#endif
@@ -0,0 +1,737 @@
+/*
+ * bench.c - sws-bench, an HTTP load generator for sws
+ *
+ * Runs a fixed set of scenarios (small and large files, a directory
+ * index, 304s, 404s and a CGI script) one after the other against a
+ * server on this machine, and prints throughput and latency percentiles
+ * for each as JSON. The document root they expect is created with -m.
+ *
+ * Each thread drives its share of the connections from its own epoll
+ * instance, one request in flight per connection. In the default closed
+ * loop, a connection sends its next request as soon as a response is
+ * complete. With -r, requests are instead due at a constant total rate,
+ * whether or not the server keeps up. A request that finds no idle
+ * connection waits for one, and its latency is counted from when it was
+ * due rather than when it could be sent, so that a stalled server is not
+ * excused by the requests it kept us from sending (coordinated omission).
+ */
+#define _GNU_SOURCE
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "hist.h"
+
+/* Defaults */
+#define BENCH_CONNS 64
+#define BENCH_THREADS 4
+#define BENCH_DURATION 10
+#define BENCH_PORT 8080
+
+/* Receive buffer of a connection, which must hold a response head */
+#define BENCH_BUF 65536
+
+/* Most events handled per wakeup */
+#define BENCH_EVENTS 256
+
+/* Where a connection is in reading a response */
+#define READ_HEAD 0
+#define READ_BODY 1
+#define READ_CHUNK_SIZE 2
+#define READ_CHUNK_END 3
+#define READ_TRAILER 4
+#define READ_UNTIL_CLOSE 5
+#define READ_DONE 6
+
+struct scenario {
+	const char *name;
+	const char *path;
+	/* Sends an If-Modified-Since of now */
+	int conditional;
+	int status;
+};
+
+static const struct scenario scenarios[] = {
+	{ "small", "/small.txt", 0, 200 },
+	{ "large", "/large.bin", 0, 200 },
+	{ "index", "/index/", 0, 200 },
+	{ "not-modified", "/small.txt", 1, 304 },
+	{ "not-found", "/missing", 0, 404 },
+	{ "cgi", "/cgi-bin/hello.sh", 0, 200 },
+};
+
+#define NSCENARIOS (sizeof(scenarios) / sizeof(scenarios[0]))
+
+struct bconn {
+	int fd;
+	/* A request is in flight */
+	int busy;
+	/* When it was sent, or due in the open loop */
+	unsigned long start;
+	int state;
+	int status;
+	int close;
+	/* The body is chunked, and how much of the current part is left */
+	int chunked;
+	unsigned long remaining;
+	char buf[BENCH_BUF];
+	size_t len;
+};
+
+struct worker {
+	pthread_t thread;
+	struct bconn *conns;
+	int nconns;
+	/* Nanoseconds between due requests, 0 for the closed loop */
+	unsigned long interval;
+	const struct scenario *sc;
+	unsigned long requests;
+	unsigned long errors;
+	unsigned long bytes;
+	/* Due requests still waiting for a connection at the end */
+	unsigned long unsent;
+	unsigned long max;
+	unsigned long hist[HIST_BUCKETS];
+};
+
+static struct sockaddr_in server;
+static char request[1024];
+static size_t request_len;
+static unsigned long start_time, end_time;
+
+int main(int, char**);
+void usage(void);
+
+static unsigned long
+now_ns(void) {
+
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+/*
+ * Return the latency, in microseconds, that fraction q of the count
+ * requests in h did not exceed. The end of its bucket is reported, or
+ * max, the largest latency seen, if that is smaller.
+ */
+static double
+percentile(const unsigned long *h, unsigned long count, unsigned long max,
+	double q) {
+
+	unsigned long ns;
+
+	ns = hist_percentile(h, count, q);
+	return ((ns < max) ? ns : max) / 1000.0;
+}
+
+/*
+ * Wait up to ns nanoseconds for events. Requests due in less than a
+ * millisecond would otherwise be sent late, or spun for, taking the CPU
+ * from the server. Kernels without epoll_pwait2() get the millisecond
+ * wait, rounded up.
+ */
+static int
+wait_events(int epfd, struct epoll_event *events, unsigned long ns) {
+
+	static int nopwait2;
+	struct timespec ts;
+	int n;
+
+	if (!nopwait2) {
+		ts.tv_sec = ns / 1000000000UL;
+		ts.tv_nsec = ns % 1000000000UL;
+		if ((n = epoll_pwait2(epfd, events, BENCH_EVENTS, &ts, NULL)) >= 0
+			|| errno != ENOSYS)
+			return n;
+		nopwait2 = 1;
+	}
+
+	return epoll_wait(epfd, events, BENCH_EVENTS, (ns + 999999) / 1000000);
+}
+
+static void
+drop_conn(struct bconn *c) {
+
+	if (c->fd >= 0)
+		close(c->fd);
+	c->fd = -1;
+	c->busy = 0;
+}
+
+/*
+ * Connect c to the server and add it to epfd. Local connections are
+ * established at once, so this blocks.
+ */
+static int
+open_conn(int epfd, struct bconn *c) {
+
+	struct epoll_event ev;
+	int opt;
+
+	if ((c->fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0) {
+		perror("socket");
+		return -1;
+	}
+	if (connect(c->fd, (struct sockaddr*)&server, sizeof(server)) < 0) {
+		perror("connect");
+		drop_conn(c);
+		return -1;
+	}
+
+	opt = 1;
+	setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+	if (fcntl(c->fd, F_SETFL, O_NONBLOCK) < 0) {
+		perror("fcntl");
+		drop_conn(c);
+		return -1;
+	}
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.ptr = c;
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, c->fd, &ev) < 0) {
+		perror("epoll_ctl");
+		drop_conn(c);
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Send the request on c, counted from start, reconnecting first if the
+ * server closed the connection.
+ */
+static int
+send_request(struct worker *w, int epfd, struct bconn *c,
+	unsigned long start) {
+
+	if (c->fd < 0 && open_conn(epfd, c) < 0)
+		return -1;
+
+	c->busy = 1;
+	c->start = start;
+	c->state = READ_HEAD;
+	c->close = 0;
+	c->chunked = 0;
+	c->len = 0;
+
+	/* Requests are small enough for an empty socket buffer */
+	if (send(c->fd, request, request_len, MSG_NOSIGNAL)
+		!= (ssize_t)request_len) {
+		w->errors++;
+		drop_conn(c);
+		return -1;
+	}
+
+	return 0;
+}
+
+static void
+consume(struct bconn *c, size_t n) {
+
+	memmove(c->buf, c->buf + n, c->len - n);
+	c->len -= n;
+}
+
+/*
+ * Parse the head of a response, ending at end.
+ */
+static void
+parse_head(struct bconn *c, char *end) {
+
+	char *line, *next;
+	int length;
+
+	c->status = (c->len > 12) ? atoi(c->buf + 9) : 0;
+	length = 0;
+	for (line = strstr(c->buf, "\r\n") + 2; line < end; line = next) {
+		next = strstr(line, "\r\n") + 2;
+		if (strncasecmp(line, "Content-Length:", 15) == 0) {
+			c->remaining = strtoul(line + 15, NULL, 10);
+			length = 1;
+		} else if (strncasecmp(line, "Transfer-Encoding:", 18) == 0)
+			c->chunked = strstr(line, "chunked") != NULL
+				&& strstr(line, "chunked") < next;
+		else if (strncasecmp(line, "Connection:", 11) == 0)
+			c->close = strstr(line, "close") != NULL
+				&& strstr(line, "close") < next;
+	}
+
+	if (c->status == 304 || c->status == 204)
+		c->state = READ_DONE;
+	else if (c->chunked)
+		c->state = READ_CHUNK_SIZE;
+	else if (length)
+		c->state = (c->remaining > 0) ? READ_BODY : READ_DONE;
+	else
+		c->state = READ_UNTIL_CLOSE;
+}
+
+/*
+ * Consume what has arrived of the response on c. Returns 1 once it is
+ * complete, 0 if more is needed and -1 if it is malformed.
+ */
+static int
+parse_response(struct bconn *c) {
+
+	unsigned long n;
+	char *end;
+
+	while (1) {
+		switch (c->state) {
+		case READ_HEAD:
+			c->buf[c->len] = '\0';
+			if ((end = strstr(c->buf, "\r\n\r\n")) == NULL)
+				return (c->len == BENCH_BUF - 1) ? -1 : 0;
+			if (strncmp(c->buf, "HTTP/1.", 7) != 0)
+				return -1;
+			parse_head(c, end + 2);
+			consume(c, end + 4 - c->buf);
+			break;
+		case READ_BODY:
+			n = (c->remaining < c->len) ? c->remaining : c->len;
+			consume(c, n);
+			if ((c->remaining -= n) > 0)
+				return 0;
+			c->state = c->chunked ? READ_CHUNK_END : READ_DONE;
+			break;
+		case READ_CHUNK_SIZE:
+			c->buf[c->len] = '\0';
+			if ((end = strstr(c->buf, "\r\n")) == NULL)
+				return 0;
+			c->remaining = strtoul(c->buf, NULL, 16);
+			consume(c, end + 2 - c->buf);
+			c->state = (c->remaining > 0) ? READ_BODY : READ_TRAILER;
+			break;
+		case READ_CHUNK_END:
+			if (c->len < 2)
+				return 0;
+			consume(c, 2);
+			c->state = READ_CHUNK_SIZE;
+			break;
+		case READ_TRAILER:
+			c->buf[c->len] = '\0';
+			if ((end = strstr(c->buf, "\r\n")) == NULL)
+				return 0;
+			n = end - c->buf;
+			consume(c, n + 2);
+			if (n == 0)
+				c->state = READ_DONE;
+			break;
+		case READ_UNTIL_CLOSE:
+			c->len = 0;
+			return 0;
+		default:
+			return 1;
+		}
+	}
+}
+
+/*
+ * Count the response just completed on c, and leave c idle, or closed if
+ * the server is closing it.
+ */
+static void
+finish_response(struct worker *w, struct bconn *c, unsigned long now) {
+
+	unsigned long latency;
+
+	latency = now - c->start;
+	w->hist[hist_bucket(latency)]++;
+	if (latency > w->max)
+		w->max = latency;
+	w->requests++;
+	if (c->status != w->sc->status)
+		w->errors++;
+
+	c->busy = 0;
+	if (c->close || c->state == READ_UNTIL_CLOSE)
+		drop_conn(c);
+}
+
+/*
+ * Read what is available on c. Returns 1 if a response was completed.
+ */
+static int
+read_conn(struct worker *w, struct bconn *c) {
+
+	ssize_t n;
+	int rval;
+
+	if ((n = recv(c->fd, c->buf + c->len, BENCH_BUF - 1 - c->len, 0)) < 0) {
+		if (errno == EAGAIN || errno == EINTR)
+			return 0;
+	}
+	if (n <= 0) {
+		/* The end of a response that had no length */
+		if (n == 0 && c->busy && c->state == READ_UNTIL_CLOSE)
+			return 1;
+		if (c->busy)
+			w->errors++;
+		drop_conn(c);
+		return 0;
+	}
+
+	w->bytes += n;
+	c->len += n;
+	if (!c->busy) {
+		/* Nothing was asked for */
+		w->errors++;
+		drop_conn(c);
+		return 0;
+	}
+
+	if ((rval = parse_response(c)) < 0) {
+		w->errors++;
+		drop_conn(c);
+		return 0;
+	}
+
+	return rval;
+}
+
+static void*
+run_worker(void *arg) {
+
+	struct epoll_event events[BENCH_EVENTS];
+	struct worker *w;
+	struct bconn *c;
+	unsigned long now, due, timeout;
+	int epfd, i, n;
+
+	w = arg;
+	if ((epfd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+		perror("epoll_create1");
+		return NULL;
+	}
+
+	now = now_ns();
+	due = start_time;
+	if (w->interval == 0) {
+		for (i = 0; i < w->nconns; i++)
+			send_request(w, epfd, &w->conns[i], now);
+	}
+
+	while ((now = now_ns()) < end_time) {
+		/* Due requests take whatever connections are idle */
+		for (i = 0; w->interval > 0 && i < w->nconns && due <= now; i++) {
+			c = &w->conns[i];
+			if (!c->busy && send_request(w, epfd, c, due) == 0)
+				due += w->interval;
+		}
+
+		timeout = end_time - now;
+		if (w->interval > 0 && due > now && due - now < timeout)
+			timeout = due - now;
+		if ((n = wait_events(epfd, events, timeout)) < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("epoll_wait");
+			break;
+		}
+
+		now = now_ns();
+		for (i = 0; i < n; i++) {
+			c = events[i].data.ptr;
+			if (c->fd < 0 || read_conn(w, c) == 0)
+				continue;
+			finish_response(w, c, now);
+			if (w->interval == 0)
+				send_request(w, epfd, c, now);
+		}
+
+		/* Connections lost in the closed loop are replaced */
+		for (i = 0; w->interval == 0 && i < w->nconns; i++)
+			if (!w->conns[i].busy)
+				send_request(w, epfd, &w->conns[i], now_ns());
+	}
+
+	if (w->interval > 0 && due < end_time)
+		w->unsent = (end_time - due) / w->interval;
+
+	for (i = 0; i < w->nconns; i++)
+		drop_conn(&w->conns[i]);
+	close(epfd);
+
+	return NULL;
+}
+
+/*
+ * Run scenario sc with nconns connections spread over nthreads threads,
+ * for duration seconds, at rate requests a second in total or in a closed
+ * loop if rate is 0, and print its results as a JSON object.
+ */
+static int
+run_scenario(const struct scenario *sc, int nconns, int nthreads,
+	int duration, double rate, const char *host) {
+
+	struct worker *workers;
+	char date[64];
+	unsigned long requests, errors, bytes, unsent, max;
+	unsigned long *hist;
+	time_t t;
+	int i, j;
+
+	if (sc->conditional) {
+		t = time(NULL);
+		strftime(date, sizeof(date), "%a, %d %b %Y %T GMT", gmtime(&t));
+		request_len = snprintf(request, sizeof(request),
+			"GET %s HTTP/1.1\r\nHost: %s\r\n"
+			"If-Modified-Since: %s\r\n\r\n", sc->path, host, date);
+	} else
+		request_len = snprintf(request, sizeof(request),
+			"GET %s HTTP/1.1\r\nHost: %s\r\n\r\n", sc->path, host);
+
+	if ((workers = calloc(nthreads, sizeof(struct worker))) == NULL
+		|| (hist = calloc(HIST_BUCKETS, sizeof(unsigned long))) == NULL) {
+		fprintf(stderr, "calloc error\n");
+		free(workers);
+		return -1;
+	}
+
+	start_time = now_ns();
+	end_time = start_time + duration * 1000000000UL;
+	for (i = 0; i < nthreads; i++) {
+		workers[i].sc = sc;
+		workers[i].nconns = nconns / nthreads
+			+ (i < nconns % nthreads);
+		if (rate > 0)
+			workers[i].interval = 1e9 / (rate / nthreads);
+		if ((workers[i].conns = calloc(workers[i].nconns,
+			sizeof(struct bconn))) == NULL) {
+			fprintf(stderr, "calloc error\n");
+			exit(EXIT_FAILURE);
+			/* NOTREACHED */
+		}
+		for (j = 0; j < workers[i].nconns; j++)
+			workers[i].conns[j].fd = -1;
+		if (pthread_create(&workers[i].thread, NULL, run_worker,
+			&workers[i]) != 0) {
+			fprintf(stderr, "pthread_create failed\n");
+			exit(EXIT_FAILURE);
+			/* NOTREACHED */
+		}
+	}
+
+	requests = errors = bytes = unsent = max = 0;
+	for (i = 0; i < nthreads; i++) {
+		pthread_join(workers[i].thread, NULL);
+		requests += workers[i].requests;
+		errors += workers[i].errors;
+		bytes += workers[i].bytes;
+		unsent += workers[i].unsent;
+		if (workers[i].max > max)
+			max = workers[i].max;
+		for (j = 0; j < HIST_BUCKETS; j++)
+			hist[j] += workers[i].hist[j];
+		free(workers[i].conns);
+	}
+
+	printf("    {\"scenario\": \"%s\", \"path\": \"%s\", "
+		"\"requests\": %lu, \"errors\": %lu, \"bytes\": %lu,\n",
+		sc->name, sc->path, requests, errors, bytes);
+	printf("     \"requests_per_sec\": %.1f, \"bytes_per_sec\": %.1f,\n",
+		(double)requests / duration, (double)bytes / duration);
+	if (rate > 0)
+		printf("     \"unsent\": %lu,\n", unsent);
+	printf("     \"latency_us\": {\"p50\": %.1f, \"p90\": %.1f, "
+		"\"p99\": %.1f, \"p999\": %.1f, \"max\": %.1f}}",
+		percentile(hist, requests, max, 0.5),
+		percentile(hist, requests, max, 0.9),
+		percentile(hist, requests, max, 0.99),
+		percentile(hist, requests, max, 0.999), max / 1000.0);
+
+	free(hist);
+	free(workers);
+
+	return 0;
+}
+
+static void
+write_file(const char *path, const char *data, size_t len, size_t size,
+	mode_t mode) {
+
+	FILE *fp;
+	size_t n;
+
+	if ((fp = fopen(path, "w")) == NULL) {
+		perror(path);
+		exit(EXIT_FAILURE);
+		/* NOTREACHED */
+	}
+	for (n = 0; n < size; n += len)
+		fwrite(data, 1, (size - n < len) ? size - n : len, fp);
+	if (fclose(fp) != 0 || chmod(path, mode) < 0) {
+		perror(path);
+		exit(EXIT_FAILURE);
+		/* NOTREACHED */
+	}
+}
+
+/*
+ * Create the document root the scenarios expect in dir.
+ */
+static void
+make_root(const char *dir) {
+
+	const char *script = "#!/bin/sh\n"
+		"printf 'Content-Type: text/plain\\r\\n\\r\\nhello\\n'\n";
+	char path[4096], line[64];
+	int i;
+
+	snprintf(path, sizeof(path), "%s/index", dir);
+	if ((mkdir(dir, 0755) < 0 && errno != EEXIST)
+		|| (mkdir(path, 0755) < 0 && errno != EEXIST)) {
+		perror("mkdir");
+		exit(EXIT_FAILURE);
+		/* NOTREACHED */
+	}
+	snprintf(path, sizeof(path), "%s/cgi-bin", dir);
+	if (mkdir(path, 0755) < 0 && errno != EEXIST) {
+		perror("mkdir");
+		exit(EXIT_FAILURE);
+		/* NOTREACHED */
+	}
+
+	snprintf(line, sizeof(line), "%063d", 0);
+	snprintf(path, sizeof(path), "%s/small.txt", dir);
+	write_file(path, line, strlen(line), 1024, 0644);
+	snprintf(path, sizeof(path), "%s/large.bin", dir);
+	write_file(path, line, strlen(line), 1024 * 1024, 0644);
+	for (i = 0; i < 100; i++) {
+		snprintf(path, sizeof(path), "%s/index/file%03d.txt", dir, i);
+		write_file(path, line, strlen(line), 64, 0644);
+	}
+	snprintf(path, sizeof(path), "%s/cgi-bin/hello.sh", dir);
+	write_file(path, script, strlen(script), strlen(script), 0755);
+}
+
+int
+main(int argc, char **argv) {
+
+	const char *host;
+	double rate;
+	size_t i;
+	int conns, duration, flag, first, j, port, threads;
+
+	conns = BENCH_CONNS;
+	threads = BENCH_THREADS;
+	duration = BENCH_DURATION;
+	port = BENCH_PORT;
+	host = "127.0.0.1";
+	rate = 0;
+	while ((flag = getopt(argc, argv, "c:d:hi:m:p:r:t:")) != -1) {
+		switch (flag) {
+		case 'c':
+			if ((conns = atoi(optarg)) < 1)
+				usage();
+			break;
+		case 'd':
+			if ((duration = atoi(optarg)) < 1)
+				usage();
+			break;
+		case 'i':
+			host = optarg;
+			break;
+		case 'm':
+			make_root(optarg);
+			exit(EXIT_SUCCESS);
+			/* NOTREACHED */
+		case 'p':
+			if ((port = atoi(optarg)) < 1 || port > 65535)
+				usage();
+			break;
+		case 'r':
+			if ((rate = atof(optarg)) <= 0)
+				usage();
+			break;
+		case 't':
+			if ((threads = atoi(optarg)) < 1)
+				usage();
+			break;
+		case 'h':
+			/* FALLTHROUGH */
+		default:
+			usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+
+	if (threads > conns)
+		threads = conns;
+
+	memset(&server, 0, sizeof(server));
+	server.sin_family = AF_INET;
+	server.sin_port = htons(port);
+	if (inet_pton(AF_INET, host, &server.sin_addr) <= 0) {
+		fprintf(stderr, "Invalid IP\n");
+		exit(EXIT_FAILURE);
+		/* NOTREACHED */
+	}
+
+	for (j = 0; j < argc; j++) {
+		for (i = 0; i < NSCENARIOS; i++)
+			if (strcmp(argv[j], scenarios[i].name) == 0)
+				break;
+		if (i == NSCENARIOS) {
+			fprintf(stderr, "Unknown scenario %s\n", argv[j]);
+			exit(EXIT_FAILURE);
+			/* NOTREACHED */
+		}
+	}
+
+	printf("{\"mode\": \"%s\", \"connections\": %d, \"threads\": %d, "
+		"\"duration\": %d,", (rate > 0) ? "open" : "closed", conns,
+		threads, duration);
+	if (rate > 0)
+		printf(" \"rate\": %.1f,", rate);
+	printf("\n  \"results\": [\n");
+
+	first = 1;
+	for (i = 0; i < NSCENARIOS; i++) {
+		for (j = 0; j < argc; j++)
+			if (strcmp(argv[j], scenarios[i].name) == 0)
+				break;
+		if (argc > 0 && j == argc)
+			continue;
+		if (!first)
+			printf(",\n");
+		first = 0;
+		fflush(stdout);
+		if (run_scenario(&scenarios[i], conns, threads, duration, rate,
+			host) < 0)
+			exit(EXIT_FAILURE);
+	}
+	printf("\n  ]\n}\n");
+
+	return EXIT_SUCCESS;
+}
+
+void
+usage(void) {
+	fprintf(stderr,
+		"usage: sws-bench [-h][-c connections][-d seconds][-i address]\n"
+		"                 [-p port][-r rate][-t threads] [scenario ...]\n"
+		"       sws-bench -m dir\n");
+	exit(EXIT_FAILURE);
+	/* NOTREACHED */
+}
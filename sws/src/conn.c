@@ -0,0 +1,918 @@
+/*
+ * conn.c - Per-connection state
+ *
+ * A connection owns its socket, a receive buffer holding request bytes
+ * that have not been parsed yet, and a queue of pending output. Handlers
+ * never write to the socket directly; they queue output here and the
+ * caller flushes it, either blocking (one process per connection) or as
+ * the socket becomes writable (event loop).
+ */
+#define _GNU_SOURCE
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "conn.h"
+#include "defines.h"
+#include "parse.h"
+#include "request.h"
+#include "response.h"
+#include "server.h"
+#include "stats.h"
+#include "utils.h"
+
+struct conn*
+create_conn(int fd, int blocking) {
+
+	struct conn *conn;
+	struct sockaddr_storage client;
+	socklen_t client_len;
+
+	if ((conn = calloc(1, sizeof(struct conn))) == NULL) {
+		fprintf(stderr, "calloc error\n");
+		return NULL;
+	}
+
+	conn->fd = fd;
+	conn->epfd = -1;
+	conn->blocking = blocking;
+	conn->state = CONN_READING;
+	conn->last_active = time(NULL);
+	conn->accepted = stats_now();
+
+	memset(&client, 0, sizeof(struct sockaddr_storage));
+	client_len = sizeof(client);
+
+	if (getpeername(fd, (struct sockaddr*)&client, &client_len) == -1) {
+		fprintf(stderr, "Unable to get socket name: %s\n",
+			strerror(errno));
+		free(conn);
+		return NULL;
+	}
+
+	if (client.ss_family == AF_INET) {
+		struct sockaddr_in *s = (struct sockaddr_in *)&client;
+		conn->port = ntohs(s->sin_port);
+		if (!inet_ntop(AF_INET, &s->sin_addr, conn->ip,
+			sizeof(conn->ip))) {
+			perror("inet_ntop");
+			free(conn);
+			return NULL;
+		}
+	} else {
+		struct sockaddr_in6 *s = (struct sockaddr_in6*)&client;
+		conn->port = ntohs(s->sin6_port);
+		if (!inet_ntop(AF_INET6, &s->sin6_addr, conn->ip,
+			sizeof(conn->ip))) {
+			perror("inet_ntop");
+			free(conn);
+			return NULL;
+		}
+	}
+
+	if ((conn->req = create_request()) == NULL) {
+		free(conn);
+		return NULL;
+	}
+	if ((conn->resp = create_response()) == NULL) {
+		destroy_request(conn->req);
+		free(conn);
+		return NULL;
+	}
+
+	stats.opened++;
+	return conn;
+}
+
+static void
+free_chunk(struct conn *conn, struct chunk *c) {
+
+	if (c->data)
+		free(c->data);
+	if (c->pipe)
+		conn_unwatch(conn, c->fd);
+	if (c->fd >= 0)
+		close(c->fd);
+	if (c->release)
+		c->release(c->arg);
+	free(c);
+}
+
+void
+destroy_conn(struct conn *conn) {
+
+	struct chunk *c, *next;
+
+	for (c = conn->head; c != NULL; c = next) {
+		next = c->next;
+		free_chunk(conn, c);
+	}
+	if (conn->release != NULL)
+		conn->release(conn->arg);
+
+	destroy_request(conn->req);
+	destroy_response(conn->resp);
+
+	/* A script forked just now may still share the socket */
+	if (conn->epfd >= 0)
+		epoll_ctl(conn->epfd, EPOLL_CTL_DEL, conn->fd, NULL);
+
+	/*
+	 * Discard input the client pipelined past the last response, so that
+	 * close() sends a FIN rather than a reset that could destroy responses
+	 * it has not read yet.
+	 */
+	shutdown(conn->fd, SHUT_WR);
+	while (recv(conn->fd, conn->rbuf, sizeof(conn->rbuf), MSG_DONTWAIT) > 0)
+		;
+	close(conn->fd);
+	free(conn);
+	conn = NULL;
+
+	stats.closed++;
+}
+
+/*
+ * Make room at the end of the receive buffer by discarding the bytes
+ * already parsed.
+ */
+static void
+conn_compact(struct conn *conn) {
+
+	memmove(conn->rbuf, conn->rbuf + conn->rpos, conn->rlen - conn->rpos);
+	conn->rlen -= conn->rpos;
+	conn->rpos = 0;
+}
+
+/*
+ * Prepare a persistent connection for its next request: drop the bytes of
+ * the request just handled, keeping any that were sent after it.
+ */
+void
+conn_reset(struct conn *conn) {
+
+	if (conn->rpos > 0)
+		conn_compact(conn);
+
+	conn->keepalive = 0;
+	conn->state = CONN_READING;
+}
+
+/*
+ * Leave the response to the current request to resume, for a connection
+ * of the event loop. The loop calls it with arg whenever there is an
+ * event for the connection, including one for a descriptor it watches,
+ * until it returns 0, having queued the response, or -1. release frees
+ * arg once the wait is over, or if the connection closes first.
+ */
+void
+conn_suspend(struct conn *conn, int (*resume)(struct conn*, void*),
+	void (*release)(void*), void *arg) {
+
+	conn->resume = resume;
+	conn->release = release;
+	conn->arg = arg;
+	conn->state = CONN_WAITING;
+}
+
+/*
+ * Call the handler of a waiting connection. Returns 1 if it is still
+ * waiting, 0 once the response is queued and -1 on error.
+ */
+int
+conn_resume(struct conn *conn) {
+
+	int rval;
+
+	if ((rval = conn->resume(conn, conn->arg)) != 1) {
+		conn->release(conn->arg);
+		conn->resume = NULL;
+		conn->release = NULL;
+		conn->arg = NULL;
+	}
+
+	return rval;
+}
+
+/*
+ * Have the event loop report events on fd, a pipe or socket the response
+ * depends on, as events for the connection. Does nothing for blocking
+ * connections.
+ */
+int
+conn_watch(struct conn *conn, int fd, int events) {
+
+	struct epoll_event ev;
+
+	if (conn->epfd < 0)
+		return 0;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = events | EPOLLET;
+	ev.data.ptr = conn;
+	if (epoll_ctl(conn->epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+		perror("epoll_ctl");
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Stop watching fd, before it is closed: a script forked meanwhile may
+ * still hold a copy, which would keep it registered.
+ */
+void
+conn_unwatch(struct conn *conn, int fd) {
+
+	if (conn->epfd >= 0)
+		epoll_ctl(conn->epfd, EPOLL_CTL_DEL, fd, NULL);
+}
+
+/*
+ * Wait up to timeout seconds for the next request on a blocking
+ * connection. Returns 1 if input is available, 0 otherwise.
+ */
+int
+conn_wait(struct conn *conn, int timeout) {
+
+	struct pollfd pfd;
+	int n;
+
+	if (conn->rpos < conn->rlen)
+		return 1;
+
+	pfd.fd = conn->fd;
+	pfd.events = POLLIN;
+	while ((n = poll(&pfd, 1, timeout * 1000)) < 0 && errno == EINTR)
+		;
+
+	return n > 0;
+}
+
+/*
+ * Read whatever the (non-blocking) socket has into the receive buffer.
+ * Returns 0 on EOF, -1 on error, 1 otherwise.
+ */
+int
+conn_fill(struct conn *conn) {
+
+	ssize_t n;
+
+	while (conn->rlen < sizeof(conn->rbuf)) {
+		n = recv(conn->fd, conn->rbuf + conn->rlen,
+			sizeof(conn->rbuf) - conn->rlen, 0);
+		if (n < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return 1;
+			if (errno == EINTR)
+				continue;
+			perror("recv");
+			return -1;
+		}
+		if (n == 0)
+			return 0;
+		conn->rlen += n;
+	}
+
+	return 1;
+}
+
+/*
+ * Check whether the receive buffer holds a complete request head: either
+ * a simple (HTTP/0.9) request line, or a request line and headers ended
+ * by an empty line. Returns 1 if so, 0 if more input is needed and -1 if
+ * the buffer is full without a complete request.
+ */
+int
+conn_request_ready(struct conn *conn) {
+
+	char *start, *end, *eol;
+
+	start = conn->rbuf + conn->rpos;
+	end = conn->rbuf + conn->rlen;
+
+	if ((eol = memchr(start, '\n', end - start)) != NULL) {
+		if (memmem(start, eol - start, " HTTP/", 6) == NULL)
+			return 1;
+		if (memmem(start, end - start, CRLF CRLF, 4) != NULL)
+			return 1;
+	}
+
+	if (conn->rlen == sizeof(conn->rbuf))
+		return -1;
+
+	return 0;
+}
+
+/*
+ * Wait up to the keep-alive timeout for more input, and append what the
+ * socket has to the receive buffer, making room in it first. Returns 1
+ * if some arrived, 0 on EOF and -1, with http_status set, on error, on
+ * timeout or if the buffer is full of unparsed input. A connection that
+ * is not blocking does not wait, but returns CONN_AGAIN.
+ */
+static int
+conn_more(struct conn *conn) {
+
+	struct pollfd pfd;
+	ssize_t n;
+
+	if (conn->rlen == sizeof(conn->rbuf)) {
+		if (conn->rpos == 0) {
+			http_status = STATUS_400;
+			return -1;
+		}
+		conn_compact(conn);
+	}
+
+	while (1) {
+		n = recv(conn->fd, conn->rbuf + conn->rlen,
+			sizeof(conn->rbuf) - conn->rlen, 0);
+		if (n > 0) {
+			conn->rlen += n;
+			return 1;
+		}
+		if (n == 0)
+			return 0;
+		if (errno == EINTR)
+			continue;
+		if (errno != EAGAIN && errno != EWOULDBLOCK) {
+			perror("recv");
+			http_status = STATUS_500;
+			return -1;
+		}
+		if (!conn->blocking)
+			return CONN_AGAIN;
+
+		pfd.fd = conn->fd;
+		pfd.events = POLLIN;
+		if ((n = poll(&pfd, 1, __sws_timeout * 1000)) == 0) {
+			http_status = STATUS_400;
+			return -1;
+		}
+		if (n < 0 && errno != EINTR) {
+			perror("poll");
+			http_status = STATUS_500;
+			return -1;
+		}
+	}
+}
+
+/*
+ * Point *line at the next line of the request, NUL-terminated in place
+ * with its CRLF stripped. The line is a slice of the receive buffer and
+ * is only valid until the next call. More input is read whenever the
+ * buffer holds no complete line. Returns the number of bytes consumed
+ * including the CRLF, 0 on EOF, -1 on error and CONN_AGAIN, having
+ * consumed nothing, if a non-blocking socket has not sent the rest yet.
+ */
+int
+conn_recv_line(struct conn *conn, char **line) {
+
+	char *start, *eol;
+	ssize_t n;
+
+	/* glibc's memchr already scans a vector register at a time */
+	while ((eol = memchr(conn->rbuf + conn->rpos, '\n',
+		conn->rlen - conn->rpos)) == NULL) {
+		if ((n = conn_more(conn)) < 0)
+			return n;
+		if (n == 0) {
+			if (conn->rpos == conn->rlen)
+				return 0;
+			http_status = STATUS_400;
+			return -1;
+		}
+	}
+
+	start = conn->rbuf + conn->rpos;
+	if (eol == start || eol[-1] != '\r') {
+		http_status = STATUS_400;
+		return -1;
+	}
+
+	eol[-1] = '\0';
+	*line = start;
+	n = eol - start + 1;
+	conn->rpos += n;
+
+	return n;
+}
+
+/*
+ * Read the body of req through the receive buffer, and hand it to sink a
+ * piece at a time as it arrives, undoing any chunked coding. sink returns
+ * how much of a piece it took, which is less than all of it once it can
+ * take no more for now, or -1 if it fails, after which the rest of the
+ * body is read and thrown away, so the connection stays in step with the
+ * client. A blocking connection waits for the whole body. Otherwise the
+ * reading stops where the socket has nothing more or sink is full, to
+ * carry on from there, as recorded in req, when called again. Returns 0
+ * once the whole body has been read, 1 if it stopped short and -1, with
+ * http_status set, on error.
+ */
+int
+conn_read_body(struct conn *conn, struct request *req,
+	ssize_t (*sink)(void*, const char*, size_t), void *arg) {
+
+	size_t len;
+	ssize_t n;
+	int rval;
+	char *line;
+
+	while (req->unread) {
+		if (req->body_state != BODY_DATA) {
+			if ((rval = conn_recv_line(conn, &line)) == CONN_AGAIN)
+				return 1;
+			if (rval <= 0)
+				goto bad;
+
+			if (req->body_state == BODY_SIZE) {
+				if (sws_parse_chunk_size(line, &req->left) < 0)
+					goto bad;
+				req->body_state = req->left > 0
+					? BODY_DATA : BODY_TRAILER;
+			} else if (req->body_state == BODY_DATA_END) {
+				/* Data of a chunk is followed by an empty line */
+				if (*line != '\0')
+					goto bad;
+				req->body_state = BODY_SIZE;
+			} else if (*line == '\0') {
+				/* The end of the trailer, whose fields are ignored */
+				req->unread = 0;
+			}
+			continue;
+		}
+
+		if (conn->rpos == conn->rlen) {
+			if ((rval = conn_more(conn)) == CONN_AGAIN)
+				return 1;
+			if (rval <= 0)
+				goto bad;
+		}
+
+		len = conn->rlen - conn->rpos;
+		if (len > req->left)
+			len = req->left;
+		if (!req->discard) {
+			if ((n = sink(arg, conn->rbuf + conn->rpos, len)) == 0)
+				return 1;
+			if (n < 0)
+				req->discard = 1;
+			else
+				len = n;
+		}
+		conn->rpos += len;
+		req->left -= len;
+		if (req->left == 0) {
+			if (req->chunked)
+				req->body_state = BODY_DATA_END;
+			else
+				req->unread = 0;
+		}
+	}
+
+	return 0;
+
+bad:
+	if (http_status == STATUS_200)
+		http_status = STATUS_400;
+	return -1;
+}
+
+static struct chunk*
+new_chunk(size_t cap) {
+
+	struct chunk *c;
+
+	if ((c = calloc(1, sizeof(struct chunk))) == NULL) {
+		fprintf(stderr, "calloc error\n");
+		return NULL;
+	}
+	c->fd = -1;
+
+	if (cap > 0 && (c->data = malloc(cap)) == NULL) {
+		fprintf(stderr, "malloc error\n");
+		free(c);
+		return NULL;
+	}
+	c->cap = cap;
+
+	return c;
+}
+
+static void
+append_chunk(struct conn *conn, struct chunk *c) {
+
+	if (conn->tail == NULL)
+		conn->head = c;
+	else
+		conn->tail->next = c;
+	conn->tail = c;
+}
+
+/*
+ * Reserve len bytes at the end of the output queue for the caller to fill
+ * in. Small writes are appended to the last memory chunk so headers and
+ * short bodies go out together.
+ */
+char*
+conn_reserve(struct conn *conn, size_t len) {
+
+	struct chunk *c;
+	char *p;
+
+	c = conn->tail;
+	if (c == NULL || c->fd >= 0 || c->fill != NULL
+		|| c->cap - c->len < len) {
+		if ((c = new_chunk(len > CHUNK_SIZE ? len : CHUNK_SIZE)) == NULL)
+			return NULL;
+		append_chunk(conn, c);
+	}
+
+	p = c->data + c->len;
+	c->len += len;
+
+	return p;
+}
+
+/*
+ * Queue a copy of buf for sending.
+ */
+int
+conn_write(struct conn *conn, const char *buf, size_t len) {
+
+	char *p;
+
+	if ((p = conn_reserve(conn, len)) == NULL)
+		return -1;
+	memcpy(p, buf, len);
+
+	return 0;
+}
+
+/*
+ * Queue len bytes of fd starting at off. The connection takes ownership of
+ * fd and closes it once sent.
+ */
+int
+conn_queue_file(struct conn *conn, int fd, off_t off, off_t len) {
+
+	struct chunk *c;
+
+	if ((c = new_chunk(0)) == NULL)
+		return -1;
+
+	c->fd = fd;
+	c->foff = off;
+	c->flen = len;
+	append_chunk(conn, c);
+
+	return 0;
+}
+
+/*
+ * Queue a body produced piece by piece by fill into a buffer of cap
+ * bytes. The connection calls release on arg once the chunk is done with,
+ * or at once if it cannot be queued.
+ */
+int
+conn_queue_gen(struct conn *conn, size_t cap, chunk_fill fill,
+	void (*release)(void*), void *arg) {
+
+	struct chunk *c;
+
+	if ((c = new_chunk(cap)) == NULL) {
+		release(arg);
+		return -1;
+	}
+
+	c->fill = fill;
+	c->release = release;
+	c->arg = arg;
+	append_chunk(conn, c);
+
+	return 0;
+}
+
+/*
+ * Queue what is written to the pipe fd from now until it is closed, as
+ * chunked frames if framing is PIPE_CHUNKED. The connection takes
+ * ownership of fd. The event loop watches it, so the output is forwarded
+ * as it arrives rather than as the socket drains.
+ */
+int
+conn_queue_pipe(struct conn *conn, int fd, int framing) {
+
+	struct chunk *c;
+
+	if ((c = new_chunk(0)) == NULL)
+		return -1;
+
+	if (conn_watch(conn, fd, EPOLLIN) < 0) {
+		free(c);
+		return -1;
+	}
+
+	c->fd = fd;
+	c->pipe = framing;
+	append_chunk(conn, c);
+
+	return 0;
+}
+
+/*
+ * Copy a file chunk through a userspace buffer, for files sendfile()
+ * cannot handle.
+ */
+static ssize_t
+copy_file_chunk(int sock, struct chunk *c) {
+
+	ssize_t n, sent;
+	char buf[BUFF_SIZE];
+
+	n = c->flen < (off_t)sizeof(buf) ? c->flen : (off_t)sizeof(buf);
+	if ((n = pread(c->fd, buf, n, c->foff)) <= 0) {
+		if (n == 0)
+			errno = EIO;
+		return -1;
+	}
+
+	if ((sent = send(sock, buf, n, MSG_NOSIGNAL)) > 0) {
+		c->foff += sent;
+		c->flen -= sent;
+	}
+
+	return sent;
+}
+
+/*
+ * Hand a file chunk to the kernel with sendfile(), which advances foff
+ * itself, so the file never passes through userspace.
+ */
+static ssize_t
+send_file_chunk(int sock, struct chunk *c) {
+
+	ssize_t sent;
+
+	if ((sent = sendfile(sock, c->fd, &c->foff, c->flen)) < 0) {
+		if (errno == EINVAL || errno == ENOSYS)
+			return copy_file_chunk(sock, c);
+		return -1;
+	}
+
+	if (sent == 0) {
+		/* File shrank since it was queued */
+		errno = EIO;
+		return -1;
+	}
+	c->flen -= sent;
+
+	return sent;
+}
+
+/*
+ * Put a memory chunk holding len bytes of buf at the head of the queue,
+ * in place of c if replace is set, before it otherwise.
+ */
+static int
+push_chunk(struct conn *conn, struct chunk *c, const char *buf, size_t len,
+	int replace) {
+
+	struct chunk *m;
+
+	if ((m = new_chunk(len)) == NULL) {
+		errno = ENOMEM;
+		return -1;
+	}
+	memcpy(m->data, buf, len);
+	m->len = len;
+
+	if (replace) {
+		m->next = c->next;
+		if (conn->tail == c)
+			conn->tail = m;
+		free_chunk(conn, c);
+	} else
+		m->next = c;
+	conn->head = m;
+
+	return 0;
+}
+
+/*
+ * Forward the output waiting in the pipe of the chunk at the head of the
+ * queue with splice(), so it never passes through userspace. Each frame
+ * covers what the pipe held when it was started, its size line queued
+ * ahead of it. The chunk is replaced by the last frame at EOF. Returns
+ * the bytes sent, 0 if the queue changed instead, or -1 and EAGAIN if
+ * neither the pipe nor the socket is ready.
+ */
+static ssize_t
+send_pipe_chunk(struct conn *conn, struct chunk *c) {
+
+	struct pollfd pfd;
+	ssize_t n;
+	char *p;
+	char line[32];
+	int avail;
+
+	if (c->flen == 0) {
+		if (ioctl(c->fd, FIONREAD, &avail) < 0)
+			return -1;
+		if (avail == 0) {
+			/* Only blocking connections wait for the script */
+			pfd.fd = c->fd;
+			pfd.events = POLLIN;
+			while ((n = poll(&pfd, 1, conn->blocking ? -1 : 0)) < 0
+				&& errno == EINTR)
+				;
+			if (n < 0)
+				return -1;
+			if (n == 0) {
+				errno = EAGAIN;
+				return -1;
+			}
+			if (ioctl(c->fd, FIONREAD, &avail) < 0)
+				return -1;
+		}
+
+		p = line;
+		if (c->pipe == PIPE_CHUNKED && c->foff > 0)
+			p = PUT_LITERAL(p, CRLF);
+
+		if (avail == 0) {
+			/* EOF */
+			if (c->pipe == PIPE_CHUNKED)
+				p = PUT_LITERAL(p, "0" CRLF CRLF);
+			if (p > line)
+				return push_chunk(conn, c, line, p - line, 1);
+			conn->head = c->next;
+			if (conn->head == NULL)
+				conn->tail = NULL;
+			free_chunk(conn, c);
+			return 0;
+		}
+
+		c->flen = avail;
+		if (c->pipe == PIPE_CHUNKED) {
+			p = put_hex(p, avail);
+			p = PUT_LITERAL(p, CRLF);
+			return push_chunk(conn, c, line, p - line, 0);
+		}
+	}
+
+	if ((n = splice(c->fd, NULL, conn->fd, NULL, c->flen,
+		SPLICE_F_MOVE | SPLICE_F_NONBLOCK)) == 0) {
+		errno = EIO;
+		return -1;
+	}
+	if (n > 0) {
+		c->flen -= n;
+		c->foff += n;
+	}
+
+	return n;
+}
+
+/*
+ * Send the run of memory chunks at the head of the queue with a single
+ * writev, so the responses to pipelined requests share one syscall.
+ */
+static ssize_t
+send_mem_chunks(int sock, struct chunk *c) {
+
+	struct iovec iov[IOV_BATCH];
+	struct msghdr msg;
+	int n, flags;
+
+	flags = MSG_NOSIGNAL;
+	for (n = 0; c != NULL && c->fd < 0 && n < IOV_BATCH; c = c->next) {
+		if (c->off < c->len) {
+			iov[n].iov_base = c->data + c->off;
+			iov[n].iov_len = c->len - c->off;
+			n++;
+		}
+		/* Nothing behind a generator goes out before it is done */
+		if (c->fill != NULL)
+			break;
+	}
+
+	if (n == 0)
+		return 0;
+
+	/*
+	 * Headers followed by a file body are corked with MSG_MORE, so they
+	 * leave in the same segments as the start of the sendfile() data.
+	 * So are chunk-size lines, but not headers that would wait on a pipe.
+	 */
+	if (c != NULL && c->fd >= 0 && (!c->pipe || c->flen > 0))
+		flags |= MSG_MORE;
+
+	/* sendmsg is writev with flags */
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = iov;
+	msg.msg_iovlen = n;
+
+	return sendmsg(sock, &msg, flags);
+}
+
+/*
+ * Send as much queued output as the socket accepts. Returns 0 once the
+ * queue is empty, 1 if the socket, or the source of a generated body,
+ * would block and -1 on error.
+ */
+int
+conn_flush(struct conn *conn) {
+
+	struct chunk *c;
+	ssize_t n;
+	size_t left;
+
+	while ((c = conn->head) != NULL) {
+		if (c->fill != NULL && c->off == c->len) {
+			if ((n = c->fill(c->arg, c->data, c->cap)) < 0) {
+				if (errno != EAGAIN)
+					return -1;
+				c->stalled = 1;
+				return 1;
+			}
+			c->stalled = 0;
+			if (n == 0) {
+				conn->head = c->next;
+				if (conn->head == NULL)
+					conn->tail = NULL;
+				free_chunk(conn, c);
+				continue;
+			}
+			c->off = 0;
+			c->len = n;
+		}
+
+		/* A pipe chunk retires itself, so may be gone once it has sent */
+		if (c->pipe) {
+			if ((n = send_pipe_chunk(conn, c)) >= 0) {
+				stats.bytes += n;
+				continue;
+			}
+		} else if (c->fd >= 0)
+			n = c->flen > 0 ? send_file_chunk(conn->fd, c) : 0;
+		else
+			n = send_mem_chunks(conn->fd, c);
+
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return 1;
+			perror("send");
+			return -1;
+		}
+		stats.bytes += n;
+
+		/* Retire everything that went out completely */
+		if (c->fd < 0) {
+			for (; c != NULL && c->fd < 0; c = conn->head) {
+				left = c->len - c->off;
+				if ((size_t)n < left) {
+					c->off += n;
+					break;
+				}
+				n -= left;
+				if (c->fill != NULL) {
+					/* Refilled on the next pass */
+					c->off = c->len;
+					break;
+				}
+				conn->head = c->next;
+				if (conn->head == NULL)
+					conn->tail = NULL;
+				free_chunk(conn, c);
+			}
+		} else if (c->flen == 0) {
+			conn->head = c->next;
+			if (conn->head == NULL)
+				conn->tail = NULL;
+			free_chunk(conn, c);
+		}
+	}
+
+	stats_sent(&conn->req->trace, conn->req->method_line);
+	return 0;
+}
@@ -0,0 +1,127 @@
+#ifndef _CONN_H_
+#define _CONN_H_
+
+#include <arpa/inet.h>
+#include <sys/types.h>
+
+#include <time.h>
+
+#include "defines.h"
+#include "request.h"
+#include "response.h"
+
+/* Connection states */
+#define CONN_READING 0
+#define CONN_WRITING 1
+#define CONN_CLOSING 2
+#define CONN_WAITING 3
+
+/* Returned by reads that would have to wait on a non-blocking socket */
+#define CONN_AGAIN -2
+
+/* Minimum size of an output buffer chunk */
+#define CHUNK_SIZE 4096
+
+/* Most memory chunks gathered into one writev */
+#define IOV_BATCH 64
+
+/* Most pipelined requests answered before their responses are flushed */
+#define PIPELINE_MAX 32
+
+/* How a pipe chunk frames what it forwards */
+#define PIPE_RAW 1
+#define PIPE_CHUNKED 2
+
+/*
+ * Produces the next piece of a generated body into buf, which holds cap
+ * bytes. Returns its length, 0 once the body is complete or -1 on error,
+ * with errno EAGAIN if the body comes from a descriptor that has nothing
+ * more yet (which the producer has the event loop watch).
+ */
+typedef ssize_t (*chunk_fill)(void*, char*, size_t);
+
+/*
+ * A piece of pending output. Memory chunks own their data; file chunks
+ * own an open fd and describe the byte range still to be sent from it.
+ * Generator chunks are memory chunks that refill their buffer from fill
+ * each time it has been sent, so long bodies need not be held in memory;
+ * stalled is set while fill is waiting on its source.
+ * Pipe chunks own the read end of a pipe and forward whatever comes out
+ * of it until EOF, as it arrives; foff counts the bytes forwarded, and
+ * flen what is left of the current chunked frame.
+ */
+struct chunk {
+	struct chunk *next;
+	char *data;
+	size_t cap;
+	size_t len;
+	size_t off;
+	int fd;
+	off_t foff;
+	off_t flen;
+	chunk_fill fill;
+	int stalled;
+	int pipe;
+	void (*release)(void*);
+	void *arg;
+};
+
+struct conn {
+	int fd;
+	int state;
+	int blocking;
+	int keepalive;
+	int eof;
+	int nrequests;
+	time_t last_active;
+	/* stats_now() at accept */
+	unsigned long accepted;
+	int port;
+	char ip[INET6_ADDRSTRLEN];
+	char rbuf[BUFF_SIZE];
+	size_t rlen;
+	size_t rpos;
+	struct chunk *head;
+	struct chunk *tail;
+	struct request *req;
+	struct response *resp;
+	/*
+	 * While CONN_WAITING, the response to the current request waits on
+	 * something other than the socket, and resume is called with arg
+	 * until it is queued (see conn_suspend())
+	 */
+	int (*resume)(struct conn*, void*);
+	void (*release)(void*);
+	void *arg;
+	/* Event loop's epoll instance, watching queued pipes too; -1 if none */
+	int epfd;
+	/* Event loop's list of connections, least recently active first */
+	struct conn *prev;
+	struct conn *next;
+};
+
+struct conn* create_conn(int, int);
+void destroy_conn(struct conn*);
+void conn_reset(struct conn*);
+int conn_wait(struct conn*, int);
+
+void conn_suspend(struct conn*, int (*)(struct conn*, void*),
+	void (*)(void*), void*);
+int conn_resume(struct conn*);
+int conn_watch(struct conn*, int, int);
+void conn_unwatch(struct conn*, int);
+
+int conn_fill(struct conn*);
+int conn_request_ready(struct conn*);
+int conn_recv_line(struct conn*, char**);
+int conn_read_body(struct conn*, struct request*,
+	ssize_t (*)(void*, const char*, size_t), void*);
+
+char* conn_reserve(struct conn*, size_t);
+int conn_write(struct conn*, const char*, size_t);
+int conn_queue_file(struct conn*, int, off_t, off_t);
+int conn_queue_gen(struct conn*, size_t, chunk_fill, void (*)(void*), void*);
+int conn_queue_pipe(struct conn*, int, int);
+int conn_flush(struct conn*);
+
+#endif
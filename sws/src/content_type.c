@@ -1,138 +1,233 @@
+/*
+ * content_type.c - Mapping of file extensions to content types
+ *
+ * Types are read at startup from CTYPES_FILE, which uses the mime.types
+ * format: a content type followed by its extensions on each line, with
+ * '#' starting a comment. Extensions are kept in a hash table, so looking
+ * one up costs the same with a full mime.types as with a handful of
+ * types. Extensions are matched without regard to case.
+ */
+#include <ctype.h>
 #include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 
 #include "content_type.h"
 #include "defines.h"
 
-struct content_type*
-new_content_type() {
+#define CTYPES_DELIM " \t\r\n"
 
-	struct content_type *ctypeptr;
+static unsigned int
+ext_hash(const char *ext) {
 
-	if ((ctypeptr = malloc(sizeof(struct content_type))) == NULL) {
-		fprintf(stderr, "malloc error\n");
+	unsigned int hash;
+
+	for (hash = 2166136261u; *ext != '\0'; ext++) {
+		hash ^= (unsigned char)tolower((unsigned char)*ext);
+		hash *= 16777619u;
+	}
+
+	return hash;
+}
+
+/*
+ * Return the slot holding ext, or the empty slot where it belongs.
+ */
+static struct ctype_entry*
+find_slot(struct ctype_table *table, const char *ext, unsigned int hash) {
+
+	struct ctype_entry *e;
+	size_t i;
+
+	for (i = hash & (table->size - 1); ; i = (i + 1) & (table->size - 1)) {
+		e = &table->slots[i];
+		if (e->ext == NULL)
+			return e;
+		if (e->hash == hash && strcasecmp(e->ext, ext) == 0)
+			return e;
+	}
+	/* NOTREACHED */
+}
+
+static int
+grow_table(struct ctype_table *table) {
+
+	struct ctype_entry *old, *e;
+	size_t i, size;
+
+	old = table->slots;
+	size = table->size;
+
+	if ((table->slots = calloc(size * 2,
+		sizeof(struct ctype_entry))) == NULL) {
+		fprintf(stderr, "calloc error\n");
+		table->slots = old;
+		return -1;
+	}
+	table->size = size * 2;
+
+	for (i = 0; i < size; i++) {
+		if (old[i].ext == NULL)
+			continue;
+		e = find_slot(table, old[i].ext, old[i].hash);
+		*e = old[i];
+	}
+	free(old);
+
+	return 0;
+}
+
+struct ctype_table*
+create_ctype_table(void) {
+
+	struct ctype_table *table;
+
+	if ((table = calloc(1, sizeof(struct ctype_table))) == NULL) {
+		fprintf(stderr, "calloc error\n");
+		return NULL;
+	}
+
+	table->size = CTYPES_SLOTS;
+	if ((table->slots = calloc(table->size,
+		sizeof(struct ctype_entry))) == NULL) {
+		fprintf(stderr, "calloc error\n");
+		free(table);
 		return NULL;
 	}
-	ctypeptr->ctype = NULL;
-	ctypeptr->exts = NULL;
-	return ctypeptr;
+
+	return table;
 }
 
-void
-delete_content_type(struct content_type *ctypeptr) {
+/*
+ * Map ext to ctype. A later mapping for the same extension replaces an
+ * earlier one.
+ */
+static int
+add_extension(struct ctype_table *table, const char *ext, char *ctype) {
 
-	if (ctypeptr->ctype)
-		free(ctypeptr->ctype);
-	clear_list(ctypeptr->exts);
+	struct ctype_entry *e;
+	unsigned int hash;
 
-	free(ctypeptr);
-	ctypeptr = NULL;
+	if ((table->count + 1) * 2 > table->size && grow_table(table) < 0)
+		return -1;
+
+	hash = ext_hash(ext);
+	e = find_slot(table, ext, hash);
+	if (e->ext == NULL) {
+		if ((e->ext = strdup(ext)) == NULL) {
+			fprintf(stderr, "strdup error\n");
+			return -1;
+		}
+		e->hash = hash;
+		table->count++;
+	}
+	e->ctype = ctype;
+
+	return 0;
+}
+
+static char*
+add_type(struct ctype_table *table, const char *type) {
+
+	char **types;
+	char *ctype;
+
+	if ((types = realloc(table->types,
+		(table->ntypes + 1) * sizeof(char*))) == NULL) {
+		fprintf(stderr, "realloc error\n");
+		return NULL;
+	}
+	table->types = types;
+
+	if ((ctype = strdup(type)) == NULL) {
+		fprintf(stderr, "strdup error\n");
+		return NULL;
+	}
+	table->types[table->ntypes++] = ctype;
+
+	return ctype;
 }
 
 int
-load_content_types(struct list *ctypes) {
+load_content_types(struct ctype_table *table) {
 
 	FILE *file;
-	struct content_type *ctypeptr;
-	struct node *nodeptr;
 	size_t len;
-	int n;
-	char *buf, *buf2;
-	char *tmp;
+	ssize_t n;
+	int rval;
+	char *buf, *ctype;
 	char *saveptr, *token;
 
-	len = BUFF_SIZE;
-	if ((buf = malloc(BUFF_SIZE)) == NULL) {
-		fprintf(stderr, "malloc error\n");
-		return -1;
-	}
-
 	if ((file = fopen(CTYPES_FILE, "r")) == NULL) {
 		perror("fopen");
 		return -1;
 	}
 
-	while ((n = getline(&buf, &len, file)) > 0) {
-		if ((ctypeptr = new_content_type()) == NULL)
-			return -1;
-		if ((nodeptr = create_node(ctypeptr)) == NULL)
-			return -1;
-		buf2 = buf;
-		token = strtok_r(buf2, " ", &saveptr);
-		if ((ctypeptr->ctype = malloc(strlen(token)+1)) == NULL) {
-			fprintf(stderr, "malloc error\n");
-			return -1;
+	buf = NULL;
+	len = 0;
+	rval = 0;
+	errno = 0;
+	while (rval == 0 && (n = getline(&buf, &len, file)) > 0) {
+		if ((token = strchr(buf, '#')) != NULL)
+			*token = '\0';
+		if ((token = strtok_r(buf, CTYPES_DELIM, &saveptr)) == NULL)
+			continue;
+		if ((ctype = add_type(table, token)) == NULL) {
+			rval = -1;
+			break;
 		}
-		strncpy(ctypeptr->ctype, token, strlen(token));
-		append_to_list(ctypes, nodeptr);
-		ctypeptr->exts = create_list();
-		while (1) {
-			buf2 = NULL;
-			token = strtok_r(buf2, " ", &saveptr);
-			if (token == NULL)
+
+		while ((token = strtok_r(NULL, CTYPES_DELIM, &saveptr)) != NULL) {
+			if ((rval = add_extension(table, token, ctype)) < 0)
 				break;
-			//add token to extension list
-			if ((tmp = malloc(strlen(token)+1)) == NULL) {
-				fprintf(stderr, "malloc error\n");
-				return -1;
-			}
-			strncpy(tmp, token, strlen(token));
-			if (tmp[strlen(tmp)-1] == '\n')
-				tmp[strlen(tmp)-1] = '\0';
-			if ((nodeptr = create_node(tmp)) == NULL)
-				return -1;
-			append_to_list(ctypeptr->exts, nodeptr);
 		}
 	}
 
-	if (n == -1 && errno) {
+	if (rval == 0 && n == -1 && errno) {
 		perror("getline");
-		return -1;
+		rval = -1;
 	}
 
-	return 0;
+	free(buf);
+	fclose(file);
+
+	return rval;
 }
 
+/*
+ * Return the content type for a file extension, without the dot, or
+ * text/plain if it has none or is unknown.
+ */
 char*
-get_content_type(struct list *ctypes, char *file) {
+get_content_type(struct ctype_table *table, char *ext) {
 
-	struct content_type *ctmp;
-	struct node *nodeptr, *nodeptr2;
+	struct ctype_entry *e;
 
-	if (file == NULL)
+	if (ext == NULL)
 		return "text/plain";
 
-	nodeptr = ctypes->head;
-	while (nodeptr != NULL) {
-		ctmp = (struct content_type*)nodeptr->data;
-		nodeptr2 = ctmp->exts->head;
-		while (nodeptr2 != NULL) {
-			//printf("%s|%s\n", (char*)nodeptr2->data, file);
-			if (strcmp((char*)nodeptr2->data,
-				file) == 0)
-				return ctmp->ctype;
-			nodeptr2 = nodeptr2->next;
-		}
-		nodeptr = nodeptr->next;
-	}
+	e = find_slot(table, ext, ext_hash(ext));
+	if (e->ext == NULL)
+		return "text/plain";
 
-	return "text/plain";
+	return e->ctype;
 }
 
 void
-free_content_types(struct list *ctypes) {
+free_content_types(struct ctype_table *table) {
 
-	struct content_type *ctmp;
-	struct node *nodeptr;
+	size_t i;
 
-	nodeptr = ctypes->head;
-	while (nodeptr != NULL) {
-		ctmp = (struct content_type*)nodeptr->data;
-		delete_content_type(ctmp);
-		nodeptr = nodeptr->next;
-	}
+	if (table == NULL)
+		return;
 
-	clear_list(ctypes);
+	for (i = 0; i < table->size; i++)
+		free(table->slots[i].ext);
+	for (i = 0; i < table->ntypes; i++)
+		free(table->types[i]);
+	free(table->slots);
+	free(table->types);
+	free(table);
 }
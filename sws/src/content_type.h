@@ -1,26 +1,38 @@
 #ifndef _CONTENT_TYPE_H_
 #define _CONTENT_TYPE_H_
 
+#include <stddef.h>
+
 #define CTYPES_FILE "content_types"
 
-#include "list.h"
+/* Initial number of slots in the extension table, a power of two */
+#define CTYPES_SLOTS 256
 
-/*struct extension {
+/* An extension and the content type it maps to */
+struct ctype_entry {
 	char *ext;
-} extension;*/
-
-struct content_type {
 	char *ctype;
-	struct list *exts;
-	//struct extension *ext;
-} content_type;
+	unsigned int hash;
+};
+
+/*
+ * Open addressing hash table of extensions, kept at most half full. The
+ * content type strings are shared by their extensions and owned by the
+ * types array.
+ */
+struct ctype_table {
+	struct ctype_entry *slots;
+	size_t size;
+	size_t count;
+	char **types;
+	size_t ntypes;
+};
 
-struct content_type* new_content_type();
-void delete_content_type(struct content_type*);
-int load_content_types(struct list*);
-char *get_content_type(struct list*, char*);
-void free_content_types(struct list*);
+struct ctype_table* create_ctype_table(void);
+int load_content_types(struct ctype_table*);
+char *get_content_type(struct ctype_table*, char*);
+void free_content_types(struct ctype_table*);
 
-extern struct list *ctypes;
+extern struct ctype_table *ctypes;
 
 #endif
@@ -0,0 +1,150 @@
+/*
+ * date.c - Cached current date
+ *
+ * Every response carries the current date in a Date header, and every
+ * log line carries it too. The formatted date only changes once a second,
+ * so it is kept here and reformatted when the second changes; time() is
+ * answered from the vDSO without entering the kernel.
+ *
+ * Dates sent by clients, in any of the three formats HTTP allows, are
+ * parsed here too, without strptime() or touching the time zone.
+ */
+#define _DEFAULT_SOURCE
+
+#include <string.h>
+#include <time.h>
+
+#include "date.h"
+#include "defines.h"
+
+static time_t date_time = -1;
+static char date[64];
+
+/*
+ * Return the current time as an RFC 1123 date, HTTP_DATE_LEN characters
+ * long. The string is overwritten when the second changes.
+ */
+const char*
+http_date(void) {
+
+	time_t now;
+
+	if ((now = time(NULL)) != date_time || date[0] == '\0') {
+		strftime(date, sizeof(date), RFC1123_DATE, gmtime(&now));
+		date_time = now;
+	}
+
+	return date;
+}
+
+static const char months[] = "JanFebMarAprMayJunJulAugSepOctNovDec";
+
+/*
+ * Parse exactly n digits at *p into *v and advance *p past them.
+ */
+static int
+parse_digits(const char **p, int n, int *v) {
+
+	for (*v = 0; n > 0; n--, (*p)++) {
+		if (**p < '0' || **p > '9')
+			return -1;
+		*v = *v * 10 + (**p - '0');
+	}
+
+	return 0;
+}
+
+static int
+parse_month(const char **p, int *mon) {
+
+	const char *m;
+
+	if (strlen(*p) < 3)
+		return -1;
+	for (m = months; *m != '\0'; m += 3) {
+		if (strncmp(*p, m, 3) == 0) {
+			*mon = (m - months) / 3;
+			*p += 3;
+			return 0;
+		}
+	}
+
+	return -1;
+}
+
+/* "08:49:37" */
+static int
+parse_clock(const char **p, struct tm *tm) {
+
+	if (parse_digits(p, 2, &tm->tm_hour) < 0 || *(*p)++ != ':'
+		|| parse_digits(p, 2, &tm->tm_min) < 0 || *(*p)++ != ':'
+		|| parse_digits(p, 2, &tm->tm_sec) < 0)
+		return -1;
+
+	return 0;
+}
+
+/*
+ * Parse an HTTP date in RFC 1123 ("Sun, 06 Nov 1994 08:49:37 GMT"),
+ * RFC 850 ("Sunday, 06-Nov-94 08:49:37 GMT") or asctime() ("Sun Nov  6
+ * 08:49:37 1994") format. Returns -1 if s is none of them.
+ */
+time_t
+http_parse_date(const char *s) {
+
+	struct tm tm;
+	const char *p;
+
+	memset(&tm, 0, sizeof(tm));
+
+	/* The weekday is redundant */
+	for (p = s; (*p >= 'A' && *p <= 'Z') || (*p >= 'a' && *p <= 'z'); p++)
+		;
+
+	if (*p == ',') {
+		if (*++p != ' ')
+			return -1;
+		p++;
+		/* The separator after the day tells the two formats apart */
+		if (parse_digits(&p, 2, &tm.tm_mday) < 0)
+			return -1;
+		if (*p == ' ') {
+			/* RFC 1123 */
+			p++;
+			if (parse_month(&p, &tm.tm_mon) < 0 || *p++ != ' '
+				|| parse_digits(&p, 4, &tm.tm_year) < 0)
+				return -1;
+			tm.tm_year -= 1900;
+		} else {
+			/* RFC 850, whose two-digit years are 1970 to 2069 */
+			if (*p++ != '-'
+				|| parse_month(&p, &tm.tm_mon) < 0 || *p++ != '-'
+				|| parse_digits(&p, 2, &tm.tm_year) < 0)
+				return -1;
+			if (tm.tm_year < 70)
+				tm.tm_year += 100;
+		}
+		if (*p++ != ' ' || parse_clock(&p, &tm) < 0
+			|| strcmp(p, " GMT") != 0)
+			return -1;
+	} else {
+		/* asctime(), with a space padded day */
+		if (*p++ != ' ' || parse_month(&p, &tm.tm_mon) < 0
+			|| *p++ != ' ')
+			return -1;
+		if (*p == ' ')
+			p++;
+		if (parse_digits(&p, (p[1] == ' ') ? 1 : 2, &tm.tm_mday) < 0
+			|| *p++ != ' ' || parse_clock(&p, &tm) < 0
+			|| *p++ != ' ' || parse_digits(&p, 4, &tm.tm_year) < 0
+			|| *p != '\0')
+			return -1;
+		tm.tm_year -= 1900;
+	}
+
+	if (tm.tm_mday < 1 || tm.tm_mday > 31 || tm.tm_hour > 23
+		|| tm.tm_min > 59 || tm.tm_sec > 60)
+		return -1;
+
+	return timegm(&tm);
+}
@@ -0,0 +1,12 @@
+#ifndef _DATE_H_
+#define _DATE_H_
+
+#include <time.h>
+
+/* Length of an RFC 1123 date */
+#define HTTP_DATE_LEN 29
+
+const char* http_date(void);
+time_t http_parse_date(const char*);
+
+#endif
@@ -1,22 +1,40 @@
 #ifndef _DEFINES_H_
 #define _DEFINES_H_
 
+#include <stddef.h>
+
 #define BUFF_SIZE 8096
 
+/* Persistent connection defaults */
+#define KEEPALIVE_TIMEOUT 5
+#define KEEPALIVE_MAX 100
+
+/* Seconds a response may wait on a script that sends nothing */
+#define SCRIPT_TIMEOUT 30
+
 #define RFC1123_DATE "%a, %d %b %Y %T GMT"
-#define RFC850_DATE "%A, %d-%b-%y %T GMT"
-#define ASCTIME_DATE "%a %b %e %T %Y"
 
 #define CRLF "\r\n"
 
-#define STATUS_200 "200 OK"
-#define STATUS_304 "304 Not Modified"
-#define STATUS_400 "400 Bad Request"
-#define STATUS_403 "403 Forbidden"
-#define STATUS_404 "404 Not Found"
-#define STATUS_500 "500 Internal Server Error"
-#define STATUS_501 "501 Not Implemented"
+/* Response statuses, indexing status_lines */
+#define STATUS_200 0
+#define STATUS_206 1
+#define STATUS_304 2
+#define STATUS_400 3
+#define STATUS_403 4
+#define STATUS_404 5
+#define STATUS_416 6
+#define STATUS_500 7
+#define STATUS_501 8
+#define STATUS_COUNT 9
+
+/* " 200 OK\r\n" and its length, ready to follow "HTTP/x.y" */
+struct status_line {
+	const char *line;
+	size_t len;
+};
 
-extern char *http_status;
+extern int http_status;
+extern const struct status_line status_lines[];
 
 #endif
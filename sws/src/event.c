@@ -0,0 +1,329 @@
+/*
+ * event.c - Single process, edge-triggered epoll event loop
+ *
+ * Every accepted connection is made non-blocking and registered once for
+ * both read and write readiness. Each connection moves through a small
+ * state machine: it reads until a full request head is buffered, the
+ * request is handled and its response queued, and the queue is flushed
+ * as the socket drains. Persistent connections then go back to reading;
+ * connections idle for longer than the keep-alive timeout are closed.
+ * A response that waits on a CGI script is suspended instead of waited
+ * for: the script's pipes are registered too, for its connection, so its
+ * headers are read and its output forwarded as the script writes them,
+ * while other connections are served.
+ */
+#define _GNU_SOURCE
+
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "conn.h"
+#include "defines.h"
+#include "event.h"
+#include "fcache.h"
+#include "fcgi.h"
+#include "gzcache.h"
+#include "log.h"
+#include "server.h"
+#include "stats.h"
+
+static int
+set_nonblocking(int fd) {
+
+	int flags;
+
+	if ((flags = fcntl(fd, F_GETFL, 0)) < 0)
+		return -1;
+	return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+/* Tags the file cache's inotify fd among the epoll entries */
+static char fcache_tag;
+
+/* All open connections, least recently active first */
+static struct conn *conns_head, *conns_tail;
+
+static void
+unlink_conn(struct conn *conn) {
+
+	if (conn->prev)
+		conn->prev->next = conn->next;
+	else
+		conns_head = conn->next;
+	if (conn->next)
+		conn->next->prev = conn->prev;
+	else
+		conns_tail = conn->prev;
+	conn->prev = conn->next = NULL;
+}
+
+/*
+ * Mark a connection as active now by moving it to the tail of the list,
+ * which keeps the list sorted by last activity.
+ */
+static void
+touch_conn(struct conn *conn, time_t now) {
+
+	if (conns_tail != conn) {
+		if (conn->prev || conn->next || conns_head == conn)
+			unlink_conn(conn);
+		conn->prev = conns_tail;
+		conn->next = NULL;
+		if (conns_tail)
+			conns_tail->next = conn;
+		else
+			conns_head = conn;
+		conns_tail = conn;
+	}
+	conn->last_active = now;
+}
+
+static void
+close_conn(struct conn *conn) {
+
+	unlink_conn(conn);
+	destroy_conn(conn);
+}
+
+/*
+ * Close connections that have been idle for longer than the timeout, or
+ * for longer than SCRIPT_TIMEOUT if their response is waiting on a script.
+ */
+static void
+expire_conns(time_t now) {
+
+	struct conn *conn, *next;
+
+	for (conn = conns_head; conn != NULL &&
+		now - conn->last_active >= __sws_timeout; conn = next) {
+		next = conn->next;
+		if ((conn->state == CONN_WAITING || (conn->head != NULL
+			&& (conn->head->pipe || conn->head->stalled)))
+			&& now - conn->last_active < SCRIPT_TIMEOUT)
+			continue;
+		close_conn(conn);
+	}
+}
+
+static void
+accept_conns(int epfd, int sock) {
+
+	struct epoll_event ev;
+	struct conn *conn;
+	int fd;
+
+	while (1) {
+		if ((fd = accept4(sock, NULL, NULL,
+			SOCK_NONBLOCK | SOCK_CLOEXEC)) < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				perror("accept");
+			return;
+		}
+
+		if ((conn = create_conn(fd, 0)) == NULL) {
+			close(fd);
+			continue;
+		}
+		conn->epfd = epfd;
+
+		memset(&ev, 0, sizeof(ev));
+		ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+		ev.data.ptr = conn;
+		if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+			perror("epoll_ctl");
+			destroy_conn(conn);
+			continue;
+		}
+		touch_conn(conn, time(NULL));
+	}
+}
+
+/*
+ * Advance a connection's state machine after a readiness event. All
+ * complete requests in the receive buffer are answered before writing,
+ * and a persistent connection loops back to reading once the responses
+ * are out. A response that waits on a script holds up the requests
+ * behind it, but those ahead of it are sent meanwhile.
+ */
+static void
+handle_conn(struct conn *conn, uint32_t events) {
+
+	int rval;
+
+	/*
+	 * While waiting, the error may be a script's stdin closing, which
+	 * the handler finds out for itself; a broken socket fails its flush.
+	 */
+	if ((events & EPOLLERR) && conn->state != CONN_WAITING) {
+		conn->state = CONN_CLOSING;
+		return;
+	}
+
+	while (1) {
+		if (conn->state == CONN_READING) {
+			if ((rval = conn_fill(conn)) < 0) {
+				conn->state = CONN_CLOSING;
+				return;
+			}
+
+			/*
+			 * A full buffer without a complete head is still handed to
+			 * the parser, which rejects the truncated line with a 400.
+			 */
+			if (conn_request_ready(conn) == 0) {
+				if (rval == 0)
+					conn->state = CONN_CLOSING;
+				return;
+			}
+
+			/* Answer a request sent just before the client shut down */
+			if (rval == 0)
+				conn->eof = 1;
+
+			sws_process_pipeline(conn);
+			if (conn->state != CONN_WAITING)
+				conn->state = CONN_WRITING;
+		}
+
+		if (conn->state == CONN_WAITING) {
+			if (conn_flush(conn) < 0
+				|| (rval = conn_resume(conn)) < 0) {
+				conn->state = CONN_CLOSING;
+				return;
+			}
+			if (rval == 1)
+				return;
+			stats_request(&conn->req->trace);
+			conn->state = CONN_WRITING;
+		}
+
+		if (conn->state == CONN_WRITING) {
+			if ((rval = conn_flush(conn)) == 1)
+				return;
+			if (rval < 0 || !conn->keepalive || conn->eof) {
+				conn->state = CONN_CLOSING;
+				return;
+			}
+			conn_reset(conn);
+		}
+	}
+}
+
+void
+sws_event_loop(int sock) {
+
+	struct epoll_event ev, events[MAX_EVENTS];
+	struct conn *conn, *closed;
+	time_t now, flushed;
+	int epfd, i, n;
+
+	if (set_nonblocking(sock) < 0) {
+		perror("fcntl");
+		exit(EXIT_FAILURE);
+		/* NOTREACHED */
+	}
+
+	if ((epfd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+		perror("epoll_create1");
+		exit(EXIT_FAILURE);
+		/* NOTREACHED */
+	}
+
+	/* The listening socket is the only entry without a conn */
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.ptr = NULL;
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, sock, &ev) < 0) {
+		perror("epoll_ctl");
+		exit(EXIT_FAILURE);
+		/* NOTREACHED */
+	}
+
+	/* This process lives long enough for cached files to pay off */
+	if (fcache_init((size_t)__sws_cache_size * 1024) == 0) {
+		memset(&ev, 0, sizeof(ev));
+		ev.events = EPOLLIN;
+		ev.data.ptr = &fcache_tag;
+		if (epoll_ctl(epfd, EPOLL_CTL_ADD, fcache_fd(), &ev) < 0) {
+			perror("epoll_ctl");
+			exit(EXIT_FAILURE);
+			/* NOTREACHED */
+		}
+	}
+
+	/* So does the gzip encoding of a text file */
+	gzcache_init();
+
+	/* Scripts keep running between requests, if asked to */
+	if (__sws_fcgi_procs > 0)
+		fcgi_init(__sws_fcgi_procs);
+
+	/* Log lines are handed to a writer thread instead of written here */
+	log_start_writer();
+
+	flushed = time(NULL);
+	while (1) {
+		/* Wake up at least once a second to expire idle connections */
+		if ((n = epoll_wait(epfd, events, MAX_EVENTS, 1000)) < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("epoll_wait");
+			exit(EXIT_FAILURE);
+			/* NOTREACHED */
+		}
+
+		now = time(NULL);
+		closed = NULL;
+		for (i = 0; i < n; i++) {
+			if ((conn = events[i].data.ptr) == NULL) {
+				accept_conns(epfd, sock);
+				continue;
+			}
+			if (conn == (struct conn*)&fcache_tag) {
+				fcache_invalidate();
+				continue;
+			}
+
+			/* Already closed on an event for its socket or CGI pipe */
+			if (conn->state == CONN_CLOSING)
+				continue;
+
+			handle_conn(conn, events[i].events);
+			if (conn->state == CONN_CLOSING) {
+				unlink_conn(conn);
+				conn->next = closed;
+				closed = conn;
+			} else
+				touch_conn(conn, now);
+		}
+
+		/* Freed only now, as later events in the batch may name them */
+		while ((conn = closed) != NULL) {
+			closed = conn->next;
+			destroy_conn(conn);
+		}
+
+		expire_conns(now);
+
+		/*
+		 * The status page sees this process's counts a second late,
+		 * and requests to FastCGI processes that died are given up on
+		 */
+		if (now != flushed) {
+			stats_flush();
+			fcgi_check();
+			flushed = now;
+		}
+	}
+}
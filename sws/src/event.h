@@ -0,0 +1,9 @@
+#ifndef _EVENT_H_
+#define _EVENT_H_
+
+/* Maximum number of events returned by one epoll_wait */
+#define MAX_EVENTS 256
+
+void sws_event_loop(int);
+
+#endif
@@ -0,0 +1,382 @@
+/*
+ * fcache.c - Cache of open static files
+ *
+ * Long-lived processes (the event loop) keep recently served files open
+ * together with their size, mtime, formatted Last-Modified date and
+ * content type, keyed by the request's real path. A hit needs no stat(),
+ * open() or date formatting. The cache holds at most FCACHE_SIZE files
+ * and evicts the least recently used one when full. Every cached file is
+ * watched with inotify, and any change to it, or to its links, drops the
+ * entry; the inotify fd is polled by the event loop, which calls
+ * fcache_invalidate() when it is readable.
+ *
+ * Directories are cached too, with the body of their listing. They are
+ * watched for entries coming and going, and are entered before their
+ * listing is generated, so a change made while it is being read is not
+ * missed: the entry is dropped, and the finished listing is not stored.
+ *
+ * Small files may additionally keep their complete serialized response,
+ * so that a hit is a single copy into the output queue. Those responses
+ * share a memory budget; when it runs out, the responses of the least
+ * recently used files are dropped first.
+ */
+#define _GNU_SOURCE
+
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "content_type.h"
+#include "defines.h"
+#include "fcache.h"
+#include "utils.h"
+
+#define FCACHE_EVENTS (IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE \
+	| IN_DELETE_SELF | IN_MOVE_SELF)
+
+#define FCACHE_DIR_EVENTS (IN_CREATE | IN_DELETE | IN_MOVED_FROM \
+	| IN_MOVED_TO | IN_ATTRIB | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR)
+
+struct fcache_stats fcache_stats;
+
+static int inotify_fd = -1;
+static int nentries;
+static unsigned long serial;
+static size_t budget;
+static struct fcache_entry *buckets[FCACHE_BUCKETS];
+static struct fcache_entry *watches[FCACHE_BUCKETS];
+static struct fcache_entry *lru_head, *lru_tail;
+
+/*
+ * Start caching in this process. Returns -1, leaving the cache disabled,
+ * if inotify is unavailable.
+ */
+int
+fcache_init(size_t response_budget) {
+
+	budget = response_budget;
+	if ((inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) < 0) {
+		perror("inotify_init1");
+		return -1;
+	}
+
+	return 0;
+}
+
+int
+fcache_fd(void) {
+
+	return inotify_fd;
+}
+
+static void
+lru_unlink(struct fcache_entry *e) {
+
+	if (e->prev)
+		e->prev->next = e->next;
+	else
+		lru_head = e->next;
+	if (e->next)
+		e->next->prev = e->prev;
+	else
+		lru_tail = e->prev;
+	e->prev = e->next = NULL;
+}
+
+static void
+lru_append(struct fcache_entry *e) {
+
+	e->prev = lru_tail;
+	e->next = NULL;
+	if (lru_tail)
+		lru_tail->next = e;
+	else
+		lru_head = e;
+	lru_tail = e;
+}
+
+static void
+unlink_chain(struct fcache_entry **pp, struct fcache_entry *e, int watch) {
+
+	for (; *pp != NULL; pp = watch ? &(*pp)->wnext : &(*pp)->hnext) {
+		if (*pp == e) {
+			*pp = watch ? e->wnext : e->hnext;
+			return;
+		}
+	}
+}
+
+static void
+drop_response(struct fcache_entry *e) {
+
+	if (e->response) {
+		fcache_stats.bytes -= e->response_len;
+		free(e->response);
+		e->response = NULL;
+	}
+}
+
+/*
+ * Remove watch wd unless an entry still uses it. Paths that are links to
+ * the same file share one watch.
+ */
+static void
+release_watch(int wd) {
+
+	struct fcache_entry *w;
+
+	for (w = watches[wd & (FCACHE_BUCKETS - 1)]; w; w = w->wnext)
+		if (w->wd == wd)
+			return;
+	inotify_rm_watch(inotify_fd, wd);
+}
+
+/*
+ * Drop an entry. rm_watch is 0 when the kernel has already removed its
+ * watch.
+ */
+static void
+fcache_remove(struct fcache_entry *e, int rm_watch) {
+
+	unlink_chain(&buckets[e->hash & (FCACHE_BUCKETS - 1)], e, 0);
+	unlink_chain(&watches[e->wd & (FCACHE_BUCKETS - 1)], e, 1);
+	lru_unlink(e);
+
+	if (rm_watch)
+		release_watch(e->wd);
+
+	drop_response(e);
+	if (e->fd >= 0)
+		close(e->fd);
+	free(e->path);
+	free(e);
+	nentries--;
+}
+
+/*
+ * Read pending inotify events and drop every entry whose file changed.
+ */
+void
+fcache_invalidate(void) {
+
+	struct fcache_entry *e, *next;
+	struct inotify_event *ev;
+	ssize_t n;
+	char *p;
+	char buf[BUFF_SIZE]
+		__attribute__((aligned(__alignof__(struct inotify_event))));
+
+	while ((n = read(inotify_fd, buf, sizeof(buf))) > 0) {
+		for (p = buf; p < buf + n; p += sizeof(*ev) + ev->len) {
+			ev = (struct inotify_event*)p;
+			if (ev->mask & IN_Q_OVERFLOW) {
+				while (lru_head != NULL)
+					fcache_remove(lru_head, 1);
+				continue;
+			}
+
+			e = watches[ev->wd & (FCACHE_BUCKETS - 1)];
+			for (; e != NULL; e = next) {
+				next = e->wnext;
+				if (e->wd == ev->wd)
+					fcache_remove(e,
+						!(ev->mask & IN_IGNORED));
+			}
+		}
+	}
+}
+
+static void
+insert_entry(struct fcache_entry *e) {
+
+	e->hash = str_hash(e->path);
+	e->serial = ++serial;
+	e->hnext = buckets[e->hash & (FCACHE_BUCKETS - 1)];
+	buckets[e->hash & (FCACHE_BUCKETS - 1)] = e;
+	e->wnext = watches[e->wd & (FCACHE_BUCKETS - 1)];
+	watches[e->wd & (FCACHE_BUCKETS - 1)] = e;
+	lru_append(e);
+	nentries++;
+}
+
+/*
+ * Find path in the cache, marking it recently used. Returns NULL on a
+ * miss or if caching is disabled.
+ */
+struct fcache_entry*
+fcache_lookup(const char *path) {
+
+	struct fcache_entry *e;
+	unsigned int hash;
+
+	if (inotify_fd < 0)
+		return NULL;
+
+	hash = str_hash(path);
+	for (e = buckets[hash & (FCACHE_BUCKETS - 1)]; e; e = e->hnext) {
+		if (e->hash == hash && strcmp(e->path, path) == 0) {
+			if (e != lru_tail) {
+				lru_unlink(e);
+				lru_append(e);
+			}
+			return e;
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * Return the cache entry for the regular file at path, opening and adding
+ * it on a miss. Returns NULL if it cannot be cached.
+ */
+struct fcache_entry*
+fcache_get(const char *path) {
+
+	struct fcache_entry *e;
+	struct stat stat_buf;
+	char *ext;
+	int wd, fd;
+
+	if (inotify_fd < 0)
+		return NULL;
+
+	if ((e = fcache_lookup(path)) != NULL)
+		return e->isdir ? NULL : e;
+
+	if (nentries == FCACHE_SIZE)
+		fcache_remove(lru_head, 1);
+
+	/* Watch before reading metadata so no change can slip in between */
+	if ((wd = inotify_add_watch(inotify_fd, path, FCACHE_EVENTS)) < 0)
+		return NULL;
+
+	if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0) {
+		release_watch(wd);
+		return NULL;
+	}
+
+	if (fstat(fd, &stat_buf) < 0 || !S_ISREG(stat_buf.st_mode)) {
+		release_watch(wd);
+		close(fd);
+		return NULL;
+	}
+
+	if ((e = calloc(1, sizeof(struct fcache_entry))) == NULL
+		|| (e->path = strdup(path)) == NULL) {
+		fprintf(stderr, "calloc error\n");
+		release_watch(wd);
+		free(e);
+		close(fd);
+		return NULL;
+	}
+
+	e->fd = fd;
+	e->wd = wd;
+	e->encodings = -1;
+	e->size = stat_buf.st_size;
+	e->mtime = stat_buf.st_mtime;
+	strftime(e->last_modified, sizeof(e->last_modified),
+		RFC1123_DATE, gmtime(&e->mtime));
+	make_etag(e->etag, &stat_buf);
+	if ((ext = strrchr(path, '.')) != NULL)
+		ext += 1;
+	e->content_type = get_content_type(ctypes, ext);
+	insert_entry(e);
+
+	return e;
+}
+
+/*
+ * Return the entry for the directory at path, adding one without a
+ * listing on a miss. Returns NULL if it cannot be cached.
+ */
+struct fcache_entry*
+fcache_get_dir(const char *path, int homedir) {
+
+	struct fcache_entry *e;
+	int wd;
+
+	if (inotify_fd < 0)
+		return NULL;
+
+	if ((e = fcache_lookup(path)) != NULL)
+		return (e->isdir && e->homedir == homedir) ? e : NULL;
+
+	if (nentries == FCACHE_SIZE)
+		fcache_remove(lru_head, 1);
+
+	if ((wd = inotify_add_watch(inotify_fd, path, FCACHE_DIR_EVENTS)) < 0)
+		return NULL;
+
+	if ((e = calloc(1, sizeof(struct fcache_entry))) == NULL
+		|| (e->path = strdup(path)) == NULL) {
+		fprintf(stderr, "calloc error\n");
+		release_watch(wd);
+		free(e);
+		return NULL;
+	}
+
+	e->isdir = 1;
+	e->homedir = homedir;
+	e->fd = -1;
+	e->wd = wd;
+	insert_entry(e);
+
+	return e;
+}
+
+/*
+ * Attach a serialized response of len bytes to e, which takes ownership
+ * of it. header_len is the length of its status line and headers, and
+ * date_off and conn_off the offsets of the Date and Connection header
+ * values. Returns -1 if it does not fit in the budget.
+ */
+int
+fcache_store_response(struct fcache_entry *e, char *response, size_t len,
+	size_t header_len, size_t date_off, size_t conn_off) {
+
+	struct fcache_entry *old;
+
+	if (len > budget)
+		return -1;
+
+	drop_response(e);
+	for (old = lru_head; old != NULL
+		&& fcache_stats.bytes + len > budget; old = old->next)
+		drop_response(old);
+
+	e->response = response;
+	e->response_len = len;
+	e->header_len = header_len;
+	e->date_off = date_off;
+	e->conn_off = conn_off;
+	fcache_stats.bytes += len;
+
+	return 0;
+}
+
+/*
+ * Attach the listing body of len bytes to the directory entry for path,
+ * which takes ownership of it, provided the entry is still the one with
+ * the given serial number, i.e. the directory has not changed since the
+ * listing was started. Returns -1 otherwise.
+ */
+int
+fcache_store_listing(const char *path, unsigned long entry_serial,
+	char *body, size_t len) {
+
+	struct fcache_entry *e;
+
+	if ((e = fcache_lookup(path)) == NULL || e->serial != entry_serial)
+		return -1;
+
+	return fcache_store_response(e, body, len, 0, 0, 0);
+}
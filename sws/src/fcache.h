@@ -0,0 +1,84 @@
+#ifndef _FCACHE_H_
+#define _FCACHE_H_
+
+#include <sys/types.h>
+
+#include <time.h>
+
+#include "utils.h"
+
+/* Most files kept open by the cache */
+#define FCACHE_SIZE 1024
+
+/* Hash buckets, a power of two */
+#define FCACHE_BUCKETS 2048
+
+/* Largest file whose whole response is kept in memory */
+#define FCACHE_SMALL_FILE 65536
+
+/* Default memory budget for those responses, in kilobytes */
+#define FCACHE_BUDGET 16384
+
+/* Largest directory listing kept in memory */
+#define FCACHE_LISTING_MAX (1024 * 1024)
+
+/*
+ * An open static file and the metadata needed to answer requests for it
+ * without touching the filesystem, or a directory and its listing.
+ */
+struct fcache_entry {
+	char *path;
+	unsigned int hash;
+	unsigned long serial;
+	int isdir;
+	/* Listing was made for a /~user URL */
+	int homedir;
+	int fd;
+	int wd;
+	off_t size;
+	time_t mtime;
+	char last_modified[64];
+	char etag[ETAG_MAX];
+	char *content_type;
+	/* ENCODING_ flags of fresh precompressed siblings, -1 until known */
+	int encodings;
+	/*
+	 * Complete 200 response for a small file, status line through body,
+	 * built with "Connection: keep-alive". Hits patch in the date, and
+	 * "close" for clients that are not kept alive. For a directory, the
+	 * body of its listing alone.
+	 */
+	char *response;
+	size_t response_len;
+	size_t header_len;
+	size_t date_off;
+	size_t conn_off;
+	/* Bucket chains by path and by inotify watch */
+	struct fcache_entry *hnext;
+	struct fcache_entry *wnext;
+	/* LRU list, least recently used first */
+	struct fcache_entry *prev;
+	struct fcache_entry *next;
+};
+
+struct fcache_stats {
+	unsigned long hits;
+	unsigned long misses;
+	unsigned long listing_hits;
+	unsigned long listing_misses;
+	size_t bytes;
+};
+
+extern struct fcache_stats fcache_stats;
+
+int fcache_init(size_t);
+int fcache_fd(void);
+void fcache_invalidate(void);
+struct fcache_entry* fcache_lookup(const char*);
+struct fcache_entry* fcache_get(const char*);
+struct fcache_entry* fcache_get_dir(const char*, int);
+int fcache_store_response(struct fcache_entry*, char*, size_t, size_t,
+	size_t, size_t);
+int fcache_store_listing(const char*, unsigned long, char*, size_t);
+
+#endif
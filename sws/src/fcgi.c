@@ -0,0 +1,883 @@
+/*
+ * fcgi.c - Persistent CGI processes
+ *
+ * With -f, long-lived processes (the event loop) run CGI scripts as
+ * FastCGI applications instead of forking and executing them for every
+ * request. The first request for a script starts a pool of processes for
+ * it, all given one listening UNIX socket as their standard input, as the
+ * FastCGI specification has it. Requests go over connections to that
+ * socket, which are kept open and reused for the next request, and what
+ * the application writes is parsed like the output of a CGI script.
+ *
+ * Nothing here blocks: the client's connection is suspended while the
+ * request goes out and the headers of the output come back, and the rest
+ * of the output is streamed to the client as it arrives. Processes that
+ * die are started again when a new connection is made; requests still
+ * waiting on a pool with none left alive are given up on.
+ */
+#define _GNU_SOURCE
+
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/un.h>
+
+#include <errno.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+
+#include "arena.h"
+#include "defines.h"
+#include "fcgi.h"
+#include "parse.h"
+#include "server.h"
+#include "utils.h"
+
+/* How far a request run through a pool has got */
+#define FCGI_SENDING 0
+#define FCGI_HEADERS 1
+#define FCGI_STREAMING 2
+#define FCGI_DONE 3
+
+/* Room for a chunk-size line, kept at a fixed width, and the last chunk */
+#define FCGI_CHUNK_HEAD 8
+#define FCGI_CHUNK_TAIL (sizeof("\r\n0\r\n\r\n") - 1)
+
+/*
+ * A request run through a pool. Its records go out from wbuf as the
+ * application takes them. What comes back is read through rbuf a record
+ * at a time, its stdout into out until the headers are in, then straight
+ * into the chunk streaming it to the client. The suspended connection
+ * and that chunk each hold a reference.
+ */
+struct fcgi_exchange {
+	struct conn *conn;
+	struct fcgi_pool *pool;
+	struct fcgi_exchange *next;
+	int refs;
+	int fd;
+	int state;
+	/* Connections tried, and whether the last was idle in the pool */
+	int tries;
+	int reused;
+	/* Writing failed; some of the body was taken; some output came */
+	int failed;
+	int took;
+	int got;
+	/* The empty record ending stdin is queued */
+	int stdin_done;
+	/* Output is sent chunked, or thrown away after the headers */
+	int chunked;
+	int discard;
+	/* The record being read: its header, and content and padding left */
+	unsigned char h[FCGI_HEADER_LEN];
+	size_t hlen;
+	size_t clen;
+	size_t plen;
+	unsigned char end[8];
+	size_t wlen;
+	size_t wpos;
+	size_t rlen;
+	size_t rpos;
+	size_t len;
+	char out[BUFF_SIZE];
+	char rbuf[BUFF_SIZE];
+	char wbuf[FCGI_RECORD_MAX + 4 * FCGI_HEADER_LEN];
+};
+
+static int nprocs;
+static int npools;
+static struct fcgi_pool pools[FCGI_POOLS];
+static char server_name[HOST_NAME_MAX + 1];
+static char sockdir[64];
+
+/*
+ * Run CGI scripts through pools of nprocs processes each in this process.
+ * Their sockets go in a directory made for this process, which no other
+ * user can enter.
+ */
+int
+fcgi_init(int procs) {
+
+	snprintf(sockdir, sizeof(sockdir), "%s/sws-fcgi.XXXXXX",
+		FCGI_SOCKET_DIR);
+	if (mkdtemp(sockdir) == NULL) {
+		perror("mkdtemp");
+		sockdir[0] = '\0';
+		return -1;
+	}
+
+	nprocs = procs;
+	if (gethostname(server_name, sizeof(server_name)) < 0) {
+		perror("gethostname");
+		strcpy(server_name, "localhost");
+	}
+
+	return 0;
+}
+
+int
+fcgi_enabled(void) {
+
+	return nprocs > 0;
+}
+
+/*
+ * Start process i of a pool. Its standard input is the pool's listening
+ * socket, and it inherits none of our other descriptors.
+ */
+static int
+spawn_proc(struct fcgi_pool *pool, int i) {
+
+	pid_t pid;
+	long fd, maxfd;
+
+	if ((pid = fork()) < 0) {
+		perror("forking fastcgi process");
+		return -1;
+	}
+
+	if (pid == 0) {
+		signal(SIGPIPE, SIG_DFL);
+		if (dup2(pool->listen_fd, STDIN_FILENO) < 0) {
+			perror("dup2");
+			_exit(EXIT_FAILURE);
+		}
+		if ((maxfd = sysconf(_SC_OPEN_MAX)) < 0 || maxfd > 65536)
+			maxfd = 65536;
+		for (fd = STDERR_FILENO + 1; fd < maxfd; fd++)
+			close(fd);
+		execl(pool->script, pool->script, NULL);
+		perror("execl");
+		_exit(EXIT_FAILURE);
+		/* NOTREACHED */
+	}
+
+	pool->pids[i] = pid;
+	return 0;
+}
+
+static int
+proc_alive(struct fcgi_pool *pool, int i) {
+
+	return pool->pids[i] > 0 && (kill(pool->pids[i], 0) == 0
+		|| errno != ESRCH);
+}
+
+/*
+ * Start again any process of the pool that has died.
+ */
+static void
+check_pool(struct fcgi_pool *pool) {
+
+	int i;
+
+	for (i = 0; i < pool->nprocs; i++)
+		if (!proc_alive(pool, i))
+			spawn_proc(pool, i);
+}
+
+/*
+ * Return the pool running script, starting one if there is none. Returns
+ * NULL if none can be started.
+ */
+static struct fcgi_pool*
+get_pool(const char *script) {
+
+	struct fcgi_pool *pool;
+	struct sockaddr_un addr;
+	int i;
+
+	for (i = 0; i < npools; i++)
+		if (strcmp(pools[i].script, script) == 0)
+			return &pools[i];
+
+	if (npools == FCGI_POOLS)
+		return NULL;
+	pool = &pools[npools];
+	memset(pool, 0, sizeof(*pool));
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	snprintf(pool->sockpath, sizeof(pool->sockpath), "%s/%d", sockdir,
+		npools);
+	strncpy(addr.sun_path, pool->sockpath, sizeof(addr.sun_path) - 1);
+
+	if ((pool->listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC,
+		0)) < 0) {
+		perror("socket");
+		return NULL;
+	}
+	if (bind(pool->listen_fd, (struct sockaddr*)&addr, sizeof(addr)) < 0
+		|| listen(pool->listen_fd, SOMAXCONN) < 0) {
+		perror("binding fastcgi socket");
+		close(pool->listen_fd);
+		return NULL;
+	}
+
+	if ((pool->script = strdup(script)) == NULL
+		|| (pool->pids = calloc(nprocs, sizeof(pid_t))) == NULL) {
+		fprintf(stderr, "calloc error\n");
+		free(pool->script);
+		close(pool->listen_fd);
+		unlink(pool->sockpath);
+		return NULL;
+	}
+	pool->nprocs = nprocs;
+	npools++;
+
+	check_pool(pool);
+	return pool;
+}
+
+/*
+ * Return a non-blocking connection to one of the pool's processes, an
+ * idle one if there is one. *reused tells which. A new connection waits
+ * for a process to accept it, so any that died are started again first.
+ */
+static int
+get_conn(struct fcgi_pool *pool, int *reused) {
+
+	struct sockaddr_un addr;
+	int fd;
+
+	if (pool->nidle > 0) {
+		*reused = 1;
+		return pool->idle[--pool->nidle];
+	}
+	*reused = 0;
+
+	check_pool(pool);
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, pool->sockpath, sizeof(addr.sun_path) - 1);
+
+	if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+		0)) < 0) {
+		perror("socket");
+		return -1;
+	}
+	/* Fails with EAGAIN, rather than waiting, if the backlog is full */
+	if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+		perror("connecting to fastcgi process");
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+static void
+put_conn(struct fcgi_pool *pool, int fd) {
+
+	if (pool->nidle < FCGI_IDLE_MAX)
+		pool->idle[pool->nidle++] = fd;
+	else
+		close(fd);
+}
+
+/*
+ * Stop every pool's processes and remove their sockets.
+ */
+void
+fcgi_shutdown(void) {
+
+	struct fcgi_pool *pool;
+	int i;
+
+	for (pool = pools; pool < pools + npools; pool++) {
+		for (i = 0; i < pool->nprocs; i++)
+			if (pool->pids[i] > 0)
+				kill(pool->pids[i], SIGTERM);
+		while (pool->nidle > 0)
+			close(pool->idle[--pool->nidle]);
+		close(pool->listen_fd);
+		unlink(pool->sockpath);
+	}
+	npools = 0;
+
+	if (sockdir[0] != '\0' && rmdir(sockdir) < 0)
+		perror("rmdir");
+	sockdir[0] = '\0';
+}
+
+/*
+ * Give up on the requests to pools whose processes have all died, rather
+ * than leave them queued until they time out for a process to accept
+ * them: a script that is not a FastCGI application exits at once. Their
+ * connections are shut down, which wakes them up with an error.
+ */
+void
+fcgi_check(void) {
+
+	struct fcgi_pool *pool;
+	struct fcgi_exchange *x;
+	int i;
+
+	for (pool = pools; pool < pools + npools; pool++) {
+		for (i = 0; i < pool->nprocs; i++)
+			if (proc_alive(pool, i))
+				break;
+		if (i < pool->nprocs)
+			continue;
+		for (x = pool->exchanges; x != NULL; x = x->next)
+			if (x->fd >= 0 && !x->got)
+				shutdown(x->fd, SHUT_RDWR);
+	}
+}
+
+/*
+ * Write the header of a record of len bytes for request 1 to p and return
+ * the end of it.
+ */
+static char*
+put_header(char *p, int type, size_t len) {
+
+	*p++ = FCGI_VERSION_1;
+	*p++ = type;
+	*p++ = 0;
+	*p++ = 1;
+	*p++ = (len >> 8) & 0xff;
+	*p++ = len & 0xff;
+	*p++ = 0;
+	*p++ = 0;
+
+	return p;
+}
+
+/* Name and value lengths take one byte below 128, four otherwise */
+static char*
+put_length(char *p, size_t len) {
+
+	if (len < 128) {
+		*p++ = len;
+	} else {
+		*p++ = ((len >> 24) & 0x7f) | 0x80;
+		*p++ = (len >> 16) & 0xff;
+		*p++ = (len >> 8) & 0xff;
+		*p++ = len & 0xff;
+	}
+
+	return p;
+}
+
+/*
+ * Append a name-value pair to the parameters being built at p, which must
+ * stay below end. Returns NULL if it does not fit.
+ */
+static char*
+put_param(char *p, char *end, const char *name, const char *value) {
+
+	size_t nlen, vlen;
+
+	if (p == NULL)
+		return NULL;
+	if (value == NULL)
+		value = "";
+	nlen = strlen(name);
+	vlen = strlen(value);
+	if ((size_t)(end - p) < nlen + vlen + 8)
+		return NULL;
+
+	p = put_length(p, nlen);
+	p = put_length(p, vlen);
+	p = put(p, name, nlen);
+	return put(p, value, vlen);
+}
+
+/*
+ * Build the records that start a request for script, up to its stdin,
+ * into buf, which holds size bytes, and return their length, or 0 if
+ * they do not fit.
+ */
+static size_t
+build_request(char *buf, size_t size, struct request *req,
+	const char *script) {
+
+	char *p, *params, *end;
+	char len[32];
+
+	p = put_header(buf, FCGI_BEGIN_REQUEST, 8);
+	*p++ = 0;
+	*p++ = FCGI_RESPONDER;
+	*p++ = FCGI_KEEP_CONN;
+	memset(p, 0, 5);
+	p += 5;
+
+	/* The parameters' header is filled in once their length is known */
+	params = p + FCGI_HEADER_LEN;
+	end = buf + size - 2 * FCGI_HEADER_LEN;
+	if (end - params > FCGI_RECORD_MAX)
+		end = params + FCGI_RECORD_MAX;
+
+	p = put_param(params, end, "GATEWAY_INTERFACE", "CGI/1.1");
+	p = put_param(p, end, "SERVER_SOFTWARE", "SWS/1.0");
+	p = put_param(p, end, "SERVER_NAME", server_name);
+	p = put_param(p, end, "SERVER_PROTOCOL", req->simple ? "HTTP/0.9"
+		: (req->version[0] == '1' && req->version[2] == '1')
+		? "HTTP/1.1" : "HTTP/1.0");
+	p = put_param(p, end, "REQUEST_METHOD", req->method == 0 ? "GET"
+		: req->method == 1 ? "HEAD" : "POST");
+	p = put_param(p, end, "REQUEST_URI", req->path);
+	p = put_param(p, end, "SCRIPT_NAME", req->path);
+	p = put_param(p, end, "SCRIPT_FILENAME", script);
+	p = put_param(p, end, "QUERY_STRING", "");
+	p = put_param(p, end, "REMOTE_ADDR", req->ip);
+	if (req->length != (unsigned long)-1) {
+		*put_ulong(len, req->length) = '\0';
+		p = put_param(p, end, "CONTENT_LENGTH", len);
+	}
+	if (req->content_type != NULL)
+		p = put_param(p, end, "CONTENT_TYPE", req->content_type);
+	if (p == NULL)
+		return 0;
+	put_header(params - FCGI_HEADER_LEN, FCGI_PARAMS, p - params);
+
+	/* An empty record ends the parameters */
+	p = put_header(p, FCGI_PARAMS, 0);
+
+	return p - buf;
+}
+
+/*
+ * Drop a reference to an exchange, which the last one frees, closing its
+ * connection unless that went back to the pool.
+ */
+static void
+put_exchange(void *arg) {
+
+	struct fcgi_exchange *x = arg;
+	struct fcgi_exchange **xp;
+
+	if (--x->refs > 0)
+		return;
+
+	for (xp = &x->pool->exchanges; *xp != x; xp = &(*xp)->next)
+		;
+	*xp = x->next;
+	if (x->fd >= 0) {
+		conn_unwatch(x->conn, x->fd);
+		close(x->fd);
+	}
+	free(x);
+}
+
+/*
+ * Start the request over a connection to the pool, in place of the last
+ * one if that broke. Returns -1 if none can be had.
+ */
+static int
+start_exchange(struct fcgi_exchange *x) {
+
+	struct request *req = x->conn->req;
+
+	if (x->fd >= 0) {
+		conn_unwatch(x->conn, x->fd);
+		close(x->fd);
+		x->fd = -1;
+	}
+
+	if ((x->wlen = build_request(x->wbuf, sizeof(x->wbuf), req,
+		req->realpath)) == 0)
+		return -1;
+	x->wpos = 0;
+
+	if ((x->fd = get_conn(x->pool, &x->reused)) < 0)
+		return -1;
+	if (conn_watch(x->conn, x->fd, EPOLLIN | EPOLLOUT) < 0) {
+		close(x->fd);
+		x->fd = -1;
+		return -1;
+	}
+
+	x->tries++;
+	x->state = FCGI_SENDING;
+	x->failed = x->took = x->got = x->stdin_done = 0;
+	x->hlen = x->clen = x->plen = 0;
+	x->rlen = x->rpos = x->len = 0;
+
+	return 0;
+}
+
+/*
+ * Try the request again after its connection broke, if that was an idle
+ * one that went away before any of the body was taken or any output came.
+ */
+static int
+retry_exchange(struct fcgi_exchange *x) {
+
+	if (!x->reused || x->took || x->got || x->tries > 1)
+		return -1;
+
+	return start_exchange(x);
+}
+
+/*
+ * Write out the records waiting in wbuf. Returns 0 once they are all out,
+ * 1 if the connection takes no more for now and -1 on error.
+ */
+static int
+send_records(struct fcgi_exchange *x) {
+
+	ssize_t n;
+
+	while (x->wpos < x->wlen) {
+		if ((n = send(x->fd, x->wbuf + x->wpos, x->wlen - x->wpos,
+			MSG_NOSIGNAL)) < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN)
+				return 1;
+			return -1;
+		}
+		x->wpos += n;
+	}
+	x->wlen = x->wpos = 0;
+
+	return 0;
+}
+
+/*
+ * Pass a piece of the request body on as a stdin record, once the records
+ * ahead of it are out.
+ */
+static ssize_t
+write_stdin(void *arg, const char *buf, size_t len) {
+
+	struct fcgi_exchange *x = arg;
+	int rval;
+
+	if (x->failed)
+		return -1;
+	if ((rval = send_records(x)) != 0) {
+		if (rval < 0) {
+			x->failed = 1;
+			return -1;
+		}
+		return 0;
+	}
+
+	if (len > FCGI_RECORD_MAX)
+		len = FCGI_RECORD_MAX;
+	put_header(x->wbuf, FCGI_STDIN, len);
+	memcpy(x->wbuf + FCGI_HEADER_LEN, buf, len);
+	x->wlen = FCGI_HEADER_LEN + len;
+	x->took = 1;
+	if (send_records(x) < 0)
+		x->failed = 1;
+
+	return len;
+}
+
+/*
+ * Read records from the application as far as it has sent them, passing
+ * its stderr on to ours, up to the next piece of its stdout, of at most
+ * max bytes. Points *data at the piece and returns its length, or returns
+ * 0 once the request has ended, putting the connection back in the pool
+ * if it is fit for another, and -1 on error, with errno EAGAIN if there
+ * is nothing more yet.
+ */
+static ssize_t
+read_stdout(struct fcgi_exchange *x, char **data, size_t max) {
+
+	ssize_t n;
+	size_t len;
+
+	while (x->state != FCGI_DONE) {
+		if (x->hlen == FCGI_HEADER_LEN && x->clen == 0 && x->plen == 0) {
+			/* A whole record is in */
+			x->hlen = 0;
+			if (x->h[1] != FCGI_END_REQUEST)
+				continue;
+			if (x->end[4] != FCGI_REQUEST_COMPLETE) {
+				errno = EPROTO;
+				return -1;
+			}
+			x->state = FCGI_DONE;
+			conn_unwatch(x->conn, x->fd);
+			/* Anything sent past the end means trouble */
+			if (x->rpos == x->rlen)
+				put_conn(x->pool, x->fd);
+			else
+				close(x->fd);
+			x->fd = -1;
+			break;
+		}
+
+		if (x->rpos == x->rlen) {
+			if ((n = recv(x->fd, x->rbuf, sizeof(x->rbuf), 0)) < 0) {
+				if (errno == EINTR)
+					continue;
+				return -1;
+			}
+			if (n == 0) {
+				errno = EPIPE;
+				return -1;
+			}
+			x->rlen = n;
+			x->rpos = 0;
+			x->got = 1;
+		}
+		len = x->rlen - x->rpos;
+
+		if (x->hlen < FCGI_HEADER_LEN) {
+			if (len > FCGI_HEADER_LEN - x->hlen)
+				len = FCGI_HEADER_LEN - x->hlen;
+			memcpy(x->h + x->hlen, x->rbuf + x->rpos, len);
+			x->rpos += len;
+			if ((x->hlen += len) < FCGI_HEADER_LEN)
+				continue;
+			x->clen = (x->h[4] << 8) | x->h[5];
+			x->plen = x->h[6];
+			if (x->h[0] != FCGI_VERSION_1 || (x->h[1] == FCGI_END_REQUEST
+				&& x->clen != sizeof(x->end))) {
+				errno = EPROTO;
+				return -1;
+			}
+			continue;
+		}
+
+		if (x->clen == 0) {
+			if (len > x->plen)
+				len = x->plen;
+			x->rpos += len;
+			x->plen -= len;
+			continue;
+		}
+
+		if (len > x->clen)
+			len = x->clen;
+		if (x->h[1] == FCGI_STDOUT) {
+			if (len > max)
+				len = max;
+			*data = x->rbuf + x->rpos;
+			x->rpos += len;
+			x->clen -= len;
+			return len;
+		}
+		if (x->h[1] == FCGI_STDERR)
+			fwrite(x->rbuf + x->rpos, 1, len, stderr);
+		else if (x->h[1] == FCGI_END_REQUEST)
+			memcpy(x->end + sizeof(x->end) - x->clen,
+				x->rbuf + x->rpos, len);
+		x->rpos += len;
+		x->clen -= len;
+	}
+
+	return 0;
+}
+
+/*
+ * Produce the next piece of the output streamed to the client, from what
+ * the application has sent so far.
+ */
+static ssize_t
+fcgi_fill(void *arg, char *buf, size_t cap) {
+
+	struct fcgi_exchange *x = arg;
+	ssize_t n;
+	size_t len;
+	char *body, *p, *end, *data;
+	int i;
+
+	if (x->state == FCGI_DONE)
+		return 0;
+
+	body = p = buf + (x->chunked ? FCGI_CHUNK_HEAD : 0);
+	end = buf + cap - FCGI_CHUNK_TAIL;
+	n = 1;
+	while (p < end && (n = read_stdout(x, &data, end - p)) > 0)
+		if (!x->discard)
+			p = put(p, data, n);
+
+	/* Nothing yet, or an application that went away mid-response */
+	if (n < 0 && (errno != EAGAIN || p == body))
+		return -1;
+
+	if (!x->chunked)
+		return p - buf;
+
+	/* Chunk sizes may have leading zeros, so the size line fits in place */
+	if ((len = p - body) > 0) {
+		for (i = FCGI_CHUNK_HEAD - 3; i >= 0; i--, len >>= 4)
+			buf[i] = "0123456789abcdef"[len & 0xf];
+		buf[FCGI_CHUNK_HEAD - 2] = '\r';
+		buf[FCGI_CHUNK_HEAD - 1] = '\n';
+		p = PUT_LITERAL(p, "\r\n");
+	} else
+		p = buf;
+	if (n == 0)
+		p = PUT_LITERAL(p, "0\r\n\r\n");
+
+	return p - buf;
+}
+
+/*
+ * Send the request, body and all, as the application takes it, then read
+ * the output as far as its headers, and answer with them. Output that is
+ * all in by then goes out whole; the rest is queued to be streamed as it
+ * arrives. Returns 1 while the application is not ready for more.
+ */
+static int
+fcgi_resume(struct conn *conn, void *arg) {
+
+	struct fcgi_exchange *x = arg;
+	struct request *req;
+	struct response *resp;
+	ssize_t n, body;
+	size_t len;
+	int rval, bodyless;
+	char *data, *p;
+	char line[32];
+
+	req = conn->req;
+	resp = conn->resp;
+
+	/* Still this request's status, whatever others set meanwhile */
+	http_status = STATUS_200;
+
+	while (x->state == FCGI_SENDING) {
+		if (!x->failed && (rval = send_records(x)) != 0) {
+			if (rval == 1)
+				return 1;
+			x->failed = 1;
+		}
+		if (x->failed && retry_exchange(x) == 0)
+			continue;
+
+		/* After a failure, the body is read only to be thrown away */
+		if (req->unread) {
+			if ((rval = conn_read_body(conn, req, write_stdin, x)) == 1)
+				return 1;
+			if (rval < 0)
+				return sws_response_headers(conn, req, resp);
+			continue;
+		}
+
+		if (x->failed) {
+			http_status = STATUS_500;
+			return sws_response_headers(conn, req, resp);
+		}
+		if (x->stdin_done) {
+			x->state = FCGI_HEADERS;
+			break;
+		}
+
+		/* An empty record ends stdin */
+		put_header(x->wbuf, FCGI_STDIN, 0);
+		x->wlen = FCGI_HEADER_LEN;
+		x->stdin_done = 1;
+	}
+
+	while (x->state == FCGI_HEADERS && x->len < sizeof(x->out)) {
+		if ((n = read_stdout(x, &data, sizeof(x->out) - x->len)) > 0) {
+			memcpy(x->out + x->len, data, n);
+			x->len += n;
+			continue;
+		}
+		if (n == 0)
+			break;
+		if (errno == EAGAIN) {
+			if (sws_cgi_headers_end(x->out, x->len) >= 0)
+				break;
+			return 1;
+		}
+		if (retry_exchange(x) == 0)
+			return fcgi_resume(conn, x);
+		http_status = STATUS_500;
+		return sws_response_headers(conn, req, resp);
+	}
+
+	if ((body = sws_cgi_headers_end(x->out, x->len)) < 0
+		|| sws_parse_cgi_headers(req, resp, x->out, body) < 0) {
+		http_status = STATUS_500;
+		return sws_response_headers(conn, req, resp);
+	}
+
+	if (resp->content_type == NULL)
+		resp->content_type = "text/html";
+	bodyless = sws_cgi_bodyless(resp);
+
+	/* Then the connection can be kept alive whatever the client speaks */
+	if (x->state == FCGI_DONE) {
+		if (!bodyless)
+			resp->length = x->len - body;
+		if ((rval = sws_response_headers(conn, req, resp)) == 0
+			&& req->method != 1 && !bodyless)
+			rval = conn_write(conn, x->out + body, resp->length);
+		return rval;
+	}
+
+	resp->chunked = req->version != NULL && strcmp(req->version, "1.1") == 0
+		&& !bodyless;
+	if ((rval = sws_response_headers(conn, req, resp)) < 0)
+		return rval;
+
+	/* The rest of a HEAD response is read all the same, to end it */
+	x->discard = req->method == 1 || bodyless;
+	x->chunked = resp->chunked && !x->discard;
+
+	/* Output read along with the headers goes first, as a frame of its own */
+	if (!x->discard && (len = x->len - body) > 0) {
+		p = line;
+		if (x->chunked) {
+			p = put_hex(p, len);
+			p = PUT_LITERAL(p, CRLF);
+		}
+		if (conn_write(conn, line, p - line) < 0
+			|| conn_write(conn, x->out + body, len) < 0
+			|| (x->chunked && conn_write(conn, CRLF, 2) < 0))
+			return -1;
+	}
+
+	x->state = FCGI_STREAMING;
+	x->refs++;
+	return conn_queue_gen(conn, FCGI_CHUNK_HEAD + BUFF_SIZE + FCGI_CHUNK_TAIL,
+		fcgi_fill, put_exchange, x);
+}
+
+/*
+ * Run a request through the script's pool, with the connection suspended
+ * until the headers of the output are in. Output that comes whole with
+ * them is sent with a Content-Length; longer output is streamed, chunked
+ * for HTTP/1.1 clients and ended by closing the connection for others.
+ * Returns 1, having queued nothing, if no pool can be started, in which
+ * case the caller runs the script itself.
+ */
+int
+sws_execute_fcgi(struct conn *conn, struct request *req,
+	struct response *resp) {
+
+	struct fcgi_pool *pool;
+	struct fcgi_exchange *x;
+
+	if ((pool = get_pool(req->realpath)) == NULL)
+		return 1;
+
+	if ((x = calloc(1, sizeof(struct fcgi_exchange))) == NULL) {
+		fprintf(stderr, "calloc error\n");
+		http_status = STATUS_500;
+		return sws_response_headers(conn, req, resp);
+	}
+	x->conn = conn;
+	x->pool = pool;
+	x->refs = 1;
+	x->fd = -1;
+	x->next = pool->exchanges;
+	pool->exchanges = x;
+
+	if (start_exchange(x) < 0) {
+		put_exchange(x);
+		http_status = STATUS_500;
+		return sws_response_headers(conn, req, resp);
+	}
+
+	conn_suspend(conn, fcgi_resume, put_exchange, x);
+	return 0;
+}
@@ -0,0 +1,59 @@
+#ifndef _FCGI_H_
+#define _FCGI_H_
+
+#include <sys/types.h>
+
+#include "conn.h"
+#include "request.h"
+#include "response.h"
+
+/* Record types and roles of the FastCGI protocol we use */
+#define FCGI_VERSION_1 1
+#define FCGI_BEGIN_REQUEST 1
+#define FCGI_ABORT_REQUEST 2
+#define FCGI_END_REQUEST 3
+#define FCGI_PARAMS 4
+#define FCGI_STDIN 5
+#define FCGI_STDOUT 6
+#define FCGI_STDERR 7
+#define FCGI_RESPONDER 1
+#define FCGI_KEEP_CONN 1
+#define FCGI_REQUEST_COMPLETE 0
+
+/* Size of a record header, and most content one record carries */
+#define FCGI_HEADER_LEN 8
+#define FCGI_RECORD_MAX 65535
+
+/* Most scripts with a pool of processes, and idle connections per pool */
+#define FCGI_POOLS 32
+#define FCGI_IDLE_MAX 8
+
+/* Where each process makes a private directory for its pools' sockets */
+#define FCGI_SOCKET_DIR "/tmp"
+
+struct fcgi_exchange;
+
+/*
+ * The processes running one script as a FastCGI application. They share
+ * a listening UNIX socket, on which they accept connections from us;
+ * connections are kept open between requests and reused.
+ */
+struct fcgi_pool {
+	char *script;
+	char sockpath[108];
+	int listen_fd;
+	int nprocs;
+	pid_t *pids;
+	int idle[FCGI_IDLE_MAX];
+	int nidle;
+	/* Requests in progress, which may wait on a process to accept them */
+	struct fcgi_exchange *exchanges;
+};
+
+int fcgi_init(int);
+int fcgi_enabled(void);
+void fcgi_check(void);
+void fcgi_shutdown(void);
+int sws_execute_fcgi(struct conn*, struct request*, struct response*);
+
+#endif
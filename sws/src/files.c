@@ -1,14 +1,16 @@
 #define _XOPEN_SOURCE 1000
 #define _BSD_SOURCE 1000
 
+#include <sys/epoll.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
-#include <sys/wait.h>
 
 #include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <limits.h>
+#include <signal.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -17,304 +19,946 @@
 #include <time.h>
 #include <unistd.h>
 
+#include "conn.h"
 #include "content_type.h"
 #include "defines.h"
+#include "fcache.h"
+#include "fcgi.h"
 #include "files.h"
+#include "gzcache.h"
 #include "parse.h"
 #include "server.h"
+#include "stats.h"
 #include "utils.h"
 
-int
-sws_serve_file(int sock, struct request *req, struct response *resp) {
-	printf("entering serve_file\n");
-	FILE *file, *s;
+/* Precompressed siblings looked for next to a file, most preferred first */
+static const struct encoding {
+	int flag;
+	const char *suffix;
+	const char *coding;
+} encodings[] = {
+	{ ENCODING_BR, ".br", "br" },
+	{ ENCODING_GZIP, ".gz", "gzip" },
+};
+
+#define NENCODINGS (sizeof(encodings) / sizeof(encodings[0]))
+
+/*
+ * Return the ENCODING_ flags of the precompressed copies of path that
+ * exist as regular files. A copy older than the file itself is stale and
+ * is not counted.
+ */
+static int
+find_siblings(const char *path, time_t mtime) {
+
 	struct stat stat_buf;
-	struct tm time;
-	time_t req_time;
-	int n, lastmod_size;
-	char *tz, *tmp;
-	char buf[BUFF_SIZE];
-
-	//file existence already checked in server.c
-	//stat just for mtime
-	if (stat(req->realpath, &stat_buf) < 0) {
-		perror("stat");
+	size_t i;
+	int found;
+	char sibling[PATH_MAX];
+
+	found = 0;
+	for (i = 0; i < NENCODINGS; i++) {
+		if (snprintf(sibling, sizeof(sibling), "%s%s", path,
+			encodings[i].suffix) >= (int)sizeof(sibling))
+			continue;
+		if (stat(sibling, &stat_buf) == 0 && S_ISREG(stat_buf.st_mode)
+			&& stat_buf.st_mtime >= mtime)
+			found |= encodings[i].flag;
+	}
+
+	return found;
+}
+
+/*
+ * Return whether the list of entity tags in an If-None-Match names etag,
+ * or is "*". Tags are compared weakly, as that header asks.
+ */
+static int
+etag_listed(const char *list, const char *etag) {
+
+	const char *p, *tag;
+	size_t len;
+
+	len = strlen(etag);
+	for (p = list; *p != '\0'; ) {
+		for (; *p == ' ' || *p == '\t' || *p == ','; p++);
+		if (*p == '*')
+			return 1;
+		if (strncmp(p, "W/", 2) == 0)
+			p += 2;
+		if (*p != '"' || (tag = strchr(p + 1, '"')) == NULL)
+			return 0;
+		tag++;
+		if ((size_t)(tag - p) == len && strncmp(p, etag, len) == 0)
+			return 1;
+		p = tag;
+	}
+
+	return 0;
+}
+
+/*
+ * Turn the entity tag of a file into that of its encoding with the given
+ * coding, e.g. "...-gzip".
+ */
+static void
+etag_variant(char *etag, const char *coding) {
+
+	char *p;
+
+	p = etag + strlen(etag) - 1;
+	*p++ = '-';
+	p = put(p, coding, strlen(coding));
+	*p++ = '"';
+	*p = '\0';
+}
+
+/*
+ * Turn the entity tag of an encoding back into that of the file.
+ */
+static void
+etag_plain(char *etag, const char *coding) {
+
+	char *p;
+
+	p = etag + strlen(etag) - strlen(coding) - 2;
+	*p++ = '"';
+	*p = '\0';
+}
+
+/*
+ * Open the file at path for the request, or answer it with an error.
+ */
+static int
+open_file(struct conn *conn, struct request *req, struct response *resp,
+	const char *path) {
+
+	int fd;
+
+	stats_mark(&req->trace);
+	fd = open(path, O_RDONLY);
+	stats_phase(&req->trace, PHASE_OPEN);
+	if (fd < 0) {
+		perror("open");
+		http_status = (errno == EACCES) ? STATUS_403 : STATUS_500;
+		sws_response_headers(conn, req, resp);
+	}
+
+	return fd;
+}
+
+/*
+ * Queue a range of fd for sending from the connection's own copy of it.
+ */
+static int
+queue_range(struct conn *conn, int fd, struct byte_range *range) {
+
+	if ((fd = dup(fd)) < 0) {
+		perror("dup");
 		return -1;
 	}
 
-	if ((file = fopen(req->realpath, "r")) == NULL) {
-		perror("fopen");
-		http_status = STATUS_500;
+	/* The connection closes fd once the range is sent */
+	if (conn_queue_file(conn, fd, range->start, range->len) < 0) {
+		close(fd);
 		return -1;
 	}
 
-	if (req->if_mod_since != NULL) {
-		strptime(req->if_mod_since, req->date_format, &time);
-		tz = getenv("TZ");
-		if (setenv("TZ", "", 1) < 0) {
-			http_status = STATUS_500;
-			perror("setenv");
+	return 0;
+}
+
+/*
+ * Format the delimiter and headers that start one part of a
+ * multipart/byteranges body into buf and return their length.
+ */
+static int
+format_part(char *buf, size_t size, const char *boundary, const char *ctype,
+	struct byte_range *range, off_t file_size) {
+
+	return snprintf(buf, size, "\r\n--%s\r\n"
+		"Content-Type: %s\r\n"
+		"Content-Range: bytes %lld-%lld/%lld\r\n\r\n",
+		boundary, ctype, (long long)range->start,
+		(long long)(range->start + range->len - 1),
+		(long long)file_size);
+}
+
+/*
+ * Answer a Range request with a 206. A single range is sent straight
+ * from the file at its offset; several are sent as a multipart/byteranges
+ * body whose file parts are sent the same way. fd is not consumed.
+ */
+static int
+serve_ranges(struct conn *conn, struct request *req, struct response *resp,
+	int fd, off_t size, struct byte_range *ranges, int n) {
+
+	unsigned long total;
+	int i, len;
+	char *ctype;
+	char boundary[32];
+	char part[BUFF_SIZE];
+
+	http_status = STATUS_206;
+
+	if (n == 1) {
+		resp->length = ranges[0].len;
+		snprintf(resp->content_range, sizeof(resp->content_range),
+			"bytes %lld-%lld/%lld", (long long)ranges[0].start,
+			(long long)(ranges[0].start + ranges[0].len - 1),
+			(long long)size);
+		if (sws_response_headers(conn, req, resp) < 0)
+			return -1;
+		if (req->method != 0)
+			return 0;
+		return queue_range(conn, fd, &ranges[0]);
+	}
+
+	ctype = resp->content_type;
+	snprintf(boundary, sizeof(boundary), "%08lx%08lx",
+		(unsigned long)random(), (unsigned long)random());
+	snprintf(resp->content_type_buf, sizeof(resp->content_type_buf),
+		"multipart/byteranges; boundary=%s", boundary);
+	resp->content_type = resp->content_type_buf;
+
+	total = 0;
+	for (i = 0; i < n; i++)
+		total += format_part(part, sizeof(part), boundary, ctype,
+			&ranges[i], size) + ranges[i].len;
+	total += strlen("\r\n----\r\n") + strlen(boundary);
+	resp->length = total;
+
+	if (sws_response_headers(conn, req, resp) < 0)
+		return -1;
+	if (req->method != 0)
+		return 0;
+
+	for (i = 0; i < n; i++) {
+		len = format_part(part, sizeof(part), boundary, ctype,
+			&ranges[i], size);
+		if (conn_write(conn, part, len) < 0
+			|| queue_range(conn, fd, &ranges[i]) < 0)
+			return -1;
+	}
+
+	len = snprintf(part, sizeof(part), "\r\n--%s--\r\n", boundary);
+	return conn_write(conn, part, len);
+}
+
+int
+sws_serve_file(struct conn *conn, struct request *req, struct response *resp) {
+	printf("entering serve_file\n");
+	struct fcache_entry *fce, *enc;
+	struct gzcache_entry *gz;
+	struct byte_range ranges[RANGE_MAX];
+	struct stat stat_buf;
+	time_t mtime;
+	off_t size;
+	size_t i;
+	int compress, fd, nranges, rval, shrinks, siblings;
+	char *path, *tmp;
+	char sibling[PATH_MAX];
+
+	/* Cached files need no stat(), open() or date formatting */
+	stats_mark(&req->trace);
+	fce = fcache_get(req->realpath);
+	stats_phase(&req->trace, PHASE_OPEN);
+	if (fce != NULL) {
+		size = fce->size;
+		mtime = fce->mtime;
+		memcpy(resp->last_modified, fce->last_modified,
+			sizeof(resp->last_modified));
+		memcpy(resp->etag, fce->etag, sizeof(resp->etag));
+		resp->content_type = fce->content_type;
+	} else {
+		//file existence already checked in server.c
+		//stat just for mtime
+		rval = stat(req->realpath, &stat_buf);
+		stats_phase(&req->trace, PHASE_STAT);
+		if (rval < 0) {
+			perror("stat");
 			return -1;
 		}
-		tzset();
-		req_time = mktime(&time);
-		if (tz) {
-			if (setenv("TZ", tz, 1) < 0) {
-				perror("setenv");
-				http_status = STATUS_500;
-				return -1;
-			}
+		size = stat_buf.st_size;
+		mtime = stat_buf.st_mtime;
+
+		strftime(resp->last_modified, sizeof(resp->last_modified),
+			RFC1123_DATE, gmtime(&mtime));
+		make_etag(resp->etag, &stat_buf);
+		printf("getting content type\n");
+		if ((tmp = strrchr(req->realpath, '.')) != NULL)
+			tmp += 1;
+		resp->content_type = get_content_type(ctypes, tmp);
+		//	strrchr(req->realpath, '.'));
+	}
+
+	/*
+	 * Send a precompressed copy, foo.css.br or foo.css.gz, in place of
+	 * the file when the client accepts its coding. It keeps the file's
+	 * own type and date, but has its own entity tag. Cached files
+	 * remember which copies they have.
+	 */
+	path = req->realpath;
+	siblings = 0;
+	if (fce != NULL) {
+		if (fce->encodings < 0)
+			fce->encodings = find_siblings(path, mtime);
+		siblings = fce->encodings;
+	} else if (req->accept_encoding != 0)
+		siblings = find_siblings(path, mtime);
+	resp->vary = (siblings != 0);
+
+	for (i = 0; i < NENCODINGS; i++) {
+		if (!(siblings & req->accept_encoding & encodings[i].flag))
+			continue;
+		snprintf(sibling, sizeof(sibling), "%s%s", path,
+			encodings[i].suffix);
+		if (fce != NULL) {
+			/* Gone since it was looked for: send the file */
+			if ((enc = fcache_get(sibling)) == NULL)
+				break;
+			fce = enc;
+			size = fce->size;
+			memcpy(resp->etag, fce->etag, sizeof(resp->etag));
 		} else {
-			if (unsetenv("TZ") < 0) {
-				perror("setenv");
-				http_status = STATUS_500;
+			if (stat(sibling, &stat_buf) < 0)
+				break;
+			size = stat_buf.st_size;
+			make_etag(resp->etag, &stat_buf);
+		}
+		path = sibling;
+		resp->content_encoding = encodings[i].coding;
+		break;
+	}
+
+	/*
+	 * Failing that, text is gzipped as it is served, once per version of
+	 * the file. Ranges are always of the file itself.
+	 */
+	compress = 0;
+	if (resp->content_encoding == NULL
+		&& gzip_compressible(resp->content_type, size)) {
+		resp->vary = 1;
+		compress = (req->accept_encoding & ENCODING_GZIP)
+			&& req->range == NULL;
+	}
+
+	/*
+	 * The gzipped body has a tag of its own, which is the one to compare
+	 * with If-None-Match if that body is what would be sent, i.e. if the
+	 * file shrinks. Until it has been compressed that is not known, but a
+	 * client naming the gzip tag of this version of the file was sent it,
+	 * so only other clients have to wait for the compression.
+	 */
+	fd = -1;
+	gz = NULL;
+	if (compress) {
+		etag_variant(resp->etag, "gzip");
+		shrinks = gzcache_known(req->realpath, mtime, size);
+		if (shrinks < 0 && req->if_none_match != NULL
+			&& !etag_listed(req->if_none_match, resp->etag)) {
+			if (fce == NULL
+				&& (fd = open_file(conn, req, resp, path)) < 0)
 				return -1;
-			}
+			gz = gzcache_get(req->realpath,
+				fce != NULL ? fce->fd : fd, mtime, size);
+			shrinks = (gz != NULL);
+		}
+		if (shrinks == 0) {
+			etag_plain(resp->etag, "gzip");
+			compress = 0;
 		}
-		tzset();
-		if (req_time > stat_buf.st_mtime)
+	}
+
+	/*
+	 * Conditional requests are settled before the file is opened, unless
+	 * it was to be compressed above. An If-None-Match overrides
+	 * If-Modified-Since.
+	 */
+	if (req->if_none_match != NULL) {
+		if (etag_listed(req->if_none_match, resp->etag))
 			http_status = STATUS_304;
+	} else if (req->if_mod_since != -1 && mtime <= req->if_mod_since)
+		http_status = STATUS_304;
+
+	//TODO: change to 0 if 304
+	resp->length = size;
+	resp->ranges = 1;
+
+	/* A 304 needs nothing of the file, not even to have it open */
+	if (http_status != STATUS_200) {
+		if (fd >= 0)
+			close(fd);
+		return sws_response_headers(conn, req, resp);
 	}
 
-	lastmod_size = 64;
-	if ((resp->last_modified = malloc(lastmod_size)) == NULL) {
-		fprintf(stderr, "malloc error\n");
-		http_status = STATUS_500;
-		return -1;
+	/*
+	 * A Range is ignored if If-Range names another version of the file,
+	 * by entity tag, compared strongly, or by date.
+	 */
+	nranges = -1;
+	if (req->range != NULL && req->method != 2
+		&& (req->if_range == NULL ||
+		strcmp(req->if_range, (req->if_range[0] == '"') ?
+		resp->etag : resp->last_modified) == 0))
+		nranges = sws_parse_range(req->range, size, ranges, RANGE_MAX);
+
+	if (nranges == 0) {
+		http_status = STATUS_416;
+		snprintf(resp->content_range, sizeof(resp->content_range),
+			"bytes */%lld", (long long)size);
+		if (fd >= 0)
+			close(fd);
+		return sws_response_headers(conn, req, resp);
 	}
 
-	strftime(resp->last_modified, lastmod_size,
-		RFC1123_DATE, gmtime(&stat_buf.st_mtime));
-	//TODO: change to 0 if 304
-	resp->length = stat_buf.st_size;
-	printf("getting content type\n");
-	if ((tmp = strrchr(req->realpath, '.')) != NULL)
-		tmp += 1;
-	resp->content_type = get_content_type(ctypes, tmp);
-	//	strrchr(req->realpath, '.'));
-
-	sws_response_headers(sock, req, resp);
-
-	if ((s = fdopen(sock, "w")) == NULL) {
-		perror("fdopen");
-		exit(EXIT_FAILURE);
-		/* NOTREACHED */
+	/*
+	 * Small hot files are answered from a prebuilt response. Encoded
+	 * copies are not, as their entries may also be asked for by name.
+	 */
+	if (fce != NULL && size <= FCACHE_SMALL_FILE && req->method != 2
+		&& nranges < 0
+		&& resp->content_encoding == NULL && !compress
+		&& (rval = sws_response_cached(conn, req, resp, fce)) <= 0)
+		return rval;
+
+	if (fce == NULL && fd < 0
+		&& (fd = open_file(conn, req, resp, path)) < 0)
+		return -1;
+
+	if (compress && (gz != NULL || (gz = gzcache_get(req->realpath,
+		fce != NULL ? fce->fd : fd, mtime, size)) != NULL)) {
+		resp->content_encoding = "gzip";
+		resp->length = gz->len;
+		rval = sws_response_headers(conn, req, resp);
+		if (rval == 0 && req->method == 0)
+			rval = conn_write(conn, gz->data, gz->len);
+		if (fd >= 0)
+			close(fd);
+		return rval;
+	} else if (compress)
+		/* Not worth compressing: the tag of the file itself */
+		etag_plain(resp->etag, "gzip");
+
+	if (nranges > 0) {
+		rval = serve_ranges(conn, req, resp, fce != NULL ? fce->fd : fd,
+			size, ranges, nranges);
+		if (fd >= 0)
+			close(fd);
+		return rval;
 	}
 
-	if (req->method == 0 &&
-		strcmp(http_status, STATUS_200) == 0) {
-		memset(buf, 0, sizeof(buf));
-		while ((n = fread(buf, sizeof(buf), 1, file)) > 0) {
-			//TODO: error check
-			fwrite(buf, sizeof(buf), 1, s);
+	sws_response_headers(conn, req, resp);
+
+	if (req->method == 0) {
+		/* The cache keeps its fd; the connection gets its own */
+		if (fce != NULL && (fd = dup(fce->fd)) < 0) {
+			perror("dup");
+			return -1;
 		}
-		//flush
-		fwrite(buf, sizeof(buf), 1, s);
-	}
-	fclose(s);
-	fclose(file);
+		/* The connection closes fd once the body is sent */
+		if (conn_queue_file(conn, fd, 0, size) < 0) {
+			close(fd);
+			return -1;
+		}
+	} else if (fd >= 0)
+		close(fd);
 	printf("leaving serve_file\n");
 	return 0;
 }
 
-int
-sws_execute_cgi(int sock, struct request *req, struct response *resp) {
-	printf("in exec cgi\n");
-	struct stat stat_buf;
-	pid_t pid;
-	int i, n, status, flag;
-	int content_fd[2];
-	int size_fd[2];
-	char server_name[HOST_NAME_MAX];
-	char buf[BUFF_SIZE];
-	//char last_mod[64];
-	char c[2];
-
-	if (req->method == 2 && req->length < 0) {
-		http_status = STATUS_400;
-		return -1;
+/*
+ * Describe the request to a CGI script in its environment.
+ */
+static void
+cgi_environment(struct request *req) {
+
+	char len[32];
+	char server_name[HOST_NAME_MAX + 1];
+
+	if (gethostname(server_name, sizeof(server_name)) < 0)
+		strcpy(server_name, "localhost");
+
+	setenv("GATEWAY_INTERFACE", "CGI/1.1", 1);
+	setenv("SERVER_SOFTWARE", "SWS/1.0", 1);
+	setenv("SERVER_NAME", server_name, 1);
+	setenv("SERVER_PROTOCOL", req->simple ? "HTTP/0.9"
+		: (req->version[0] == '1' && req->version[2] == '1')
+		? "HTTP/1.1" : "HTTP/1.0", 1);
+	setenv("REQUEST_METHOD", req->method == 0 ? "GET"
+		: req->method == 1 ? "HEAD" : "POST", 1);
+	setenv("REQUEST_URI", req->path, 1);
+	setenv("SCRIPT_NAME", req->path, 1);
+	setenv("SCRIPT_FILENAME", req->realpath, 1);
+	setenv("QUERY_STRING", "", 1);
+	setenv("REMOTE_ADDR", req->ip, 1);
+	if (req->length != (unsigned long)-1) {
+		*put_ulong(len, req->length) = '\0';
+		setenv("CONTENT_LENGTH", len, 1);
+	}
+	if (req->content_type != NULL)
+		setenv("CONTENT_TYPE", req->content_type, 1);
+}
+
+/*
+ * Pass a piece of the request body on to a script's stdin, as much of it
+ * as the pipe takes.
+ */
+static ssize_t
+cgi_write(void *arg, const char *buf, size_t len) {
+
+	ssize_t n;
+	size_t done;
+
+	for (done = 0; done < len; done += n) {
+		if ((n = write(*(int*)arg, buf + done, len - done)) < 0) {
+			if (errno == EINTR) {
+				n = 0;
+				continue;
+			}
+			if (errno == EAGAIN)
+				break;
+			/* The script need not read it all */
+			if (errno != EPIPE)
+				perror("writing cgi input");
+			return -1;
+		}
+	}
+
+	return done;
+}
+
+/* A CGI script's response, until its headers are in */
+struct cgi {
+	struct conn *conn;
+	/* Write end of its stdin, until the request body is all in */
+	int in;
+	/* Read end of its stdout */
+	int fd;
+	size_t len;
+	char buf[CGI_HEADERS_MAX];
+};
+
+static void
+cgi_release(void *arg) {
+
+	struct cgi *cgi = arg;
+
+	if (cgi->in >= 0) {
+		conn_unwatch(cgi->conn, cgi->in);
+		close(cgi->in);
+	}
+	if (cgi->fd >= 0) {
+		conn_unwatch(cgi->conn, cgi->fd);
+		close(cgi->fd);
+	}
+	free(cgi);
+}
+
+/*
+ * Feed the request body to a script as far as it has come, then read the
+ * headers of its output as far as they have come, and once they are all
+ * in, answer with them and queue the rest of the output. Returns 1 if a
+ * non-blocking socket or pipe is not ready for more yet.
+ */
+static int
+cgi_resume(struct conn *conn, void *arg) {
+
+	struct cgi *cgi = arg;
+	struct request *req;
+	struct response *resp;
+	ssize_t n, body;
+	size_t len;
+	int rval;
+	char *p;
+	char line[32];
+
+	req = conn->req;
+	resp = conn->resp;
+
+	/* Still this request's status, whatever others set meanwhile */
+	http_status = STATUS_200;
+
+	/* Through a pipe's worth of buffering, so an upload is never held */
+	if (cgi->in >= 0) {
+		if ((rval = conn_read_body(conn, req, cgi_write, &cgi->in)) == 1)
+			return 1;
+		conn_unwatch(conn, cgi->in);
+		close(cgi->in);
+		cgi->in = -1;
+		if (rval < 0)
+			return sws_response_headers(conn, req, resp);
+	}
+
+	while ((body = sws_cgi_headers_end(cgi->buf, cgi->len)) < 0
+		&& cgi->len < sizeof(cgi->buf)) {
+		if ((n = read(cgi->fd, cgi->buf + cgi->len,
+			sizeof(cgi->buf) - cgi->len)) < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN)
+				return 1;
+			perror("reading cgi output");
+		}
+		if (n <= 0)
+			break;
+		cgi->len += n;
 	}
 
-	if (stat(req->realpath, &stat_buf) < 0) {
-		perror("stat");
+	if (body < 0 || sws_parse_cgi_headers(req, resp, cgi->buf, body) < 0) {
 		http_status = STATUS_500;
-		return -1;
+		return sws_response_headers(conn, req, resp);
 	}
 
-	if (pipe(size_fd) < 0) {
+	if (resp->content_type == NULL)
+		resp->content_type = "text/html";
+	resp->chunked = req->version != NULL && strcmp(req->version, "1.1") == 0
+		&& !sws_cgi_bodyless(resp);
+
+	rval = sws_response_headers(conn, req, resp);
+	if (rval < 0 || req->method == 1 || sws_cgi_bodyless(resp))
+		return rval;
+
+	/* Output read along with the headers goes first, as a frame of its own */
+	if ((len = cgi->len - body) > 0) {
+		p = line;
+		if (resp->chunked) {
+			p = put_hex(p, len);
+			p = PUT_LITERAL(p, CRLF);
+		}
+		if (conn_write(conn, line, p - line) < 0
+			|| conn_write(conn, cgi->buf + body, len) < 0
+			|| (resp->chunked && conn_write(conn, CRLF, 2) < 0))
+			return -1;
+	}
+
+	conn_unwatch(conn, cgi->fd);
+	if (conn_queue_pipe(conn, cgi->fd,
+		resp->chunked ? PIPE_CHUNKED : PIPE_RAW) < 0)
+		return -1;
+	cgi->fd = -1;
+
+	return 0;
+}
+
+/*
+ * Run a CGI script and stream its output. The request body, if any, is
+ * fed to its stdin as it arrives, before its output is read. Its headers
+ * are read whole and answered at once; the body is forwarded from the
+ * pipe as the script writes it, chunked for HTTP/1.1 clients so the
+ * connection can be kept alive, and ended by closing the connection for
+ * the others. In the event loop, the connection is suspended while the
+ * request body goes in and the headers come out, rather than holding up
+ * the loop.
+ */
+int
+sws_execute_cgi(struct conn *conn, struct request *req, struct response *resp) {
+
+	struct cgi *cgi;
+	pid_t pid;
+	int rval, in[2], fds[2];
+
+	if (fcgi_enabled() && (rval = sws_execute_fcgi(conn, req, resp)) != 1)
+		return rval;
+
+	if (pipe(in) < 0) {
 		perror("pipe");
 		http_status = STATUS_500;
-		return -1;
+		return sws_response_headers(conn, req, resp);
 	}
-	if (pipe(content_fd) < 0) {
+	if (pipe(fds) < 0) {
 		perror("pipe");
+		close(in[0]);
+		close(in[1]);
 		http_status = STATUS_500;
-		return -1;
+		return sws_response_headers(conn, req, resp);
 	}
+	/* Scripts started later must not hold on to this one's pipes */
+	fcntl(in[1], F_SETFD, FD_CLOEXEC);
+	fcntl(fds[0], F_SETFD, FD_CLOEXEC);
 
 	if ((pid = fork()) < 0) {
 		perror("forking for cgi");
+		close(in[0]);
+		close(in[1]);
+		close(fds[0]);
+		close(fds[1]);
 		http_status = STATUS_500;
-		return -1;
+		return sws_response_headers(conn, req, resp);
 	}
 
 	if (pid == 0) {
-		//set env vars
-		if (putenv("SERVER_SOFTWARE=SWS/1.0") != 0) {
-			perror("putenv");
-			http_status = STATUS_500;
-			return -1;
-		}
-		if (gethostname(server_name, sizeof(server_name)) < 0) {
-			perror("gethostname");
-			http_status = STATUS_500;
-			return -1;
-		}
-		sprintf(buf, "SERVER_NAME=%s", server_name);
-		if (putenv(buf) != 0) {
-			perror("putenv");
-			http_status = STATUS_500;
-			return -1;
-		}
-		/*bzero(buf, sizeof(buf));
-		sprintf(buf, "SERVER_PORT=%d", __sws_port);
-		if (putenv(buf) != 0) {
-			perror("putenv");
-			http_status = STATUS_500;
-			return -1;
-		}*/
-		//...
+		/* Scripts should see the default SIGPIPE, not ours */
+		signal(SIGPIPE, SIG_DFL);
 
-		close(size_fd[0]);
-		close(content_fd[0]);
-
-		if (dup2(size_fd[1], STDOUT_FILENO) < 0) {
+		if (dup2(in[0], STDIN_FILENO) < 0
+			|| dup2(fds[1], STDOUT_FILENO) < 0) {
 			perror("dup2");
-			http_status = STATUS_500;
-			return -1;
+			_exit(EXIT_FAILURE);
 		}
+		if (in[0] != STDIN_FILENO)
+			close(in[0]);
+		if (fds[1] != STDOUT_FILENO)
+			close(fds[1]);
+		cgi_environment(req);
 
-		if (execl(req->realpath, req->realpath, NULL) < 0) {
-			perror("execl");
-			close(size_fd[1]);
-			exit(EXIT_FAILURE);
-			/* NOTREACHED */
-		}
-		close(size_fd[1]);
+		execl(req->realpath, req->realpath, NULL);
+		perror("execl");
+		_exit(EXIT_FAILURE);
+		/* NOTREACHED */
+	}
+	close(in[0]);
+	close(fds[1]);
 
-		if (dup2(content_fd[1], STDOUT_FILENO) < 0) {
-			perror("dup2");
+	if ((cgi = malloc(sizeof(struct cgi))) == NULL) {
+		fprintf(stderr, "malloc error\n");
+		close(in[1]);
+		close(fds[0]);
+		http_status = STATUS_500;
+		return sws_response_headers(conn, req, resp);
+	}
+	cgi->conn = conn;
+	cgi->in = in[1];
+	cgi->fd = fds[0];
+	cgi->len = 0;
+
+	if (conn->epfd >= 0) {
+		if (fcntl(in[1], F_SETFL, O_NONBLOCK) < 0
+			|| fcntl(fds[0], F_SETFL, O_NONBLOCK) < 0
+			|| conn_watch(conn, in[1], EPOLLOUT) < 0
+			|| conn_watch(conn, fds[0], EPOLLIN) < 0) {
+			cgi_release(cgi);
 			http_status = STATUS_500;
-			return -1;
+			return sws_response_headers(conn, req, resp);
 		}
+		conn_suspend(conn, cgi_resume, cgi_release, cgi);
+		return 0;
+	}
+
+	rval = cgi_resume(conn, cgi);
+	cgi_release(cgi);
+	return rval;
+}
+
+/* Progress of a directory listing */
+#define INDEX_HEAD 0
+#define INDEX_ENTRIES 1
+#define INDEX_FOOT 2
+#define INDEX_DONE 3
+
+/* Room for a chunk-size line, kept at a fixed width, and the last chunk */
+#define INDEX_CHUNK_HEAD 8
+#define INDEX_CHUNK_TAIL (sizeof("\r\n0\r\n\r\n") - 1)
+
+#define INDEX_FOOTER "<p style=\"font-style:italic\">SWS 1.0</p></body></html>"
+
+/*
+ * A directory listing being streamed. Entries are read one at a time as
+ * the connection drains, so listing a huge directory needs no more memory
+ * than a small one; they come in directory order rather than sorted.
+ */
+struct dir_index {
+	DIR *dp;
+	int state;
+	int chunked;
+	/* Directory name in the heading, and its parent's link */
+	char *title;
+	char *parent;
+	/* Link to the directory, which entry names are appended to */
+	char *prefix;
+	size_t prefix_len;
+	/* Copy of the body for the file cache, while it stays small enough */
+	char *path;
+	unsigned long serial;
+	char *copy;
+	size_t copy_len;
+	size_t copy_cap;
+};
+
+static void
+free_index(void *arg) {
+
+	struct dir_index *di = arg;
+
+	if (di->dp)
+		closedir(di->dp);
+	free(di->title);
+	free(di->parent);
+	free(di->prefix);
+	free(di->path);
+	free(di->copy);
+	free(di);
+}
+
+/*
+ * Largest piece of HTML one entry can need.
+ */
+static size_t
+index_entry_max(struct dir_index *di) {
+
+	return di->prefix_len + 2 * NAME_MAX + 32;
+}
+
+static int
+index_isdir(struct dir_index *di, struct dirent *dir) {
+
+	struct stat stat_buf;
+
+	if (dir->d_type == DT_DIR)
+		return 1;
+	if (dir->d_type != DT_UNKNOWN && dir->d_type != DT_LNK)
+		return 0;
+
+	/* Links and filesystems without d_type need a stat */
+	if (fstatat(dirfd(di->dp), dir->d_name, &stat_buf, 0) < 0)
+		return 0;
+	return S_ISDIR(stat_buf.st_mode);
+}
+
+/*
+ * Append a piece of the listing body to the copy kept for the cache,
+ * giving up on the copy if the listing grows too large.
+ */
+static void
+index_copy(struct dir_index *di, const char *body, size_t len) {
 
-		if (execl(req->realpath, req->realpath, NULL) < 0) {
-			perror("execl");
-			close(content_fd[1]);
-			exit(EXIT_FAILURE);
-			/* NOTREACHED */
+	char *copy;
+	size_t cap;
+
+	if (di->copy_len + len > di->copy_cap) {
+		for (cap = di->copy_cap; cap < di->copy_len + len; cap *= 2)
+			;
+		if (cap > FCACHE_LISTING_MAX
+			|| (copy = realloc(di->copy, cap)) == NULL) {
+			free(di->copy);
+			di->copy = NULL;
+			return;
 		}
-		close(content_fd[1]);
+		di->copy = copy;
+		di->copy_cap = cap;
+	}
 
-		exit(EXIT_SUCCESS);
-		/* NOTREACHED */
-	} else {
-		flag = 0;
-		//consume headers
-		while (n > 0) {
-			if ((n = read(content_fd[0], c, 1)) < 0) {
-				perror("reading cgi headers");
+	memcpy(di->copy + di->copy_len, body, len);
+	di->copy_len += len;
+}
+
+static ssize_t
+index_fill(void *arg, char *buf, size_t cap) {
+
+	struct dir_index *di = arg;
+	struct dirent *dir;
+	size_t len, max;
+	char *body, *p, *end;
+	int i, isdir;
+
+	if (di->state == INDEX_DONE)
+		return 0;
+
+	body = p = buf + (di->chunked ? INDEX_CHUNK_HEAD : 0);
+	end = buf + cap - INDEX_CHUNK_TAIL;
+
+	if (di->state == INDEX_HEAD) {
+		p = PUT_LITERAL(p, "<html><body><h1>Index of ");
+		p = put(p, di->title, strlen(di->title));
+		p = PUT_LITERAL(p, "</h1><br /><a href=\"");
+		p = put(p, di->parent, strlen(di->parent));
+		p = PUT_LITERAL(p, "/\">Parent Directory/</a><br />");
+		di->state = INDEX_ENTRIES;
+	}
+
+	max = index_entry_max(di);
+	while (di->state == INDEX_ENTRIES && (size_t)(end - p) >= max) {
+		errno = 0;
+		if ((dir = readdir(di->dp)) == NULL) {
+			if (errno) {
+				perror("readdir");
 				return -1;
 			}
-			if (c[0] == '\n') {
-				if (flag)
-					break;
-				flag = 1;
-				if (strncasecmp(buf, "Content-Type:", 13) == 0) {
-					if (resp->content_type != NULL) {
-						free(resp->content_type);
-						resp->content_type = NULL;
-					}
-					if ((resp->content_type = malloc(strlen(buf)+13+1)) == NULL) {
-						perror("malloc");
-						return -1;
-					}
-					for (i = 14; buf[i] == ' '; i++);
-					strncpy(resp->content_type, &buf[i], strlen(buf));
-				}
-				if (strncasecmp(buf, "Content-Length:", 15) == 0) {
-					for (i = 15; buf[i] == ' '; i++);
-					buf[strlen(buf)-1] = '\0';
-					resp->length = atoi(&buf[i]);
-				}
-				memset(buf, 0, sizeof(buf));
-			} else {
-				strncat(buf, c, 1);
-				flag = 0;
-			}
+			di->state = INDEX_FOOT;
+			break;
 		}
-		flag = 0;
 
-		n = 0;
-		//TODO: Read cgi output in pieces
-		while ((n += read(size_fd[0], buf, sizeof(buf))) > 0);
-		if (errno) {
-			perror("read");
-			http_status = STATUS_500;
-			return -1;
-		}
+		if (strcmp(dir->d_name, ".") == 0 ||
+			strcmp(dir->d_name, "..") == 0)
+			continue;
 
-		if (resp->length == 0)
-			resp->length = n;
+		isdir = index_isdir(di, dir);
+		len = strlen(dir->d_name);
+		p = PUT_LITERAL(p, "<a href=\"");
+		p = put(p, di->prefix, di->prefix_len);
+		p = put(p, dir->d_name, len);
+		if (isdir)
+			p = PUT_LITERAL(p, "/");
+		p = PUT_LITERAL(p, "\">");
+		p = put(p, dir->d_name, len);
+		if (isdir)
+			p = PUT_LITERAL(p, "/");
+		p = PUT_LITERAL(p, "</a><br />");
+	}
 
-		if (resp->content_type == NULL) {
-			resp->content_type = "text/html";
-			flag = 1;
-		}
-		sws_response_headers(sock, req, resp);
-
-		//read contents
-		while (read(content_fd[0], buf, sizeof(buf)) > 0) {
-			if (send(sock, buf, strlen(buf), 0) < 0) {
-				perror("send");
-				exit(EXIT_FAILURE);
-				/* NOTREACHED */
-			}
-		}
-		if (errno)
-			perror("read");
+	if (di->state == INDEX_FOOT &&
+		(size_t)(end - p) >= sizeof(INDEX_FOOTER) - 1) {
+		p = PUT_LITERAL(p, INDEX_FOOTER);
+		di->state = INDEX_DONE;
+	}
 
-		if (resp->content_type != NULL && flag != 1) {
-			free(resp->content_type);
-			resp->content_type = NULL;
-		}
-		waitpid(pid, &status, 0);
+	if (di->copy != NULL) {
+		index_copy(di, body, p - body);
+		if (di->copy != NULL && di->state == INDEX_DONE &&
+			fcache_store_listing(di->path, di->serial,
+			di->copy, di->copy_len) == 0)
+			di->copy = NULL;
 	}
 
-	return 0;
+	if (!di->chunked)
+		return p - buf;
+
+	/* Chunk sizes may have leading zeros, so the size line fits in place */
+	len = p - buf - INDEX_CHUNK_HEAD;
+	for (i = INDEX_CHUNK_HEAD - 3; i >= 0; i--, len >>= 4)
+		buf[i] = "0123456789abcdef"[len & 0xf];
+	buf[INDEX_CHUNK_HEAD - 2] = '\r';
+	buf[INDEX_CHUNK_HEAD - 1] = '\n';
+	p = PUT_LITERAL(p, "\r\n");
+	if (di->state == INDEX_DONE)
+		p = PUT_LITERAL(p, "0\r\n\r\n");
+
+	return p - buf;
 }
 
+/*
+ * Answer a request for a directory without an index.html with a listing
+ * of its entries. The listing is generated as it is sent, with chunked
+ * encoding for HTTP/1.1 clients and by closing the connection otherwise.
+ */
 int
-sws_create_index(int sock, struct request *req, struct response *resp, char *serve_dir) {
+sws_create_index(struct conn *conn, struct request *req, struct response *resp, char *serve_dir) {
 	printf("index\n");
-	DIR *dp;
-	struct dirent **dirlist;
-	struct stat stat_buf;
-	int i, j, n, pos;
+	struct fcache_entry *fce;
+	struct dir_index *di;
+	size_t len;
+	int pos;
 	int username_len, home_path_len;
 	int homedir;
-	char buf[PATH_MAX];
-	char *tmp, *username;
-	char index[BUFF_SIZE];
+	char *tmp, *username, *p;
 
-	memset(index, 0, sizeof(index));
-	if ((dp = opendir(req->realpath)) == NULL) {
-		perror("opendir");
+	resp->content_type = "text/html";
+	resp->last_modified[0] = '\0';
+
+	if ((di = calloc(1, sizeof(struct dir_index))) == NULL) {
+		fprintf(stderr, "calloc error\n");
 		http_status = STATUS_500;
-		return -1;
+		return sws_response_headers(conn, req, resp);
 	}
 
-	homedir = home_path_len = 0;
+	if ((di->dp = opendir(req->realpath)) == NULL) {
+		perror("opendir");
+		free_index(di);
+		http_status = (errno == EACCES) ? STATUS_403 : STATUS_500;
+		return sws_response_headers(conn, req, resp);
+	}
+
+	homedir = home_path_len = username_len = 0;
+	username = NULL;
 
 	if (req->path[1] == '~') {
 		homedir = 1;
@@ -328,93 +972,92 @@ sws_create_index(int sock, struct request *req, struct response *resp, char *ser
 		tmp = req->realpath + strlen(serve_dir);
 	}
 
-	strncpy(index, "<html><body><h1>Index of ", 25);
+	/* Every string is at most tmp plus "/~username" and a "/" */
+	len = strlen(tmp);
+	if ((di->title = calloc(1, len + username_len + 3)) == NULL
+		|| (di->parent = calloc(1, len + username_len + 3)) == NULL
+		|| (di->prefix = calloc(1, len + username_len + 4)) == NULL) {
+		fprintf(stderr, "calloc error\n");
+		free_index(di);
+		http_status = STATUS_500;
+		return sws_response_headers(conn, req, resp);
+	}
+
+	p = di->title;
 	if (homedir) {
-		strncat(index, "~", 1);
-		strncat(index, username, username_len);
+		p = PUT_LITERAL(p, "~");
+		p = put(p, username, username_len);
 	}
-	if (strlen(tmp) == 0)
-		strncat(index, "/", 1);
+	if (len == 0)
+		p = PUT_LITERAL(p, "/");
 	else
-		strncat(index, tmp, strlen(tmp));
-	strncat(index, "</h1><br />", 11);
+		p = put(p, tmp, len);
 
-	if ((n = scandir(req->realpath, &dirlist, NULL, alphasort)) < 0) {
-		perror("scandir");
-		return -1;
+	pos = strrchr_pos(tmp, '/', len);
+	p = di->parent;
+	if (homedir) {
+		p = PUT_LITERAL(p, "/~");
+		p = put(p, username, username_len);
 	}
-	//printf("tmp:%s\n", tmp);
-	for (i = 0; i < n; i++) {
-		memset(buf, 0, sizeof(buf));
-		/*strncpy(buf, req->realpath, strlen(req->realpath));
-		strncat(buf, "/", 1);
-		strncat(buf, dirlist[i]->d_name, strlen(dirlist[i]->d_name));*/
-		concat(buf, 3, req->realpath, "/", dirlist[i]->d_name);
-		if (stat(buf, &stat_buf) < 0) {
-			perror("stat");
-			http_status = STATUS_500;
-			return -1;
-		}
-		//printf("buf:%s\n", buf);
-
-		if (strcmp(dirlist[i]->d_name, ".") != 0 &&
-			strcmp(dirlist[i]->d_name, "..") != 0) {
-			strncat(index, "<a href=\"", 9);
-			//append '/~username'
-			if (homedir) {
-				strncat(index, "/~", 2);
-				strncat(index, username, username_len);
-				//need a 'conncat' for this
-				//concat(index, 2, "/~", username);
-			}
-			concat(index, 3, tmp,
-				(tmp[strlen(tmp)-1] == '/')? "" : "/",
-				dirlist[i]->d_name);
-			if (S_ISDIR(stat_buf.st_mode))
-				strncat(index, "/", 1);
-			concat(index, 2, "\">", dirlist[i]->d_name);
-			//strncat(index, "\">", 2);
-			//strncat(index, dirlist[i]->d_name,
-			//	strlen(dirlist[i]->d_name));
-			if (S_ISDIR(stat_buf.st_mode))
-				strncat(index, "/", 1);
-			strncat(index, "</a><br />", 10);
-		}
+	if (pos > 0)
+		p = put(p, tmp, pos);
 
-		if (strcmp(dirlist[i]->d_name, "..") == 0) {
-			strncat(index, "<a href=\"", 9);
-			pos = strrchr_pos(tmp, '/', strlen(tmp));
-			if (homedir) {
-				strncat(index, "/~", 2);
-				strncat(index, username, username_len);
-			}
-			for (j = 0; j < pos; j++) {
-				strncat(index, &tmp[j], 1);
-			}
-			/*strncat(index, "/", 1);
-			strncat(index, "\">", 2);
-			strncat(index, "Parent Directory/</a><br />", 27);*/
-			concat(index, 3, "/", "\">",
-				"Parent Directory/</a><br />");
-		}
-		free(dirlist[i]);
+	p = di->prefix;
+	if (homedir) {
+		p = PUT_LITERAL(p, "/~");
+		p = put(p, username, username_len);
 	}
-	free(dirlist);
+	p = put(p, tmp, len);
+	if (len == 0 || tmp[len - 1] != '/')
+		p = PUT_LITERAL(p, "/");
+	di->prefix_len = p - di->prefix;
 
-	strncat(index, "<p style=\"font-style:italic\">SWS 1.0</p>", 40);
-	strncat(index, "</body></html>", 14);
-	resp->length = strlen(index);
-	resp->content_type = "text/html";
-	resp->last_modified = NULL;
-	sws_response_headers(sock, req, resp);
+	di->chunked = req->version != NULL && strcmp(req->version, "1.1") == 0;
+	resp->chunked = di->chunked;
+	sws_response_headers(conn, req, resp);
 
-	if (req->method == 0) {
-		if (send(sock, index, strlen(index), 0) < 0) {
-			perror("send");
-			exit(EXIT_FAILURE);
-			/* NOTREACHED */
+	if (req->method != 0) {
+		free_index(di);
+		return 0;
+	}
+
+	/*
+	 * Keep a copy of the listing for the cache. The directory's entry is
+	 * made before the listing is read, so that any change to it from
+	 * here on keeps a stale copy from being stored.
+	 */
+	if ((fce = fcache_get_dir(req->realpath, homedir)) != NULL) {
+		fcache_stats.listing_misses++;
+		di->serial = fce->serial;
+		di->copy_cap = CHUNK_SIZE;
+		if ((di->path = strdup(req->realpath)) == NULL
+			|| (di->copy = malloc(di->copy_cap)) == NULL) {
+			free(di->path);
+			di->path = NULL;
 		}
 	}
 
+	/* The connection frees di once the listing is sent */
+	return conn_queue_gen(conn, INDEX_CHUNK_HEAD + 2 * index_entry_max(di)
+		+ len + CHUNK_SIZE, index_fill, free_index, di);
+}
+
+/*
+ * Answer a request for a directory from its cached listing.
+ */
+int
+sws_index_cached(struct conn *conn, struct request *req, struct response *resp,
+	struct fcache_entry *fce) {
+
+	fcache_stats.listing_hits++;
+
+	resp->content_type = "text/html";
+	resp->length = fce->response_len;
+	if (sws_response_headers(conn, req, resp) < 0)
+		return -1;
+
+	if (req->method == 0)
+		return conn_write(conn, fce->response, fce->response_len);
+
 	return 0;
 }
@@ -1,11 +1,15 @@
 #ifndef _FILES_H_
 #define _FILES_H_
 
+#include "conn.h"
+#include "fcache.h"
 #include "request.h"
 #include "response.h"
 
-int sws_create_index(int, struct request*, struct response*, char*);
-int sws_serve_file(int, struct request*, struct response*);
-int sws_execute_cgi(int, struct request*, struct response*);
+int sws_create_index(struct conn*, struct request*, struct response*, char*);
+int sws_index_cached(struct conn*, struct request*, struct response*,
+	struct fcache_entry*);
+int sws_serve_file(struct conn*, struct request*, struct response*);
+int sws_execute_cgi(struct conn*, struct request*, struct response*);
 void concat(char*, int, ...);
 #endif
@@ -0,0 +1,277 @@
+/*
+ * gzcache.c - Cache of files compressed on the fly
+ *
+ * Text files without a precompressed copy are gzipped the first time a
+ * client that accepts gzip asks for them, at the level given with -z, and
+ * the result is kept keyed by the file's path, mtime and size, so each
+ * version of a file is compressed only once. Files that do not shrink are
+ * remembered as such. Compressed files share a memory budget; when it
+ * runs out, the least recently used ones are dropped first.
+ *
+ * Only the event loop compresses: a process forked for one request would
+ * start with an empty cache and gzip the file anew every time.
+ */
+#include <sys/types.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "gzcache.h"
+#include "server.h"
+#include "utils.h"
+
+/* deflateInit2() window bits asking for a gzip header and trailer */
+#define GZIP_WINDOW (15 + 16)
+
+struct gzcache_stats gzcache_stats;
+
+static int enabled;
+
+static struct gzcache_entry *buckets[GZCACHE_BUCKETS];
+static struct gzcache_entry *lru_head, *lru_tail;
+
+/* Media types worth compressing, by prefix */
+static const char *compressible[] = {
+	"text/",
+	"application/javascript",
+	"application/json",
+	"application/xml",
+	"image/svg+xml",
+	NULL
+};
+
+/*
+ * Compress files on the fly in this process, which lives long enough to
+ * serve them again from the cache.
+ */
+void
+gzcache_init(void) {
+
+	enabled = 1;
+}
+
+/*
+ * Return whether a file of the given type and size is gzipped on the fly.
+ */
+int
+gzip_compressible(const char *content_type, off_t size) {
+
+	int i;
+
+	if (!enabled || __sws_gzip_level == 0 || __sws_gzcache_size == 0
+		|| content_type == NULL
+		|| size < GZIP_MIN_SIZE || size > GZIP_MAX_SIZE)
+		return 0;
+
+	for (i = 0; compressible[i] != NULL; i++)
+		if (strncasecmp(content_type, compressible[i],
+			strlen(compressible[i])) == 0)
+			return 1;
+
+	return 0;
+}
+
+static void
+lru_unlink(struct gzcache_entry *e) {
+
+	if (e->prev)
+		e->prev->next = e->next;
+	else
+		lru_head = e->next;
+	if (e->next)
+		e->next->prev = e->prev;
+	else
+		lru_tail = e->prev;
+	e->prev = e->next = NULL;
+}
+
+static void
+lru_append(struct gzcache_entry *e) {
+
+	e->prev = lru_tail;
+	e->next = NULL;
+	if (lru_tail)
+		lru_tail->next = e;
+	else
+		lru_head = e;
+	lru_tail = e;
+}
+
+/*
+ * Memory charged to the budget for an entry, so that files which did not
+ * compress are not free to keep.
+ */
+static size_t
+entry_cost(struct gzcache_entry *e) {
+
+	return sizeof(struct gzcache_entry) + strlen(e->path) + e->len;
+}
+
+static void
+gzcache_remove(struct gzcache_entry *e) {
+
+	struct gzcache_entry **pp;
+
+	pp = &buckets[e->hash & (GZCACHE_BUCKETS - 1)];
+	for (; *pp != NULL; pp = &(*pp)->hnext) {
+		if (*pp == e) {
+			*pp = e->hnext;
+			break;
+		}
+	}
+	lru_unlink(e);
+
+	gzcache_stats.bytes -= entry_cost(e);
+	free(e->data);
+	free(e->path);
+	free(e);
+}
+
+/*
+ * Read size bytes of fd and gzip them into a new buffer, returned in *out
+ * with its length in *len. *out is NULL if the result would not be smaller
+ * than the file. Returns -1 on error.
+ */
+static int
+compress_file(int fd, off_t size, char **out, size_t *len) {
+
+	z_stream zs;
+	char *in, *buf;
+	int rval;
+
+	*out = NULL;
+	*len = 0;
+	if ((in = malloc(size)) == NULL || (buf = malloc(size)) == NULL) {
+		fprintf(stderr, "malloc error\n");
+		free(in);
+		return -1;
+	}
+	if (pread(fd, in, size, 0) != size) {
+		perror("pread");
+		free(buf);
+		free(in);
+		return -1;
+	}
+
+	memset(&zs, 0, sizeof(zs));
+	if (deflateInit2(&zs, __sws_gzip_level, Z_DEFLATED, GZIP_WINDOW, 8,
+		Z_DEFAULT_STRATEGY) != Z_OK) {
+		fprintf(stderr, "deflateInit2 error\n");
+		free(buf);
+		free(in);
+		return -1;
+	}
+
+	/* Output that does not fit in the file's own size is not worth it */
+	zs.next_in = (Bytef*)in;
+	zs.avail_in = size;
+	zs.next_out = (Bytef*)buf;
+	zs.avail_out = size;
+	rval = deflate(&zs, Z_FINISH);
+	deflateEnd(&zs);
+	free(in);
+
+	if (rval != Z_STREAM_END) {
+		free(buf);
+		return (rval == Z_OK || rval == Z_BUF_ERROR) ? 0 : -1;
+	}
+
+	/* Give back the unused tail; the buffer is fine as it is otherwise */
+	*len = zs.total_out;
+	if ((in = realloc(buf, *len)) != NULL)
+		buf = in;
+	*out = buf;
+
+	return 0;
+}
+
+static struct gzcache_entry*
+gzcache_find(const char *path, unsigned int hash) {
+
+	struct gzcache_entry *e;
+
+	for (e = buckets[hash & (GZCACHE_BUCKETS - 1)]; e; e = e->hnext)
+		if (e->hash == hash && strcmp(e->path, path) == 0)
+			break;
+
+	return e;
+}
+
+/*
+ * Return whether the file at path, with the given mtime and size, is known
+ * to shrink when compressed: 1 if it does, 0 if it does not and -1 if it
+ * has not been compressed yet. Counts as neither a hit nor a miss.
+ */
+int
+gzcache_known(const char *path, time_t mtime, off_t size) {
+
+	struct gzcache_entry *e;
+
+	e = gzcache_find(path, str_hash(path));
+	if (e == NULL || e->mtime != mtime || e->size != size)
+		return -1;
+
+	return e->data != NULL;
+}
+
+/*
+ * Return the compressed version of the file at path, open as fd, with
+ * the given mtime and size, compressing it on a miss. Returns NULL if it
+ * is not worth sending compressed or cannot be compressed.
+ */
+struct gzcache_entry*
+gzcache_get(const char *path, int fd, time_t mtime, off_t size) {
+
+	struct gzcache_entry *e;
+	unsigned int hash;
+	size_t budget;
+
+	hash = str_hash(path);
+	e = gzcache_find(path, hash);
+	if (e != NULL) {
+		if (e->mtime == mtime && e->size == size) {
+			gzcache_stats.hits++;
+			if (e != lru_tail) {
+				lru_unlink(e);
+				lru_append(e);
+			}
+			return e->data != NULL ? e : NULL;
+		}
+		/* An older version of the file */
+		gzcache_remove(e);
+	}
+
+	gzcache_stats.misses++;
+	if ((e = calloc(1, sizeof(struct gzcache_entry))) == NULL
+		|| (e->path = strdup(path)) == NULL) {
+		fprintf(stderr, "calloc error\n");
+		free(e);
+		return NULL;
+	}
+	e->hash = hash;
+	e->mtime = mtime;
+	e->size = size;
+
+	budget = (size_t)__sws_gzcache_size * 1024;
+	if (compress_file(fd, size, &e->data, &e->len) < 0
+		|| entry_cost(e) > budget) {
+		free(e->data);
+		free(e->path);
+		free(e);
+		return NULL;
+	}
+	while (lru_head != NULL
+		&& gzcache_stats.bytes + entry_cost(e) > budget)
+		gzcache_remove(lru_head);
+
+	e->hnext = buckets[hash & (GZCACHE_BUCKETS - 1)];
+	buckets[hash & (GZCACHE_BUCKETS - 1)] = e;
+	lru_append(e);
+	gzcache_stats.bytes += entry_cost(e);
+
+	return e->data != NULL ? e : NULL;
+}
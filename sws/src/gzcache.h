@@ -0,0 +1,51 @@
+#ifndef _GZCACHE_H_
+#define _GZCACHE_H_
+
+#include <sys/types.h>
+
+#include <time.h>
+
+/* Default compression level, 0 disables compression */
+#define GZIP_LEVEL 6
+
+/* Files compressed on the fly, by size */
+#define GZIP_MIN_SIZE 256
+#define GZIP_MAX_SIZE (1024 * 1024)
+
+/* Default memory kept for compressed files, in kilobytes */
+#define GZCACHE_BUDGET 16384
+
+/* Hash buckets, a power of two */
+#define GZCACHE_BUCKETS 1024
+
+/*
+ * The gzip encoding of one version of a file. data is NULL if the file
+ * did not compress well enough to be worth sending encoded.
+ */
+struct gzcache_entry {
+	char *path;
+	unsigned int hash;
+	time_t mtime;
+	off_t size;
+	char *data;
+	size_t len;
+	struct gzcache_entry *hnext;
+	/* LRU list, least recently used first */
+	struct gzcache_entry *prev;
+	struct gzcache_entry *next;
+};
+
+struct gzcache_stats {
+	unsigned long hits;
+	unsigned long misses;
+	size_t bytes;
+};
+
+extern struct gzcache_stats gzcache_stats;
+
+void gzcache_init(void);
+int gzip_compressible(const char*, off_t);
+int gzcache_known(const char*, time_t, off_t);
+struct gzcache_entry* gzcache_get(const char*, int, time_t, off_t);
+
+#endif
@@ -0,0 +1,63 @@
+/*
+ * hist.c - Latency histograms
+ *
+ * Shared by the status page and sws-bench, which report percentiles the
+ * same way.
+ */
+#include "hist.h"
+
+/*
+ * Return the bucket that the value ns falls into.
+ */
+int
+hist_bucket(unsigned long ns) {
+
+	int msb, b;
+
+	if (ns < HIST_SUB)
+		return ns;
+
+	msb = sizeof(unsigned long) * 8 - 1 - __builtin_clzl(ns);
+	b = (msb - HIST_SUB_BITS + 1) * HIST_SUB
+		+ (int)(ns >> (msb - HIST_SUB_BITS)) - HIST_SUB;
+
+	return (b < HIST_BUCKETS) ? b : HIST_BUCKETS - 1;
+}
+
+/*
+ * Return the largest value that falls into bucket b.
+ */
+static unsigned long
+bucket_max(int b) {
+
+	int shift;
+
+	if (b < HIST_SUB)
+		return b;
+
+	shift = b / HIST_SUB - 1;
+	return ((unsigned long)(HIST_SUB + b % HIST_SUB + 1) << shift) - 1;
+}
+
+/*
+ * Return the value, in nanoseconds, that fraction q of the count values
+ * in histogram h did not exceed, rounded up to the end of its bucket.
+ */
+unsigned long
+hist_percentile(const unsigned long *h, unsigned long count, double q) {
+
+	unsigned long seen, want;
+	int b;
+
+	if (count == 0)
+		return 0;
+
+	want = q * count;
+	if (want < q * count || want == 0)
+		want++;
+	for (b = 0, seen = 0; b < HIST_BUCKETS - 1; b++)
+		if ((seen += h[b]) >= want)
+			break;
+
+	return bucket_max(b);
+}
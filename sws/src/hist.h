@@ -0,0 +1,18 @@
+#ifndef _HIST_H_
+#define _HIST_H_
+
+/*
+ * Histograms are log-linear, in nanoseconds: values below HIST_SUB get a
+ * bucket each, and every power of two above that is split into HIST_SUB
+ * buckets, which bounds the error of a percentile to 1/HIST_SUB. The
+ * last bucket also takes everything too slow for the others.
+ */
+#define HIST_SUB_BITS 4
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_POWERS 36
+#define HIST_BUCKETS (HIST_POWERS * HIST_SUB)
+
+int hist_bucket(unsigned long);
+unsigned long hist_percentile(const unsigned long*, unsigned long, double);
+
+#endif
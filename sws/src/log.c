@@ -1,16 +1,58 @@
+/*
+ * log.c - Access log
+ *
+ * Every response is logged as one line. Forked processes write their
+ * lines to the log as they go. The event loop instead formats each line
+ * into a fixed-size record in a ring, which a writer thread drains in
+ * batches, so that answering a request never waits on the log file and
+ * many lines go out in one write(). The ring has one producer and one
+ * consumer and needs no lock; when it is full, lines are counted as
+ * dropped rather than waited for.
+ *
+ * SIGUSR1 has the log file reopened by path, for rotation. The writer
+ * thread, or a forked process before its next line, does it in place of
+ * the old descriptor.
+ */
+#define _GNU_SOURCE
+
 #include <sys/stat.h>
 #include <sys/types.h>
 
 #include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
 #include <unistd.h>
 
+#include "date.h"
 #include "defines.h"
 #include "log.h"
+#include "utils.h"
+
+/* One log line; longer request lines are cut short */
+struct log_record {
+	unsigned short len;
+	char line[LOG_RECORD_SIZE - sizeof(unsigned short)];
+};
+
+unsigned long log_dropped;
+
+static char *log_path;
+static int log_fd = -1;
+static volatile sig_atomic_t log_reopen_pending;
+
+/* The ring, and the writer thread draining it, once started */
+static struct log_record *ring;
+static atomic_ulong ring_head;
+static atomic_ulong ring_tail;
+static atomic_ulong ring_dropped;
+static atomic_int writer_stop;
+static pthread_t writer;
 
 int
 init_logfile(char *path) {
@@ -20,12 +62,12 @@ init_logfile(char *path) {
 	char *tmppath;
 
 	tmppath = NULL;
-	if (stat(path, &stat_buf) < 0 && errno != ENOENT) {
-		perror("couldn't stat logfile");
-		return -1;
-	}
-
-	if (S_ISDIR(stat_buf.st_mode)) {
+	if (stat(path, &stat_buf) < 0) {
+		if (errno != ENOENT) {
+			perror("couldn't stat logfile");
+			return -1;
+		}
+	} else if (S_ISDIR(stat_buf.st_mode)) {
 		if ((tmppath = calloc(1, strlen(path)
 			+ strlen(LOGFILE) + 2)) == NULL) {
 			fprintf(stderr, "calloc error\n");
@@ -34,46 +76,300 @@ init_logfile(char *path) {
 		strncpy(tmppath, path, strlen(path));
 		strncat(tmppath, "/", 1);
 		strncat(tmppath, LOGFILE, strlen(LOGFILE));
+		path = tmppath;
 	}
 
-	if ((fd = open(path, O_APPEND | O_CREAT | O_RDWR,
+	if ((fd = open(path, O_APPEND | O_CREAT | O_WRONLY,
 		S_IRUSR | S_IWUSR | S_IRGRP)) < 0) {
 		perror("opening logfile");
+		free(tmppath);
 		return -1;
 	}
 
+	/* Kept to reopen it on SIGUSR1 */
+	free(log_path);
+	if ((log_path = strdup(path)) == NULL)
+		fprintf(stderr, "strdup error\n");
+	log_fd = fd;
+
 	if (tmppath != NULL)
 		free(tmppath);
 
 	return fd;
 }
 
+/*
+ * SIGUSR1 handler: ask for the log file to be reopened before the next
+ * line is written.
+ */
 void
-sws_log(int fd, const struct request *req,
-	const struct response *resp, int debug) {
+log_rotate(int sig) {
+
+	log_reopen_pending = 1;
+}
+
+/*
+ * Reopen the log file if SIGUSR1 asked for it. The new file takes over
+ * the old descriptor, so everything holding it writes to the new file.
+ */
+void
+log_check_reopen(void) {
+
+	int fd;
+
+	if (!log_reopen_pending || log_path == NULL || log_fd < 0)
+		return;
+	log_reopen_pending = 0;
+
+	if ((fd = open(log_path, O_APPEND | O_CREAT | O_WRONLY,
+		S_IRUSR | S_IWUSR | S_IRGRP)) < 0) {
+		perror("reopening logfile");
+		return;
+	}
+	if (dup2(fd, log_fd) < 0)
+		perror("dup2");
+	close(fd);
+}
+
+/*
+ * Format the log line for a response into buf, which holds size bytes,
+ * and return its length.
+ */
+static size_t
+format_line(char *buf, size_t size, const struct request *req,
+	const struct response *resp) {
+
+	const char *ip, *method_line;
+	size_t len, room;
+	char *p;
+
+	ip = (req->ip != NULL) ? req->ip : "-";
+	method_line = (req->method_line != NULL) ? req->method_line : "-";
+
+	p = buf;
+	p = put(p, ip, strlen(ip));
+	*p++ = ' ';
+	p = put(p, http_date(), HTTP_DATE_LEN);
+	*p++ = ' ';
+
+	/* Leave room for the status, length and newline */
+	room = size - (p - buf) - sizeof(resp->status_line) - 32;
+	if ((len = strlen(method_line)) > room)
+		len = room;
+	p = put(p, method_line, len);
+	*p++ = ' ';
+
+	if (resp->status_line[0] != '\0')
+		p = put(p, resp->status_line + 1, strlen(resp->status_line) - 3);
+	else
+		p = put(p, status_lines[http_status].line + 1,
+			status_lines[http_status].len - 3);
+	*p++ = ' ';
+
+	/* Streamed bodies are logged with an unknown length */
+	if (resp->length == (unsigned long)-1)
+		*p++ = '-';
+	else
+		p = put_ulong(p, resp->length);
+	*p++ = '\n';
+
+	return p - buf;
+}
+
+/*
+ * Write one batch of records from the ring to the log. Returns the
+ * number of records written.
+ */
+static unsigned long
+drain_ring(void) {
+
+	struct log_record *rec;
+	unsigned long head, tail, n, dropped;
+	size_t len;
+	char *p;
+	char batch[LOG_BATCH], notice[64];
+
+	tail = atomic_load_explicit(&ring_tail, memory_order_relaxed);
+	head = atomic_load_explicit(&ring_head, memory_order_acquire);
+
+	/* Records stop short enough to leave room for the notice below */
+	p = batch;
+	for (n = 0; tail + n != head && (size_t)(batch + sizeof(batch) - p)
+		>= LOG_RECORD_SIZE + sizeof(notice); n++) {
+		rec = &ring[(tail + n) & (LOG_RING_SIZE - 1)];
+		p = put(p, rec->line, rec->len);
+	}
+	atomic_store_explicit(&ring_tail, tail + n, memory_order_release);
+
+	/* Say so in the log when lines were lost */
+	dropped = atomic_load_explicit(&ring_dropped, memory_order_relaxed);
+	if (dropped != log_dropped) {
+		len = snprintf(notice, sizeof(notice),
+			"sws: %lu log lines dropped\n", dropped - log_dropped);
+		if (len >= sizeof(notice))
+			len = sizeof(notice) - 1;
+		p = put(p, notice, len);
+		log_dropped = dropped;
+	}
+
+	if (p > batch && write(log_fd, batch, p - batch) < 0)
+		perror("writing to logfile");
+
+	return n;
+}
+
+static void*
+log_writer(void *arg) {
+
+	struct timespec interval;
+
+	interval.tv_sec = 0;
+	interval.tv_nsec = LOG_FLUSH_MS * 1000000L;
 
-	char buf[1024];
-	char timestr[50];
-	time_t now;
+	while (!atomic_load(&writer_stop)) {
+		log_check_reopen();
+		/* Sleep only once the ring is empty */
+		if (drain_ring() == 0)
+			nanosleep(&interval, NULL);
+	}
+
+	while (drain_ring() > 0)
+		;
+
+	return NULL;
+}
+
+/*
+ * Have the lines of this process logged through the ring by a writer
+ * thread from now on. Returns -1, leaving logging synchronous, if the
+ * thread cannot be started.
+ */
+int
+log_start_writer(void) {
+
+	sigset_t all, old;
+	int rval;
+
+	if (log_fd < 0 || ring != NULL)
+		return -1;
+
+	if ((ring = calloc(LOG_RING_SIZE, sizeof(struct log_record))) == NULL) {
+		fprintf(stderr, "calloc error\n");
+		return -1;
+	}
 
-	bzero(buf, sizeof(buf));
-	if ((now = time(NULL)) == (time_t)-1) {
-		/* Reponse already done, just exit */
-		perror("time");
-		exit(EXIT_FAILURE);
-		/* NOTREACHED */
+	/* Signals are for the thread serving requests */
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	rval = pthread_create(&writer, NULL, log_writer, NULL);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+	if (rval != 0) {
+		fprintf(stderr, "pthread_create: %s\n", strerror(rval));
+		free(ring);
+		ring = NULL;
+		return -1;
 	}
 
-	strftime(timestr, sizeof(timestr),
-		RFC1123_DATE, gmtime(&now));
+	return 0;
+}
+
+/*
+ * Write out whatever the writer thread has not yet, and stop it.
+ */
+void
+log_stop_writer(void) {
+
+	if (ring == NULL)
+		return;
 
-	sprintf(buf, "%s %s %s %s %lu\n", req->ip,
-		timestr, req->method_line, http_status,
-		resp->length);
+	atomic_store(&writer_stop, 1);
+	pthread_join(writer, NULL);
+	free(ring);
+	ring = NULL;
+}
+
+/*
+ * Return the next free record of the ring, or NULL, counting the line as
+ * dropped, if there is none. It is handed to the writer by log_commit().
+ */
+static struct log_record*
+log_reserve(void) {
+
+	unsigned long head, tail;
+
+	head = atomic_load_explicit(&ring_head, memory_order_relaxed);
+	tail = atomic_load_explicit(&ring_tail, memory_order_acquire);
+	if (head - tail == LOG_RING_SIZE) {
+		atomic_fetch_add_explicit(&ring_dropped, 1,
+			memory_order_relaxed);
+		return NULL;
+	}
+
+	return &ring[head & (LOG_RING_SIZE - 1)];
+}
+
+static void
+log_commit(void) {
+
+	atomic_store_explicit(&ring_head, atomic_load_explicit(&ring_head,
+		memory_order_relaxed) + 1, memory_order_release);
+}
+
+/*
+ * Log a line that is already formatted, newline included. Without a log
+ * file, as in debug mode, it goes to stdout.
+ */
+void
+log_write(const char *line, size_t len) {
+
+	struct log_record *rec;
+
+	if (log_fd < 0) {
+		fwrite(line, 1, len, stdout);
+		return;
+	}
+
+	if (ring == NULL) {
+		log_check_reopen();
+		if (write(log_fd, line, len) < 0)
+			perror("writing to logfile");
+		return;
+	}
+
+	if ((rec = log_reserve()) == NULL)
+		return;
+	if (len > sizeof(rec->line))
+		len = sizeof(rec->line);
+	memcpy(rec->line, line, len);
+	rec->len = len;
+	log_commit();
+}
+
+void
+sws_log(int fd, const struct request *req,
+	const struct response *resp, int debug) {
+
+	struct log_record *rec;
+	size_t len;
+	char buf[LOG_RECORD_SIZE];
 
 	if (debug) {
-		if (write(fd, buf, strlen(buf)) < 0)
+		len = format_line(buf, sizeof(buf), req, resp);
+		fwrite(buf, 1, len, stdout);
+		return;
+	}
+
+	if (ring == NULL) {
+		log_check_reopen();
+		len = format_line(buf, sizeof(buf), req, resp);
+		if (write(fd, buf, len) < 0)
 			perror("writing to logfile");
-	} else
-		printf("%s", buf);
+		return;
+	}
+
+	if ((rec = log_reserve()) == NULL)
+		return;
+	rec->len = format_line(rec->line, sizeof(rec->line), req, resp);
+	log_commit();
 }
@@ -3,10 +3,30 @@
 
 #define LOGFILE "sws.log"
 
+/* Size of a queued log line, and of the ring of them, a power of two */
+#define LOG_RECORD_SIZE 512
+#define LOG_RING_SIZE 4096
+
+/* Most bytes the writer thread gathers into one write() */
+#define LOG_BATCH (64 * 1024)
+
+/* How long the writer thread sleeps when there is nothing to write */
+#define LOG_FLUSH_MS 50
+
+#include <stddef.h>
+
 #include "request.h"
 #include "response.h"
 
+/* Lines the writer thread could not keep up with */
+extern unsigned long log_dropped;
+
 int init_logfile(char*);
+void log_rotate(int);
+void log_check_reopen(void);
+int log_start_writer(void);
+void log_stop_writer(void);
+void log_write(const char*, size_t);
 void sws_log(int, const struct request*, const struct response*, int);
 
 #endif
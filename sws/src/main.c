@@ -2,8 +2,13 @@
  * main.c - Main functions for simple web server
  *
  * Option parsing and creation of connections is handled here.
- * IPV6 support is enabled using the -6 flag.
+ * IPV6 support is enabled using the -6 flag. By default each connection
+ * is handled in its own process; -e serves all connections from a single
+ * epoll event loop instead, and -w runs that event loop in several worker
+ * processes, each pinned to a core with its own SO_REUSEPORT listener.
  */
+#define _GNU_SOURCE
+
 #include <arpa/inet.h>
 #include <netinet/in.h>
 #include <sys/socket.h>
@@ -13,6 +18,7 @@
 
 #include <errno.h>
 #include <fcntl.h>
+#include <sched.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -22,31 +28,46 @@
 
 //#include "sws.h"
 #include "defines.h"
+#include "event.h"
+#include "gzcache.h"
+#include "log.h"
 #include "server.h"
+#include "stats.h"
 
 /* Connection properties */
 #define MAX_CONN 20
 #define PENDING_CONN 10
 
 int main(int, char**);
+int create_listener(int);
 void mainloop(void);
 void reap(int);
+void rotate_workers(int);
+void run_workers(void);
+void set_reaper(void);
+pid_t spawn_worker(int);
+void stop_workers(int);
 void usage(void);
+void worker(int);
 
 struct swsopts opts;
 int cur_connections, ipv6;
+pid_t *workers;
 
-void
-mainloop() {
+/*
+ * Create, bind and listen on the server socket. Workers each create their
+ * own listener with SO_REUSEPORT so the kernel spreads accepts over them.
+ */
+int
+create_listener(int reuseport) {
 
 	struct sockaddr_in sws;
 	struct sockaddr_in6 sws6;
-	struct sigaction sig;
-	pid_t pid;
-	socklen_t sin_size;
 	int sock, domain, opt;
-	int conn, pending_connections;
-	char buf[1024];
+	int pending_connections;
+
+	memset(&sws, 0, sizeof(sws));
+	memset(&sws6, 0, sizeof(sws6));
 
 	/* Set port */
 	if (!ipv6) {
@@ -95,6 +116,13 @@ mainloop() {
 		/* NOTREACHED */
 	}
 
+	if (reuseport && setsockopt(sock, SOL_SOCKET, SO_REUSEPORT,
+		&opt, sizeof(int)) < 0) {
+		perror("setsockopt");
+		exit(EXIT_FAILURE);
+		/* NOTREACHED */
+	}
+
 	/* Bind to specified address(es) */
 	sws.sin_family = sws6.sin6_family = domain;
 	if (bind(sock, (ipv6 == 1) ?
@@ -105,6 +133,30 @@ mainloop() {
 		/* NOTREACHED */
 	}
 
+	/* Connection accept loop */
+	pending_connections = PENDING_CONN;
+
+	if (opts.event)
+		pending_connections = SOMAXCONN;
+
+	if (opts.debug)
+		pending_connections = 1;
+
+	/* Listen on socket */
+	if (listen(sock, pending_connections) < 0) {
+		perror("listen");
+		exit(EXIT_FAILURE);
+		/* NOTREACHED */
+	}
+
+	return sock;
+}
+
+void
+set_reaper() {
+
+	struct sigaction sig;
+
 	/* Set up signal handler */
 	sig.sa_handler = reap;
 	sigemptyset(&sig.sa_mask);
@@ -114,22 +166,190 @@ mainloop() {
 		exit(EXIT_FAILURE);
 		/* NOTREACHED */
 	}
+}
 
-	/* Connection accept loop */
-	pending_connections = PENDING_CONN;
+/*
+ * Body of worker n: pin to a core, open a private listener and run the
+ * event loop on it.
+ */
+void
+worker(int n) {
 
-	if (opts.debug)
-		pending_connections = 1;
+	struct sigaction sig;
+	cpu_set_t cpus;
+	long ncpu;
 
-	/* Listen on socket */
-	if (listen(sock, pending_connections) < 0) {
-		perror("listen");
+	/* Undo the supervisor's handlers inherited across fork */
+	sig.sa_handler = sws_cleanup;
+	sigemptyset(&sig.sa_mask);
+	sig.sa_flags = 0;
+	if ((sigaction(SIGINT, &sig, NULL) < 0)
+		|| (sigaction(SIGTERM, &sig, NULL) < 0)) {
+		perror("sigaction");
+		exit(EXIT_FAILURE);
+		/* NOTREACHED */
+	}
+	sig.sa_handler = log_rotate;
+	sig.sa_flags = SA_RESTART;
+	if (sigaction(SIGUSR1, &sig, NULL) < 0) {
+		perror("sigaction");
+		exit(EXIT_FAILURE);
+		/* NOTREACHED */
+	}
+
+	if ((ncpu = sysconf(_SC_NPROCESSORS_ONLN)) > 0) {
+		CPU_ZERO(&cpus);
+		CPU_SET(n % ncpu, &cpus);
+		if (sched_setaffinity(0, sizeof(cpus), &cpus) < 0)
+			perror("sched_setaffinity");
+	}
+
+	stats_attach(n);
+	set_reaper();
+	sws_event_loop(create_listener(1));
+	/* NOTREACHED */
+}
+
+pid_t
+spawn_worker(int n) {
+
+	pid_t pid;
+
+	if ((pid = fork()) < 0) {
+		perror("error forking worker");
+		return -1;
+	} else if (pid == 0) {
+		worker(n);
+		/* NOTREACHED */
+	}
+
+	return pid;
+}
+
+/*
+ * Pass a SIGUSR1 on to the workers, which do the logging.
+ */
+void
+rotate_workers(int sig) {
+
+	int i;
+
+	for (i = 0; i < opts.workers; i++) {
+		if (workers[i] > 0)
+			kill(workers[i], SIGUSR1);
+	}
+}
+
+void
+stop_workers(int sig) {
+
+	int i;
+
+	for (i = 0; i < opts.workers; i++) {
+		if (workers[i] > 0)
+			kill(workers[i], SIGTERM);
+	}
+
+	sws_cleanup(sig);
+	/* NOTREACHED */
+}
+
+/*
+ * Start opts.workers long-lived workers and supervise them. A worker that
+ * is killed by a signal is replaced; one that exits on its own (e.g. it
+ * could not bind) is not, and the server exits once none are left.
+ */
+void
+run_workers() {
+
+	struct sigaction sig;
+	pid_t pid;
+	int i, status, running;
+
+	if ((workers = calloc(opts.workers, sizeof(pid_t))) == NULL) {
+		fprintf(stderr, "calloc error\n");
 		exit(EXIT_FAILURE);
 		/* NOTREACHED */
 	}
 
+	sig.sa_handler = stop_workers;
+	sigemptyset(&sig.sa_mask);
+	sig.sa_flags = 0;
+	if ((sigaction(SIGINT, &sig, NULL) < 0)
+		|| (sigaction(SIGTERM, &sig, NULL) < 0)) {
+		perror("sigaction");
+		exit(EXIT_FAILURE);
+		/* NOTREACHED */
+	}
+	sig.sa_handler = rotate_workers;
+	sig.sa_flags = SA_RESTART;
+	if (sigaction(SIGUSR1, &sig, NULL) < 0) {
+		perror("sigaction");
+		exit(EXIT_FAILURE);
+		/* NOTREACHED */
+	}
+
+	for (i = 0; i < opts.workers; i++) {
+		if ((workers[i] = spawn_worker(i)) < 0)
+			exit(EXIT_FAILURE);
+	}
+
+	running = opts.workers;
+	while (running > 0) {
+		if ((pid = wait(&status)) < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("wait");
+			break;
+		}
+
+		for (i = 0; i < opts.workers && workers[i] != pid; i++)
+			;
+		if (i == opts.workers)
+			continue;
+
+		if (WIFSIGNALED(status)) {
+			fprintf(stderr, "worker %d killed by signal %d\n",
+				i, WTERMSIG(status));
+			if ((workers[i] = spawn_worker(i)) > 0)
+				continue;
+		}
+		workers[i] = 0;
+		running--;
+	}
+
+	exit(EXIT_FAILURE);
+	/* NOTREACHED */
+}
+
+void
+mainloop() {
+
+	pid_t pid;
+	socklen_t sin_size;
+	int sock;
+	int conn;
+	char buf[1024];
+
+	if (opts.workers > 0) {
+		run_workers();
+		/* NOTREACHED */
+	}
+
+	sock = create_listener(0);
+	set_reaper();
+
+	if (opts.event) {
+		stats_attach(0);
+		sws_event_loop(sock);
+		/* NOTREACHED */
+	}
+
 	/* Accept loop */
 	do {
+		/* Children forked from here on log to the rotated file */
+		log_check_reopen();
+
 		if ((conn = accept(sock, 0, &sin_size)) == -1)
 			perror("accept");
 		else {
@@ -137,7 +357,6 @@ mainloop() {
 
 			if (opts.debug) {
 				sws_handle_request(conn);
-				close(conn);
 			} else {
 				if ((pid = fork()) < 0) {
 					perror("error forking for connection");
@@ -150,7 +369,6 @@ mainloop() {
 					/* Pass socket to handler */
 					sws_handle_request(conn);
 
-					close(conn);
 					if (errno > 0) {
 						perror("error");
 						exit(EXIT_FAILURE);
@@ -181,7 +399,12 @@ main(int argc, char **argv) {
 	extern char *optarg;
 
 	opts.port = 8080;
-	while((flag = getopt(argc, argv, "6c:dhi:k:l:p:s:")) != -1) {
+	opts.timeout = KEEPALIVE_TIMEOUT;
+	opts.max_requests = KEEPALIVE_MAX;
+	opts.cache_size = FCACHE_BUDGET;
+	opts.gzip_level = GZIP_LEVEL;
+	opts.gzcache_size = GZCACHE_BUDGET;
+	while((flag = getopt(argc, argv, "6c:def:g:hi:k:l:m:p:r:Ss:T:t:w:z:")) != -1) {
 		switch(flag) {
 		case '6':
 			ipv6 = 1;
@@ -192,6 +415,25 @@ main(int argc, char **argv) {
 		case 'd':
 			opts.debug = 1;
 			break;
+		case 'e':
+			opts.event = 1;
+			break;
+		case 'f':
+			if ((opts.fcgi_procs = atoi(optarg)) < 1) {
+				fprintf(stderr, "Invalid number of processes\n");
+				exit(EXIT_FAILURE);
+				/* NOTREACHED */
+			}
+			/* Only a long-lived process can keep scripts running */
+			opts.event = 1;
+			break;
+		case 'g':
+			if ((opts.gzcache_size = atoi(optarg)) < 0) {
+				fprintf(stderr, "Invalid gzip cache size\n");
+				exit(EXIT_FAILURE);
+				/* NOTREACHED */
+			}
+			break;
 		case 'i':
 			opts.ip = optarg;
 			break;
@@ -201,6 +443,13 @@ main(int argc, char **argv) {
 		case 'l':
 			opts.logfile = optarg;
 			break;
+		case 'm':
+			if ((opts.cache_size = atoi(optarg)) < 0) {
+				fprintf(stderr, "Invalid cache size\n");
+				exit(EXIT_FAILURE);
+				/* NOTREACHED */
+			}
+			break;
 		case 'p':
 			if(!(opts.port = atoi(optarg))) {
 				fprintf(stderr, "Invalid port\n");
@@ -208,9 +457,50 @@ main(int argc, char **argv) {
 				/* NOTREAHCED */
 			}
 			break;
+		case 'r':
+			if ((opts.max_requests = atoi(optarg)) < 1) {
+				fprintf(stderr, "Invalid request limit\n");
+				exit(EXIT_FAILURE);
+				/* NOTREACHED */
+			}
+			break;
+		case 'S':
+			opts.status = 1;
+			break;
 		case 's':
 			opts.secdir = optarg;
 			break;
+		case 'T':
+			if ((opts.trace = atoi(optarg)) < 1) {
+				fprintf(stderr, "Invalid trace rate\n");
+				exit(EXIT_FAILURE);
+				/* NOTREACHED */
+			}
+			break;
+		case 't':
+			if ((opts.timeout = atoi(optarg)) < 1) {
+				fprintf(stderr, "Invalid timeout\n");
+				exit(EXIT_FAILURE);
+				/* NOTREACHED */
+			}
+			break;
+		case 'w':
+			if ((opts.workers = atoi(optarg)) < 1) {
+				fprintf(stderr, "Invalid number of workers\n");
+				exit(EXIT_FAILURE);
+				/* NOTREACHED */
+			}
+			/* Workers always run the event loop */
+			opts.event = 1;
+			break;
+		case 'z':
+			opts.gzip_level = atoi(optarg);
+			if (opts.gzip_level < 0 || opts.gzip_level > 9) {
+				fprintf(stderr, "Invalid compression level\n");
+				exit(EXIT_FAILURE);
+				/* NOTREACHED */
+			}
+			break;
 		case 'h':
 			/* FALLTHROUGH */
 		case '?':
@@ -248,7 +538,9 @@ main(int argc, char **argv) {
 void
 usage(void) {
 	fprintf(stderr,
-		"usage: sws [-6dh][-c dir][-i address][-l file][-p port][-s dir -k key] dir\n");
+		"usage: sws [-6dehS][-c dir][-f procs][-g kbytes][-i address][-l file]\n"
+		"           [-m kbytes][-p port][-r requests][-s dir -k key][-T n]\n"
+		"           [-t timeout][-w workers][-z level] dir\n");
 	exit(EXIT_FAILURE);
 	/* NOTREACHED */
 }
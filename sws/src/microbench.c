@@ -0,0 +1,510 @@
+/*
+ * microbench.c - sws-microbench, timing of the request parsing hot paths
+ *
+ * Runs sws_parse_method(), sws_parse_header(), http_realpath() and
+ * my_realpath() from libsws over a corpus of request lines and headers,
+ * and reports for each the time and heap allocations per call. The
+ * corpus is built in, or read from a file of request heads as sent by
+ * clients, one line per line and a blank line between requests.
+ *
+ * Each call gets a fresh copy of its line, as the parser writes into it,
+ * and a freshly reset request, as it would in the server; the baseline
+ * row is the cost of just that, to be subtracted from the others.
+ * Allocations are counted by wrapping malloc() and friends for the whole
+ * process, so those made by the arena for the strings of a request show
+ * up as well. The parser's debugging printf()s stay in, as the server has
+ * them, writing to /dev/null.
+ *
+ * The results can be saved as a baseline, and a later run compared with
+ * one: it fails if a function got slower by more than a given percentage,
+ * or allocates more.
+ */
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "parse.h"
+#include "request.h"
+#include "utils.h"
+
+/* Defaults */
+#define MICROBENCH_SECONDS 1
+#define MICROBENCH_SERVE_DIR "/var/www/sws"
+#define MICROBENCH_THRESHOLD 10
+
+/* Allocations per call are exact, but printed rounded */
+#define ALLOCS_SLACK 0.005
+
+/* Longest corpus line, and most lines of each kind */
+#define LINE_MAX_LEN 8192
+#define CORPUS_MAX 4096
+
+/* Request lines as browsers, crawlers and tools send them */
+static const char *builtin_lines[] = {
+	"GET / HTTP/1.1",
+	"GET /index.html HTTP/1.1",
+	"GET /favicon.ico HTTP/1.1",
+	"GET /css/main.min.css?v=3.4.1 HTTP/1.1",
+	"GET /js/vendor/jquery-3.6.0.min.js HTTP/1.1",
+	"GET /images/2023/05/header-background@2x.png HTTP/1.1",
+	"GET /blog/2023/05/17/a-fairly-long-article-slug-with-many-words/ HTTP/1.1",
+	"GET /search?q=simple+web+server&lang=en&page=2 HTTP/1.1",
+	"GET /~alice/ HTTP/1.1",
+	"GET /~bob/papers/thesis.pdf HTTP/1.1",
+	"GET /docs/./api/../guide/getting-started.html HTTP/1.1",
+	"GET /a/b/c/d/e/f/g/h/i/j/k/l/m/n/o/p/file.txt HTTP/1.1",
+	"GET /robots.txt HTTP/1.0",
+	"GET /cgi-bin/search.cgi?query=test HTTP/1.1",
+	"HEAD /downloads/release-1.2.3.tar.gz HTTP/1.1",
+	"POST /cgi-bin/form.cgi HTTP/1.1",
+};
+
+/* Headers of the same requests */
+static const char *builtin_headers[] = {
+	"Host: www.example.com",
+	"Connection: keep-alive",
+	"User-Agent: Mozilla/5.0 (Windows NT 10.0; Win64; x64) "
+		"AppleWebKit/537.36 (KHTML, like Gecko) Chrome/120.0.0.0 "
+		"Safari/537.36",
+	"User-Agent: Mozilla/5.0 (compatible; Googlebot/2.1; "
+		"+http://www.google.com/bot.html)",
+	"User-Agent: curl/8.4.0",
+	"Accept: text/html,application/xhtml+xml,application/xml;q=0.9,"
+		"image/avif,image/webp,*/*;q=0.8",
+	"Accept: */*",
+	"Accept-Encoding: gzip, deflate, br",
+	"Accept-Language: en-US,en;q=0.9,de;q=0.8",
+	"Cache-Control: max-age=0",
+	"Cookie: _ga=GA1.2.1234567890.1690000000; session=8f14e45fceea167a5a36"
+		"dedd4bea2543; theme=dark",
+	"Referer: https://www.example.com/blog/",
+	"If-Modified-Since: Wed, 17 May 2023 08:00:00 GMT",
+	"If-None-Match: \"64a4f0e2-1b3c\"",
+	"Range: bytes=0-1023",
+	"Upgrade-Insecure-Requests: 1",
+	"Sec-Fetch-Mode: navigate",
+	"Content-Type: application/x-www-form-urlencoded",
+	"Content-Length: 27",
+};
+
+struct corpus {
+	char *lines[CORPUS_MAX];
+	int nlines;
+	char *headers[CORPUS_MAX];
+	int nheaders;
+	/* The paths of the request lines */
+	char *paths[CORPUS_MAX];
+	int npaths;
+};
+
+/* What a run of one benchmark measured */
+struct result {
+	double ns;
+	double allocs;
+	unsigned long ops;
+	/* Found in the baseline */
+	int valid;
+};
+
+/* Counted only while a benchmark runs */
+static int counting;
+static unsigned long allocs;
+
+extern void *__libc_malloc(size_t);
+extern void *__libc_calloc(size_t, size_t);
+extern void *__libc_realloc(void*, size_t);
+
+void*
+malloc(size_t size) {
+
+	if (counting)
+		allocs++;
+	return __libc_malloc(size);
+}
+
+void*
+calloc(size_t n, size_t size) {
+
+	if (counting)
+		allocs++;
+	return __libc_calloc(n, size);
+}
+
+void*
+realloc(void *p, size_t size) {
+
+	if (counting)
+		allocs++;
+	return __libc_realloc(p, size);
+}
+
+int main(int, char**);
+void usage(void);
+
+static unsigned long
+now_ns(void) {
+
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+static void
+add_line(char **list, int *n, const char *line) {
+
+	if (*n == CORPUS_MAX)
+		return;
+	if ((list[*n] = strdup(line)) == NULL) {
+		fprintf(stderr, "strdup error\n");
+		exit(EXIT_FAILURE);
+		/* NOTREACHED */
+	}
+	(*n)++;
+}
+
+/*
+ * Add a request line, and its path, to the corpus.
+ */
+static void
+add_request_line(struct corpus *c, const char *line) {
+
+	const char *p, *q;
+	char path[LINE_MAX_LEN];
+
+	add_line(c->lines, &c->nlines, line);
+
+	if ((p = strchr(line, ' ')) == NULL || p[1] != '/')
+		return;
+	p++;
+	for (q = p; *q != ' ' && *q != '\0'; q++)
+		;
+	snprintf(path, sizeof(path), "%.*s", (int)(q - p), p);
+	add_line(c->paths, &c->npaths, path);
+}
+
+/*
+ * Read request heads from path: the first line of each is a request line,
+ * the rest headers, up to a blank line.
+ */
+static void
+load_corpus(struct corpus *c, const char *path) {
+
+	FILE *fp;
+	size_t len;
+	int first;
+	char line[LINE_MAX_LEN];
+
+	if ((fp = fopen(path, "r")) == NULL) {
+		perror(path);
+		exit(EXIT_FAILURE);
+		/* NOTREACHED */
+	}
+
+	first = 1;
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		len = strcspn(line, "\r\n");
+		line[len] = '\0';
+		if (len == 0)
+			first = 1;
+		else if (first) {
+			add_request_line(c, line);
+			first = 0;
+		} else
+			add_line(c->headers, &c->nheaders, line);
+	}
+	fclose(fp);
+
+	if (c->nlines == 0 || c->nheaders == 0) {
+		fprintf(stderr, "%s: no requests with headers\n", path);
+		exit(EXIT_FAILURE);
+		/* NOTREACHED */
+	}
+}
+
+#define BENCH_BASELINE 0
+#define BENCH_PARSE_METHOD 1
+#define BENCH_PARSE_HEADER 2
+#define BENCH_HTTP_REALPATH 3
+#define BENCH_MY_REALPATH 4
+#define BENCH_COUNT 5
+
+static const char *bench_names[] = {
+	"baseline", "sws_parse_method", "sws_parse_header", "http_realpath",
+	"my_realpath",
+};
+
+/*
+ * Call the function of benchmark b once on each of the n lines.
+ */
+static void
+run_pass(int b, struct request *req, char **lines, int n) {
+
+	int i;
+	char buf[LINE_MAX_LEN];
+
+	for (i = 0; i < n; i++) {
+		reset_request(req);
+		strcpy(buf, lines[i]);
+		switch (b) {
+		case BENCH_PARSE_METHOD:
+			sws_parse_method(req, buf, MICROBENCH_SERVE_DIR);
+			break;
+		case BENCH_PARSE_HEADER:
+			sws_parse_header(req, buf);
+			break;
+		case BENCH_HTTP_REALPATH:
+			http_realpath(&req->arena, buf, MICROBENCH_SERVE_DIR);
+			break;
+		case BENCH_MY_REALPATH:
+			my_realpath(&req->arena, buf);
+			break;
+		}
+	}
+}
+
+/*
+ * Run benchmark b over the lines for about the given number of seconds,
+ * and return its time and allocations per call in r.
+ */
+static void
+run_bench(int b, struct request *req, char **lines, int n, int seconds,
+	struct result *r) {
+
+	unsigned long start, elapsed, ops, allocated;
+
+	if (n == 0)
+		return;
+
+	/* Warm up, and let stdio allocate its buffer */
+	run_pass(b, req, lines, n);
+	fflush(stdout);
+
+	ops = 0;
+	allocs = 0;
+	counting = 1;
+	start = now_ns();
+	do {
+		run_pass(b, req, lines, n);
+		ops += n;
+		elapsed = now_ns() - start;
+	} while (elapsed < seconds * 1000000000UL);
+	counting = 0;
+	allocated = allocs;
+	fflush(stdout);
+
+	r->ns = (double)elapsed / ops;
+	r->allocs = (double)allocated / ops;
+	r->ops = ops;
+	r->valid = 1;
+}
+
+/*
+ * Read a baseline saved with -o into results, by benchmark. Lines
+ * other than results, like the note printed before them, are skipped.
+ */
+static void
+load_baseline(const char *path, struct result *results) {
+
+	FILE *fp;
+	struct result r;
+	int b;
+	char line[256], name[64];
+
+	if ((fp = fopen(path, "r")) == NULL) {
+		perror(path);
+		exit(EXIT_FAILURE);
+		/* NOTREACHED */
+	}
+
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		if (sscanf(line, "%63s %lf ns/op %lf allocs/op %lu ops", name,
+			&r.ns, &r.allocs, &r.ops) != 4)
+			continue;
+		for (b = 0; b < BENCH_COUNT; b++)
+			if (strcmp(name, bench_names[b]) == 0) {
+				results[b] = r;
+				results[b].valid = 1;
+			}
+	}
+	fclose(fp);
+}
+
+/*
+ * Write s to fd, and to fp if there is one.
+ */
+static void
+emit(int fd, FILE *fp, const char *s) {
+
+	if (write(fd, s, strlen(s)) < 0)
+		perror("write");
+	if (fp != NULL && fputs(s, fp) == EOF)
+		perror("fputs");
+}
+
+/*
+ * Print how each result differs from the baseline, and return the number
+ * of regressions: functions more than threshold percent slower, or
+ * allocating more.
+ */
+static int
+compare(int out, const struct result *results, const struct result *base,
+	double threshold) {
+
+	double dns;
+	int b, failed, slower;
+	char line[256];
+
+	failed = 0;
+	for (b = 0; b < BENCH_COUNT; b++) {
+		if (!results[b].valid || !base[b].valid || base[b].ns <= 0)
+			continue;
+		dns = (results[b].ns - base[b].ns) * 100 / base[b].ns;
+		slower = dns > threshold
+			|| results[b].allocs > base[b].allocs + ALLOCS_SLACK;
+		snprintf(line, sizeof(line), "%-20s %+9.1f%% ns/op %+8.2f "
+			"allocs/op%s\n", bench_names[b], dns,
+			results[b].allocs - base[b].allocs,
+			slower ? "  REGRESSION" : "");
+		emit(out, NULL, line);
+		failed += slower;
+	}
+
+	return failed;
+}
+
+int
+main(int argc, char **argv) {
+
+	struct corpus corpus;
+	struct request *req;
+	struct result results[BENCH_COUNT], base[BENCH_COUNT];
+	FILE *save;
+	char *file, *baseline, *savefile;
+	char line[128];
+	double threshold;
+	size_t i;
+	int b, flag, out, null, seconds, failed;
+
+	file = baseline = savefile = NULL;
+	seconds = MICROBENCH_SECONDS;
+	threshold = MICROBENCH_THRESHOLD;
+	while ((flag = getopt(argc, argv, "c:f:ho:t:x:")) != -1) {
+		switch (flag) {
+		case 'c':
+			baseline = optarg;
+			break;
+		case 'f':
+			file = optarg;
+			break;
+		case 'o':
+			savefile = optarg;
+			break;
+		case 't':
+			if ((seconds = atoi(optarg)) < 1)
+				usage();
+			break;
+		case 'x':
+			if ((threshold = atof(optarg)) <= 0)
+				usage();
+			break;
+		case 'h':
+			/* FALLTHROUGH */
+		default:
+			usage();
+		}
+	}
+
+	memset(&corpus, 0, sizeof(corpus));
+	if (file != NULL)
+		load_corpus(&corpus, file);
+	else {
+		for (i = 0; i < sizeof(builtin_lines) / sizeof(char*); i++)
+			add_request_line(&corpus, builtin_lines[i]);
+		for (i = 0; i < sizeof(builtin_headers) / sizeof(char*); i++)
+			add_line(corpus.headers, &corpus.nheaders,
+				builtin_headers[i]);
+	}
+
+	memset(base, 0, sizeof(base));
+	if (baseline != NULL)
+		load_baseline(baseline, base);
+
+	save = NULL;
+	if (savefile != NULL && (save = fopen(savefile, "w")) == NULL) {
+		perror(savefile);
+		exit(EXIT_FAILURE);
+		/* NOTREACHED */
+	}
+
+	if ((req = create_request()) == NULL)
+		exit(EXIT_FAILURE);
+
+	/* The parser's debugging output goes where a daemon's does */
+	if ((out = dup(STDOUT_FILENO)) < 0
+		|| (null = open("/dev/null", O_WRONLY)) < 0
+		|| dup2(null, STDOUT_FILENO) < 0) {
+		perror("/dev/null");
+		exit(EXIT_FAILURE);
+		/* NOTREACHED */
+	}
+	close(null);
+
+	memset(results, 0, sizeof(results));
+	run_bench(BENCH_BASELINE, req, corpus.lines, corpus.nlines, seconds,
+		&results[BENCH_BASELINE]);
+	run_bench(BENCH_PARSE_METHOD, req, corpus.lines, corpus.nlines,
+		seconds, &results[BENCH_PARSE_METHOD]);
+	run_bench(BENCH_PARSE_HEADER, req, corpus.headers, corpus.nheaders,
+		seconds, &results[BENCH_PARSE_HEADER]);
+	run_bench(BENCH_HTTP_REALPATH, req, corpus.paths, corpus.npaths,
+		seconds, &results[BENCH_HTTP_REALPATH]);
+	run_bench(BENCH_MY_REALPATH, req, corpus.paths, corpus.npaths,
+		seconds, &results[BENCH_MY_REALPATH]);
+
+	destroy_request(req);
+
+	emit(out, save, "# times include the parser's debugging printf()s, "
+		"written to /dev/null\n");
+	for (b = 0; b < BENCH_COUNT; b++) {
+		if (!results[b].valid)
+			continue;
+		snprintf(line, sizeof(line), "%-20s %10.1f ns/op %8.2f "
+			"allocs/op %12lu ops\n", bench_names[b], results[b].ns,
+			results[b].allocs, results[b].ops);
+		emit(out, save, line);
+	}
+
+	if (save != NULL && fclose(save) == EOF) {
+		perror(savefile);
+		exit(EXIT_FAILURE);
+		/* NOTREACHED */
+	}
+
+	if (baseline == NULL)
+		return EXIT_SUCCESS;
+
+	snprintf(line, sizeof(line), "\ncompared with %s, failing above "
+		"+%.1f%% ns/op:\n", baseline, threshold);
+	emit(out, NULL, line);
+	failed = compare(out, results, base, threshold);
+	snprintf(line, sizeof(line), "%d regression%s\n", failed,
+		failed == 1 ? "" : "s");
+	emit(out, NULL, line);
+
+	return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+void
+usage(void) {
+	fprintf(stderr, "usage: sws-microbench [-h][-c baseline [-x pct]]"
+		"[-f file][-o file]\n"
+		"                      [-t seconds]\n");
+	exit(EXIT_FAILURE);
+	/* NOTREACHED */
+}
@@ -1,17 +1,34 @@
-#define _XOPEN_SOURCE 1000
+#define _GNU_SOURCE
 
+#include <sys/types.h>
+
+#include <ctype.h>
+#include <limits.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <strings.h>
 #include <time.h>
 
+#include "date.h"
 #include "defines.h"
 #include "parse.h"
+#include "stats.h"
 #include "utils.h"
 
+#ifndef OFF_MAX
+#define OFF_MAX ((off_t)INT64_MAX)
+#endif
+
+static const char* parse_offset(const char*, off_t*);
+
+/*
+ * Map a request path to the file it names, allocated from arena: under
+ * serve_dir, or under ~user/sws for a /~user path.
+ */
 char*
-http_realpath(char *path, char *serve_dir) {
+http_realpath(struct arena *arena, char *path, char *serve_dir) {
 
 	int username_len;
 	char *tmp, *newpath;
@@ -24,32 +41,35 @@ http_realpath(char *path, char *serve_dir) {
 			*tmp != '/' && *tmp != '\0' && *tmp != ' ';
 			 tmp++, username_len++);
 		if (*tmp == '\0' || *tmp == ' ') {
-			newpath = calloc(1, strlen("/home/")
-				+ username_len + strlen("/sws") + 1);
+			if ((newpath = arena_calloc(arena, strlen("/home/")
+				+ username_len + strlen("/sws") + 1)) == NULL)
+				return NULL;
 			conncat(newpath, 3, "/home/", strlen("/home/"),
 				path+2, username_len,
 				"/sws", strlen("/sws"));
 			return newpath;
 		}
 
-		if ((tmp = my_realpath(path+2+username_len)) == NULL) {
-			//error
-		}
-		newpath = calloc(1, strlen(tmp) + username_len + 11);
+		if ((tmp = my_realpath(arena, path+2+username_len)) == NULL)
+			return NULL;
+		if ((newpath = arena_calloc(arena,
+			strlen(tmp) + username_len + 11)) == NULL)
+			return NULL;
 		conncat(newpath, 4, "/home/", 6,
 			path+2, username_len,
 			"/sws", 4,
 			tmp, strlen(tmp));
-		free(tmp);
 		return newpath;
 	} else {
-		tmp = my_realpath(path);
-		newpath = calloc(1, strlen(tmp)+strlen(serve_dir)+1);
+		if ((tmp = my_realpath(arena, path)) == NULL)
+			return NULL;
+		if ((newpath = arena_calloc(arena,
+			strlen(tmp)+strlen(serve_dir)+1)) == NULL)
+			return NULL;
 		conncat(newpath, 2, serve_dir, strlen(serve_dir),
 			tmp, strlen(tmp));
 		if (newpath[strlen(newpath)-1] == '/')
 			newpath[strlen(newpath)-1] = '\0';
-		free(tmp);
 		return newpath;
 	}
 
@@ -59,7 +79,6 @@ int
 sws_parse_method(struct request *req, char *buf, char *serve_dir) {
 	printf("entering parse_method\n");
 	int i;
-	char *tmp;
 
 	if (strncmp("GET ", buf, 4) == 0) {
 		i = 3;
@@ -83,31 +102,35 @@ sws_parse_method(struct request *req, char *buf, char *serve_dir) {
 		return -1;
 	}
 
-	for (i = 0; buf[i] != ' ' && buf[i] != '\r'
-		&& i < strlen(buf); i++)
+	for (i = 0; buf[i] != ' ' && buf[i] != '\0'; i++)
 		;
-	if ((tmp = calloc(1, i+1)) == NULL) {
-		fprintf(stderr, "calloc error\n");
+	if ((req->path = arena_strndup(&req->arena, buf, i)) == NULL) {
 		http_status = STATUS_500;
 		return -1;
 	}
-	strncpy(tmp, buf, i);
-	req->path = tmp;
 
-	if ((req->realpath = http_realpath(req->path, serve_dir)) == NULL) {
+	stats_phase(&req->trace, PHASE_PARSE);
+	if ((req->realpath = http_realpath(&req->arena, req->path,
+		serve_dir)) == NULL) {
 		http_status = STATUS_500;
 		return -1;
 	}
+	stats_phase(&req->trace, PHASE_REALPATH);
 
 	for (;i > 0; i--, buf++);
 	for (;*buf == ' '; buf++);
 
-	if ((strncmp(buf, CRLF, 2) == 0) && req->method == 0) {
+	if (*buf == '\0' && req->method == 0) {
 		req->simple = 1;
+		req->version = "0.9";
 	} else if (strncmp(buf, "HTTP/1.0", 8) == 0) {
-	//make HTTP/1.1 for now for browser testing
-	//} else if (strncmp(buf, "HTTP/1.1", 8) == 0) {
 		req->simple = 0;
+		req->version = "1.0";
+	} else if (strncmp(buf, "HTTP/1.1", 8) == 0) {
+		/* Persistent unless the client asks otherwise */
+		req->simple = 0;
+		req->version = "1.1";
+		req->keepalive = 1;
 	} else {
 		http_status = STATUS_400;
 		return -1;
@@ -119,7 +142,7 @@ sws_parse_method(struct request *req, char *buf, char *serve_dir) {
 int
 sws_parse_header(struct request *req, char *buf) {
 	printf("entering parse_header\n");
-	struct tm time;
+	off_t length;
 	int i;
 	char *tmp;
 
@@ -131,38 +154,375 @@ sws_parse_header(struct request *req, char *buf) {
 	for (;*buf == ' '; buf++);
 	for (i = 0; buf[i] != ':'; i++);
 
-	if (strncasecmp(buf, "If-Modified-Since", i) == 0) {
-		for (; i > 0; i--, buf++);
-		if (*buf != ':' && (*(buf+1) != ' ')) {
+	if ((i == strlen("Range") && strncasecmp(buf, "Range", i) == 0)
+		|| (i == strlen("If-Range") &&
+		strncasecmp(buf, "If-Range", i) == 0)
+		|| (i == strlen("If-None-Match") &&
+		strncasecmp(buf, "If-None-Match", i) == 0)
+		|| (i == strlen("Content-Type") &&
+		strncasecmp(buf, "Content-Type", i) == 0)) {
+		tmp = buf + i + 1;
+		for (; *tmp == ' ' || *tmp == '\t'; tmp++);
+		if ((tmp = arena_strdup(&req->arena, tmp)) == NULL) {
+			http_status = STATUS_500;
+			return -1;
+		}
+		if (i == strlen("Range"))
+			req->range = tmp;
+		else if (i == strlen("If-None-Match"))
+			req->if_none_match = tmp;
+		else if (i == strlen("Content-Type"))
+			req->content_type = tmp;
+		else
+			req->if_range = tmp;
+	} else if (i == strlen("Content-Length") &&
+		strncasecmp(buf, "Content-Length", i) == 0) {
+		for (tmp = buf + i + 1; *tmp == ' ' || *tmp == '\t'; tmp++);
+		/* Two lengths, or a length and chunks, could frame two ways */
+		if (req->chunked || req->length != (unsigned long)-1
+			|| (tmp = (char*)parse_offset(tmp, &length)) == NULL
+			|| tmp[strspn(tmp, " \t")] != '\0') {
 			http_status = STATUS_400;
 			return -1;
 		}
-		buf += 2;
-
-		if ((tmp = calloc(1, strlen(buf))) == NULL) {
-			fprintf(stderr, "calloc error\n");
-			http_status = STATUS_500;
+		req->length = req->left = length;
+		req->unread = length > 0;
+	} else if (i == strlen("Transfer-Encoding") &&
+		strncasecmp(buf, "Transfer-Encoding", i) == 0) {
+		for (tmp = buf + i + 1; *tmp == ' ' || *tmp == '\t'; tmp++);
+		if (strncasecmp(tmp, "chunked", 7) != 0
+			|| tmp[7 + strspn(tmp + 7, " \t")] != '\0') {
+			http_status = STATUS_501;
 			return -1;
 		}
-		strncpy(tmp, buf, strlen(buf));
-		req->if_mod_since = tmp;
-
-		/* Trim CRLF */
-		for (; *tmp != '\r' && *tmp != '\n'; tmp++);
-		tmp = '\0';
-
-		if (strptime(req->if_mod_since, RFC1123_DATE, &time) != NULL)
-			req->date_format = RFC1123_DATE;
-		else if (strptime(req->if_mod_since, RFC850_DATE, &time) != NULL)
-			req->date_format = RFC850_DATE;
-		else if (strptime(req->if_mod_since, ASCTIME_DATE, &time) != NULL)
-			req->date_format = ASCTIME_DATE;
-		else {
-			free(req->if_mod_since);
-			req->date_format = req->if_mod_since = NULL;
+		if (req->length != (unsigned long)-1) {
+			http_status = STATUS_400;
+			return -1;
 		}
+		req->chunked = req->unread = 1;
+		req->body_state = BODY_SIZE;
+	} else if (i == strlen("Accept-Encoding") &&
+		strncasecmp(buf, "Accept-Encoding", i) == 0) {
+		req->accept_encoding = sws_parse_accept_encoding(buf + i + 1);
+	} else if (i == strlen("Connection") &&
+		strncasecmp(buf, "Connection", i) == 0) {
+		buf += i + 1;
+		if (strcasestr(buf, "close") != NULL)
+			req->keepalive = 0;
+		else if (strcasestr(buf, "keep-alive") != NULL)
+			req->keepalive = 1;
+	} else if (i == strlen("If-Modified-Since") &&
+		strncasecmp(buf, "If-Modified-Since", i) == 0) {
+		for (tmp = buf + i + 1; *tmp == ' ' || *tmp == '\t'; tmp++);
+		/* An invalid date is ignored */
+		req->if_mod_since = http_parse_date(tmp);
 	}
 
 	printf("leaving parse_header\n");
 	return 0;
 }
+
+/*
+ * Return the ENCODING_ flags for the codings an Accept-Encoding header
+ * value allows. A coding with q=0 is refused, and "*" stands for every
+ * coding not named otherwise.
+ */
+int
+sws_parse_accept_encoding(const char *value) {
+
+	const char *name, *p;
+	size_t len;
+	int flag, star, refused, accepted, named, any;
+
+	accepted = named = any = 0;
+	for (p = value; *p != '\0'; ) {
+		for (; *p == ' ' || *p == '\t' || *p == ','; p++);
+		name = p;
+		for (; *p != '\0' && *p != ',' && *p != ';'
+			&& *p != ' ' && *p != '\t'; p++);
+		len = p - name;
+
+		flag = star = 0;
+		if (len == strlen("br") && strncasecmp(name, "br", len) == 0)
+			flag = ENCODING_BR;
+		else if ((len == strlen("gzip") &&
+			strncasecmp(name, "gzip", len) == 0)
+			|| (len == strlen("x-gzip") &&
+			strncasecmp(name, "x-gzip", len) == 0))
+			flag = ENCODING_GZIP;
+		else if (len == 1 && *name == '*')
+			star = 1;
+
+		/* Of the parameters, only a q of zero matters here */
+		for (refused = 0; *p != '\0' && *p != ','; p++) {
+			if (*p != ';')
+				continue;
+			for (; p[1] == ' ' || p[1] == '\t'; p++);
+			if ((p[1] == 'q' || p[1] == 'Q') && p[2] == '='
+				&& strtod(p + 3, NULL) <= 0)
+				refused = 1;
+		}
+
+		named |= flag;
+		if (!refused) {
+			accepted |= flag;
+			any |= star;
+		}
+	}
+
+	if (any)
+		accepted |= (ENCODING_BR | ENCODING_GZIP) & ~named;
+
+	return accepted;
+}
+
+/*
+ * Parse one number of a byte range spec into *n. Returns the end of the
+ * number, or NULL if there is none or it overflows.
+ */
+static const char*
+parse_offset(const char *p, off_t *n) {
+
+	off_t v;
+
+	if (*p < '0' || *p > '9')
+		return NULL;
+	for (v = 0; *p >= '0' && *p <= '9'; p++) {
+		if (v > (OFF_MAX - (*p - '0')) / 10)
+			return NULL;
+		v = v * 10 + (*p - '0');
+	}
+	*n = v;
+
+	return p;
+}
+
+/*
+ * Resolve the value of a Range header against a file of the given size,
+ * filling in at most max ranges. Returns the number of satisfiable
+ * ranges, 0 if there are none (a 416), or -1 if the header is malformed
+ * or asks for too many ranges, in which case it is to be ignored.
+ */
+int
+sws_parse_range(const char *spec, off_t size, struct byte_range *ranges,
+	int max) {
+
+	off_t first, last;
+	int n;
+
+	if (strncasecmp(spec, "bytes=", 6) != 0)
+		return -1;
+	spec += 6;
+
+	for (n = 0; ; ) {
+		for (; *spec == ' ' || *spec == '\t'; spec++);
+
+		if (*spec == '-') {
+			/* Suffix: the last n bytes */
+			if ((spec = parse_offset(spec + 1, &last)) == NULL)
+				return -1;
+			if (last > 0 && size > 0) {
+				if (n == max)
+					return -1;
+				ranges[n].start = last < size ? size - last : 0;
+				ranges[n].len = size - ranges[n].start;
+				n++;
+			}
+		} else {
+			if ((spec = parse_offset(spec, &first)) == NULL
+				|| *spec++ != '-')
+				return -1;
+			last = OFF_MAX;
+			if (*spec >= '0' && *spec <= '9') {
+				if ((spec = parse_offset(spec, &last)) == NULL
+					|| last < first)
+					return -1;
+			}
+			if (first < size) {
+				if (n == max)
+					return -1;
+				if (last >= size)
+					last = size - 1;
+				ranges[n].start = first;
+				ranges[n].len = last - first + 1;
+				n++;
+			}
+		}
+
+		for (; *spec == ' ' || *spec == '\t'; spec++);
+		if (*spec == '\0')
+			break;
+		if (*spec++ != ',')
+			return -1;
+	}
+
+	return n;
+}
+
+/*
+ * Parse the size line of a chunk of a request body into *size, ignoring
+ * any chunk extensions. Returns -1 if it is malformed.
+ */
+int
+sws_parse_chunk_size(const char *line, unsigned long *size) {
+
+	unsigned long v;
+	int d;
+
+	if (!isxdigit((unsigned char)*line))
+		return -1;
+	for (v = 0; isxdigit((unsigned char)*line); line++) {
+		d = isdigit((unsigned char)*line) ? *line - '0'
+			: (tolower((unsigned char)*line) - 'a' + 10);
+		if (v > (ULONG_MAX - d) / 16)
+			return -1;
+		v = v * 16 + d;
+	}
+	line += strspn(line, " \t");
+	if (*line != '\0' && *line != ';')
+		return -1;
+	*size = v;
+
+	return 0;
+}
+
+/*
+ * Take in the value of a script's Status header, a three digit code and
+ * an optional reason phrase, as the status line of the response. Codes
+ * the server knows set http_status as well. Returns -1 if it is invalid.
+ */
+static int
+cgi_status(struct response *resp, const char *value) {
+
+	const char *reason;
+	int i;
+
+	if (value[0] < '2' || value[0] > '5' || !isdigit((unsigned char)value[1])
+		|| !isdigit((unsigned char)value[2])
+		|| (value[3] != '\0' && value[3] != ' '))
+		return -1;
+	for (reason = value + 3; *reason == ' '; reason++)
+		;
+	snprintf(resp->status_line, sizeof(resp->status_line), " %.3s %.*s\r\n",
+		value, (int)sizeof(resp->status_line) - 8, reason);
+
+	for (i = 0; i < STATUS_COUNT; i++)
+		if (strncmp(status_lines[i].line + 1, value, 3) == 0)
+			http_status = i;
+
+	return 0;
+}
+
+/*
+ * Return whether the status a script gave forbids a body.
+ */
+int
+sws_cgi_bodyless(const struct response *resp) {
+
+	return strncmp(resp->status_line, " 204", 4) == 0
+		|| strncmp(resp->status_line, " 304", 4) == 0;
+}
+
+/*
+ * Find the empty line ending the headers a CGI script starts its output
+ * with. Returns the offset of the body, or -1 if it has not arrived yet.
+ */
+ssize_t
+sws_cgi_headers_end(const char *buf, size_t len) {
+
+	const char *p, *eol;
+
+	for (p = buf; p < buf + len; p = eol + 1) {
+		if ((eol = memchr(p, '\n', buf + len - p)) == NULL)
+			return -1;
+		if (eol == p || (eol == p + 1 && *p == '\r'))
+			return eol + 1 - buf;
+	}
+
+	return -1;
+}
+
+/*
+ * Return whether a header a CGI script sends is one the server sets
+ * itself, as it frames the body and keeps the connection alive or not on
+ * its own: Content-Length, and the hop-by-hop headers.
+ */
+static int
+cgi_framing_header(const char *name) {
+
+	static const char *names[] = {
+		"Connection", "Content-Length", "Keep-Alive",
+		"Proxy-Connection", "TE", "Trailer", "Transfer-Encoding",
+		"Upgrade",
+	};
+	size_t i;
+
+	for (i = 0; i < sizeof(names) / sizeof(char*); i++)
+		if (strcasecmp(name, names[i]) == 0)
+			return 1;
+
+	return 0;
+}
+
+/*
+ * Apply the headers at the start of a CGI script's output to the response.
+ * Status and Content-Type are taken in, and the framing headers dropped;
+ * other headers are passed on to the client as they are. Returns the offset of the body, or -1 if the
+ * output has no complete header block within CGI_HEADERS_MAX bytes or an
+ * invalid Status.
+ */
+ssize_t
+sws_parse_cgi_headers(struct request *req, struct response *resp, char *out,
+	size_t len) {
+
+	char *p, *end, *eol, *value, *extra, *q;
+	size_t nlen;
+
+	if (len > CGI_HEADERS_MAX)
+		len = CGI_HEADERS_MAX;
+	/* Lines grow as they are rewritten, at most ":\n" to ": \r\n" */
+	if ((extra = arena_alloc(&req->arena, 2 * len + 1)) == NULL)
+		return -1;
+	q = extra;
+
+	end = out + len;
+	for (p = out; ; p = eol + 1) {
+		if ((eol = memchr(p, '\n', end - p)) == NULL)
+			goto bad;
+		nlen = eol - p;
+		if (nlen > 0 && p[nlen - 1] == '\r')
+			nlen--;
+		if (nlen == 0)
+			break;
+
+		if ((value = memchr(p, ':', nlen)) == NULL)
+			continue;
+		*value = '\0';
+		for (value++; *value == ' ' || *value == '\t'; value++)
+			;
+		p[nlen] = '\0';
+
+		if (strcasecmp(p, "Content-Type") == 0) {
+			if ((resp->content_type = arena_strdup(&req->arena,
+				value)) == NULL)
+				goto bad;
+		} else if (strcasecmp(p, "Status") == 0) {
+			if (cgi_status(resp, value) < 0)
+				goto bad;
+		} else if (!cgi_framing_header(p)) {
+			q = put(q, p, strlen(p));
+			q = PUT_LITERAL(q, ": ");
+			q = put(q, value, strlen(value));
+			q = PUT_LITERAL(q, "\r\n");
+		}
+	}
+
+	*q = '\0';
+	resp->extra_headers = extra;
+	return eol + 1 - out;
+
+bad:
+	/* The error page must not go out under the script's status */
+	resp->status_line[0] = '\0';
+	return -1;
+}
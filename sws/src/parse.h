@@ -2,10 +2,20 @@
 #define _PARSE_H_
 
 #include "request.h"
+#include "response.h"
 
-char* http_realpath(char*, char*);
+/* Longest header block accepted from a CGI script */
+#define CGI_HEADERS_MAX 2048
+
+char* http_realpath(struct arena*, char*, char*);
 int sws_parse_method(struct request*, char*, char*);
 int sws_parse_header(struct request*, char*);
+int sws_parse_accept_encoding(const char*);
+int sws_parse_range(const char*, off_t, struct byte_range*, int);
+int sws_parse_chunk_size(const char*, unsigned long*);
 int strrchr_pos(char*, char, int);
+ssize_t sws_cgi_headers_end(const char*, size_t);
+ssize_t sws_parse_cgi_headers(struct request*, struct response*, char*, size_t);
+int sws_cgi_bodyless(const struct response*);
 
 #endif
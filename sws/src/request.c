@@ -12,26 +12,42 @@ create_request(void) {
 		return NULL;
 	}
 
+	arena_init(&req->arena);
+	reset_request(req);
+
+	return req;
+}
+
+/*
+ * Free everything the previous request on a connection allocated, all of
+ * it from req's arena, and return req to its initial state so it can be
+ * reused.
+ */
+void
+reset_request(struct request *req) {
+
+	arena_reset(&req->arena);
+
 	req->length = -1;
-	req->date_format = req->if_mod_since
+	req->chunked = req->unread = 0;
+	req->left = 0;
+	req->body_state = BODY_DATA;
+	req->discard = 0;
+	req->method = req->simple = req->keepalive = 0;
+	req->accept_encoding = 0;
+	req->if_mod_since = -1;
+	req->version = NULL;
+	req->if_none_match
+		= req->if_range = req->range = req->content_type
 		= req->ip = req->method_line
 		= req->path = req->realpath
 		= NULL;
-
-	return req;
 }
 
 void
 destroy_request(struct request *req) {
 
-	if (req->ip)
-		free(req->ip);
-	if (req->method_line)
-		free(req->method_line);
-	if (req->path)
-		free(req->path);
-	if (req->realpath)
-		free(req->realpath);
+	reset_request(req);
 
 	free(req);
 	req = NULL;
@@ -1,19 +1,64 @@
 #ifndef _REQUEST_H_
 #define _REQUEST_H_
 
+#include <sys/types.h>
+
+#include "arena.h"
+#include "stats.h"
+
+/* Most ranges answered in one multipart/byteranges response */
+#define RANGE_MAX 16
+
+/* A byte range of a file, after resolving it against the file's size */
+struct byte_range {
+	off_t start;
+	off_t len;
+};
+
+/* How far reading a request body has got */
+#define BODY_DATA 0
+#define BODY_SIZE 1
+#define BODY_DATA_END 2
+#define BODY_TRAILER 3
+
+/* Content codings a client accepts, in order of preference */
+#define ENCODING_BR 0x01
+#define ENCODING_GZIP 0x02
+
 struct request {
+	/* Content-Length, (unsigned long)-1 without one */
 	unsigned long length;
+	/* Body comes in chunks, its length unknown */
+	int chunked;
+	/* Some of the body has not been read from the connection yet */
+	int unread;
+	/* Bytes left of the body, or of its current chunk, and what follows */
+	unsigned long left;
+	int body_state;
+	/* The rest of the body is read only to be thrown away */
+	int discard;
 	int method;
+	int accept_encoding;
 	int simple;
-	char *date_format;
-	char *if_mod_since;
+	int keepalive;
+	char *version;
+	/* -1 without a valid If-Modified-Since */
+	time_t if_mod_since;
+	char *if_none_match;
+	char *if_range;
+	char *range;
+	char *content_type;
 	char *ip;
 	char *method_line;
 	char *path;
 	char *realpath;
+	/* Where the strings above come from */
+	struct arena arena;
+	struct stats_trace trace;
 };
 
 struct request* create_request(void);
+void reset_request(struct request*);
 void destroy_request(struct request*);
 
 #endif
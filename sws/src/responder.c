@@ -0,0 +1,223 @@
+/*
+ * responder.c - sws-responder, a stand-in FastCGI application
+ *
+ * A minimal FastCGI responder to try sws -f with: put it in the CGI
+ * directory and request it. It accepts connections on the socket it is
+ * given as its standard input, as sws starts it, and answers each request
+ * with a short text/plain page naming the method, the URI, the size of
+ * the request body and the process that served it, so that reuse of the
+ * processes and their connections can be seen. Connections are kept open
+ * when the server asks for it.
+ */
+#include <sys/socket.h>
+#include <sys/types.h>
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "fcgi.h"
+
+/* A parameter's value is kept if it fits */
+#define VALUE_MAX 1024
+
+struct record {
+	int type;
+	int id;
+	size_t len;
+	unsigned char data[FCGI_RECORD_MAX];
+};
+
+static int
+read_full(int fd, void *buf, size_t len) {
+
+	ssize_t n;
+	char *p;
+
+	for (p = buf; len > 0; p += n, len -= n) {
+		if ((n = read(fd, p, len)) < 0 && errno == EINTR) {
+			n = 0;
+			continue;
+		}
+		if (n <= 0)
+			return -1;
+	}
+
+	return 0;
+}
+
+static int
+write_full(int fd, const void *buf, size_t len) {
+
+	ssize_t n;
+	const char *p;
+
+	for (p = buf; len > 0; p += n, len -= n) {
+		if ((n = write(fd, p, len)) < 0) {
+			if (errno != EINTR)
+				return -1;
+			n = 0;
+		}
+	}
+
+	return 0;
+}
+
+static int
+read_record(int fd, struct record *r) {
+
+	unsigned char h[FCGI_HEADER_LEN], pad[256];
+
+	if (read_full(fd, h, sizeof(h)) < 0 || h[0] != FCGI_VERSION_1)
+		return -1;
+	r->type = h[1];
+	r->id = (h[2] << 8) | h[3];
+	r->len = (h[4] << 8) | h[5];
+	if (read_full(fd, r->data, r->len) < 0 || read_full(fd, pad, h[6]) < 0)
+		return -1;
+
+	return 0;
+}
+
+static int
+write_record(int fd, int type, int id, const char *data, size_t len) {
+
+	unsigned char h[FCGI_HEADER_LEN];
+
+	h[0] = FCGI_VERSION_1;
+	h[1] = type;
+	h[2] = (id >> 8) & 0xff;
+	h[3] = id & 0xff;
+	h[4] = (len >> 8) & 0xff;
+	h[5] = len & 0xff;
+	h[6] = h[7] = 0;
+
+	if (write_full(fd, h, sizeof(h)) < 0)
+		return -1;
+	return write_full(fd, data, len);
+}
+
+/* Name and value lengths take one byte below 128, four otherwise */
+static size_t
+get_length(const unsigned char **p, const unsigned char *end) {
+
+	size_t len;
+
+	if (*p >= end)
+		return (size_t)-1;
+	if (**p < 128)
+		return *(*p)++;
+	if (end - *p < 4)
+		return (size_t)-1;
+	len = ((size_t)((*p)[0] & 0x7f) << 24) | ((size_t)(*p)[1] << 16)
+		| ((size_t)(*p)[2] << 8) | (*p)[3];
+	*p += 4;
+
+	return len;
+}
+
+/*
+ * Copy the value of the parameter name, if the parameters in buf have it,
+ * to value, which holds VALUE_MAX bytes.
+ */
+static void
+get_param(const unsigned char *buf, size_t len, const char *name,
+	char *value) {
+
+	const unsigned char *p, *end;
+	size_t nlen, vlen;
+
+	for (p = buf, end = buf + len; p < end; p += nlen + vlen) {
+		if ((nlen = get_length(&p, end)) == (size_t)-1
+			|| (vlen = get_length(&p, end)) == (size_t)-1
+			|| nlen + vlen > (size_t)(end - p))
+			return;
+		if (nlen == strlen(name) && memcmp(p, name, nlen) == 0
+			&& vlen < VALUE_MAX) {
+			memcpy(value, p + nlen, vlen);
+			value[vlen] = '\0';
+			return;
+		}
+	}
+}
+
+/*
+ * Answer the requests that come over one connection. Returns 0 once the
+ * server closes it or asks for it to be closed, -1 on error.
+ */
+static int
+serve(int fd, unsigned long *served) {
+
+	static struct record r;
+	static unsigned char params[FCGI_RECORD_MAX * 4];
+	char method[VALUE_MAX], uri[VALUE_MAX], out[3 * VALUE_MAX];
+	unsigned char end[8];
+	size_t plen, body;
+	int id, keep, len;
+
+	while (1) {
+		if (read_record(fd, &r) < 0)
+			return 0;
+		if (r.type != FCGI_BEGIN_REQUEST || r.len != 8)
+			return -1;
+		id = r.id;
+		keep = r.data[2] & FCGI_KEEP_CONN;
+
+		/* Parameters, then stdin, each ended by an empty record */
+		plen = body = 0;
+		do {
+			if (read_record(fd, &r) < 0)
+				return -1;
+			if (r.type == FCGI_PARAMS
+				&& plen + r.len <= sizeof(params)) {
+				memcpy(params + plen, r.data, r.len);
+				plen += r.len;
+			} else if (r.type == FCGI_STDIN)
+				body += r.len;
+		} while (r.type != FCGI_STDIN || r.len > 0);
+
+		strcpy(method, "?");
+		strcpy(uri, "?");
+		get_param(params, plen, "REQUEST_METHOD", method);
+		get_param(params, plen, "REQUEST_URI", uri);
+
+		(*served)++;
+		len = snprintf(out, sizeof(out), "Content-Type: text/plain\r\n\r\n"
+			"method %s\nuri %s\nbody %zu bytes\npid %d, request %lu\n",
+			method, uri, body, (int)getpid(), *served);
+
+		memset(end, 0, sizeof(end));
+		end[4] = FCGI_REQUEST_COMPLETE;
+		if (write_record(fd, FCGI_STDOUT, id, out, len) < 0
+			|| write_record(fd, FCGI_STDOUT, id, NULL, 0) < 0
+			|| write_record(fd, FCGI_END_REQUEST, id, (char*)end,
+			sizeof(end)) < 0)
+			return -1;
+
+		if (!keep)
+			return 0;
+	}
+}
+
+int
+main(void) {
+
+	unsigned long served;
+	int fd;
+
+	served = 0;
+	while (1) {
+		if ((fd = accept(STDIN_FILENO, NULL, NULL)) < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("accept");
+			exit(EXIT_FAILURE);
+			/* NOTREACHED */
+		}
+		if (serve(fd, &served) < 0)
+			fprintf(stderr, "sws-responder: bad request\n");
+		close(fd);
+	}
+}
@@ -13,17 +13,32 @@ create_response(void) {
 		return NULL;
 	}
 
-	resp->length = -1;
-	resp->last_modified = resp->content_type = NULL;
+	reset_response(resp);
 
 	return resp;
 }
 
+/*
+ * Return resp to its initial state so it can be reused.
+ */
+void
+reset_response(struct response *resp) {
+
+	resp->length = -1;
+	resp->chunked = resp->ranges = resp->vary = 0;
+	resp->last_modified[0] = '\0';
+	resp->etag[0] = '\0';
+	resp->content_range[0] = '\0';
+	resp->content_type = NULL;
+	resp->content_encoding = NULL;
+	resp->extra_headers = NULL;
+	resp->status_line[0] = '\0';
+}
+
 void
 destroy_response(struct response *resp) {
 
-	if (resp->last_modified)
-		free(resp->last_modified);
+	reset_response(resp);
 	free(resp);
 	resp = NULL;
 }
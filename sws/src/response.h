@@ -1,13 +1,34 @@
 #ifndef _RESPONSE_H_
 #define _RESPONSE_H_
 
+#include "utils.h"
+
 struct response {
+	/* (unsigned long)-1 while the length is unknown */
 	unsigned long length;
-	char *last_modified;
+	int chunked;
+	/* Accept-Ranges is sent */
+	int ranges;
+	char last_modified[64];
+	char etag[ETAG_MAX];
+	char content_range[64];
 	char *content_type;
+	/* Coding of a precompressed body, and whether one might be chosen */
+	const char *content_encoding;
+	int vary;
+	/* Header lines passed through from a script, each ending in CRLF */
+	char *extra_headers;
+	/*
+	 * Status line a script asked for, less its "HTTP/x.y", in place of
+	 * that of http_status; empty if none
+	 */
+	char status_line[64];
+	/* Storage for a content type made up per response */
+	char content_type_buf[64];
 };
 
 struct response* create_response(void);
+void reset_response(struct response*);
 void destroy_response(struct response*);
 
 #endif
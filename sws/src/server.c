@@ -17,15 +17,21 @@
 #include <time.h>
 #include <unistd.h>
 
+#include "conn.h"
 #include "content_type.h"
+#include "date.h"
 #include "defines.h"
+#include "fcache.h"
+#include "fcgi.h"
 #include "files.h"
-#include "list.h"
+#include "gzcache.h"
 #include "log.h"
 #include "parse.h"
 #include "request.h"
 #include "response.h"
 #include "server.h"
+#include "stats.h"
+#include "utils.h"
 
 char *__sws_cgidir;
 char *__sws_dir;
@@ -35,17 +41,62 @@ char *__sws_logfile;
 int __sws_port = 8080;
 char *__sws_secdir;
 char *__sws_key;
+int __sws_timeout = KEEPALIVE_TIMEOUT;
+int __sws_max_requests = KEEPALIVE_MAX;
+int __sws_cache_size = FCACHE_BUDGET;
+int __sws_gzip_level = GZIP_LEVEL;
+int __sws_gzcache_size = GZCACHE_BUDGET;
+int __sws_fcgi_procs = 0;
+int __sws_status = 0;
+int __sws_trace = 0;
 
 int logfile_fd;
 
-char *http_status;
-struct list *ctypes;
+int http_status;
+
+#define STATUS_LINE(s) { " " s "\r\n", sizeof(" " s "\r\n") - 1 }
+
+/* Status lines less their "HTTP/x.y" prefix, indexed by status */
+const struct status_line status_lines[] = {
+	STATUS_LINE("200 OK"),
+	STATUS_LINE("206 Partial Content"),
+	STATUS_LINE("304 Not Modified"),
+	STATUS_LINE("400 Bad Request"),
+	STATUS_LINE("403 Forbidden"),
+	STATUS_LINE("404 Not Found"),
+	STATUS_LINE("416 Range Not Satisfiable"),
+	STATUS_LINE("500 Internal Server Error"),
+	STATUS_LINE("501 Not Implemented"),
+};
+struct ctype_table *ctypes;
+
+static int sws_dispatch(struct conn*, struct request*, struct response*);
+static int sws_server_status(struct conn*, struct request*,
+	struct response*);
 
 void
 sws_cleanup(int sig) {
 
 	fprintf(stderr, "Exiting...\n");
 
+	if (fcache_stats.hits + fcache_stats.misses > 0)
+		fprintf(stderr, "response cache: %lu hits, %lu misses\n",
+			fcache_stats.hits, fcache_stats.misses);
+	if (fcache_stats.listing_hits + fcache_stats.listing_misses > 0)
+		fprintf(stderr, "listing cache: %lu hits, %lu misses (%.1f%%)\n",
+			fcache_stats.listing_hits, fcache_stats.listing_misses,
+			100.0 * fcache_stats.listing_hits /
+			(fcache_stats.listing_hits + fcache_stats.listing_misses));
+	if (gzcache_stats.hits + gzcache_stats.misses > 0)
+		fprintf(stderr, "gzip cache: %lu hits, %lu misses, %lu bytes\n",
+			gzcache_stats.hits, gzcache_stats.misses,
+			(unsigned long)gzcache_stats.bytes);
+
+	fcgi_shutdown();
+	log_stop_writer();
+	if (log_dropped > 0)
+		fprintf(stderr, "access log: %lu lines dropped\n", log_dropped);
+
 	free_content_types(ctypes);
 
 	if (__sws_dir)
@@ -77,6 +128,14 @@ sws_init(const struct swsopts opts) {
 	__sws_port = opts.port;
 	__sws_secdir = opts.secdir;
 	__sws_key = opts.key;
+	__sws_timeout = opts.timeout;
+	__sws_max_requests = opts.max_requests;
+	__sws_cache_size = opts.cache_size;
+	__sws_gzip_level = opts.gzip_level;
+	__sws_gzcache_size = opts.gzcache_size;
+	__sws_fcgi_procs = opts.fcgi_procs;
+	__sws_status = opts.status;
+	__sws_trace = opts.trace;
 
 	if ((__sws_dir = realpath(__sws_dir, NULL)) == NULL) {
 		perror("realpath");
@@ -169,7 +228,15 @@ sws_init(const struct swsopts opts) {
 		}
 	}
 
-	if ((ctypes = create_list()) == NULL) {
+	/* Mapped before anything forks, so all processes share the slots */
+	if (__sws_status &&
+		stats_init((opts.workers > 0) ? opts.workers : 1) < 0) {
+		exit(EXIT_FAILURE);
+		/* NOTREACHED */
+	}
+	stats_set_trace(__sws_trace);
+
+	if ((ctypes = create_ctype_table()) == NULL) {
 		exit(EXIT_FAILURE);
 		/* NOTREACHED */
 	}
@@ -179,6 +246,13 @@ sws_init(const struct swsopts opts) {
 		/* NOTREACHED */
 	}
 
+	/* sendfile() to a closed socket must fail with EPIPE, not kill us */
+	if (signal(SIGPIPE, SIG_IGN) == SIG_ERR) {
+		perror("signal");
+		exit(EXIT_FAILURE);
+		/* NOTREACHED */
+	}
+
 	sig.sa_handler = sws_cleanup;
 	sigemptyset(&sig.sa_mask);
 
@@ -190,121 +264,181 @@ sws_init(const struct swsopts opts) {
 		exit(EXIT_FAILURE);
 		/* NOTREACHED */
 	}
+
+	/* SIGUSR1 reopens the log, for rotation */
+	sig.sa_handler = log_rotate;
+	sig.sa_flags = SA_RESTART;
+	if (sigaction(SIGUSR1, &sig, NULL) < 0) {
+		perror("sigaction");
+		exit(EXIT_FAILURE);
+		/* NOTREACHED */
+	}
 }
 
 void
 sws_handle_request(int sock) {
 
-	DIR *dp;
-	struct dirent *dir;
-	socklen_t client_len;
-	struct request *req;
-	struct response *resp;
-	struct sockaddr_storage client;
-	struct stat stat_buf;
-	int port, rval;
-	char ipstr[INET6_ADDRSTRLEN];
-	char buf[BUFF_SIZE];
+	struct conn *conn;
 
-	if ((req = create_request()) == NULL)
-		return;
-	if ((resp = create_response()) == NULL)
+	if ((conn = create_conn(sock, 1)) == NULL) {
+		close(sock);
 		return;
+	}
 
-	memset(&client, 0, sizeof(struct sockaddr_storage));
-	memset(ipstr, 0, INET6_ADDRSTRLEN);
-	memset(buf, 0, sizeof(buf));
-	client_len = sizeof(client);
+	fprintf(stderr, "Connection from %s to remote port %d\n",
+		conn->ip, conn->port);
 
-	if (getpeername(sock, (struct sockaddr*)&client, &client_len) == -1) {
-		fprintf(stderr, "Unable to get socket name: %s\n",
-			strerror(errno));
-		return;
+	while (1) {
+		sws_process_pipeline(conn);
+		if (conn_flush(conn) != 0 || !conn->keepalive)
+			break;
+		stats_flush();
+		conn_reset(conn);
+		if (!conn_wait(conn, __sws_timeout))
+			break;
 	}
 
-	if (client.ss_family == AF_INET) {
-		struct sockaddr_in *s = (struct sockaddr_in *)&client;
-		port = ntohs(s->sin_port);
-		if (!inet_ntop(AF_INET, &s->sin_addr, ipstr, sizeof(ipstr))) {
-			perror("inet_ntop");
-			return;
-		}
-	} else {
-		struct sockaddr_in6 *s = (struct sockaddr_in6*)&client;
-		port = ntohs(s->sin6_port);
-		if (!inet_ntop(AF_INET6, &s->sin6_addr, ipstr, sizeof(ipstr))) {
-			perror("inet_ntop");
-			return;
-		}
+	destroy_conn(conn);
+	stats_flush();
+}
+
+/*
+ * Read one request from the connection and queue its response. The
+ * connection's request and response are reused from one request to the
+ * next.
+ */
+int
+sws_process_request(struct conn *conn) {
+
+	int rval;
+
+	reset_request(conn->req);
+	reset_response(conn->resp);
+	conn->keepalive = 0;
+	conn->nrequests++;
+
+	stats_begin(&conn->req->trace,
+		(conn->nrequests == 1) ? conn->accepted : 0);
+	rval = sws_dispatch(conn, conn->req, conn->resp);
+
+	/*
+	 * Not a request if the client went away before sending one, and
+	 * counted only once queued if it waits on a script
+	 */
+	if (conn->req->method_line != NULL && conn->state != CONN_WAITING)
+		stats_request(&conn->req->trace);
+
+	return rval;
+}
+
+/*
+ * Handle the next request, then every further request the client has
+ * already pipelined behind it, queueing the responses in order so they
+ * can be written out together. Stops at the first response that closes
+ * the connection.
+ */
+int
+sws_process_pipeline(struct conn *conn) {
+
+	int n;
+
+	sws_process_request(conn);
+	for (n = 1; n < PIPELINE_MAX && conn->keepalive
+		&& conn->state != CONN_WAITING; n++) {
+		if (conn_request_ready(conn) <= 0)
+			break;
+		sws_process_request(conn);
 	}
 
-	fprintf(stderr, "Connection from %s to remote port %d\n",
-		ipstr, port);
+	return n;
+}
+
+static int
+sws_dispatch(struct conn *conn, struct request *req, struct response *resp) {
+
+	DIR *dp;
+	struct dirent *dir;
+	struct fcache_entry *fce;
+	struct stat stat_buf;
+	int cgi, rval;
+	char *line;
 
 	//Start with 200 OK
 	http_status = STATUS_200;
 
-	if ((req->ip = calloc(1, strlen(ipstr))) == NULL) {
-		fprintf(stderr, "calloc error\n");
+	if ((req->ip = arena_strdup(&req->arena, conn->ip)) == NULL) {
 		http_status = STATUS_500;
-		sws_response_headers(sock, req, resp);
+		return sws_response_headers(conn, req, resp);
 	}
-	strcpy(req->ip, ipstr);
 
-	if ((rval = sws_recv_line(sock, buf, BUFF_SIZE)) < 0) {
-		sws_response_headers(sock, req, resp);
-		return;
-	}
+	if ((rval = conn_recv_line(conn, &line)) < 0)
+		return sws_response_headers(conn, req, resp);
+	else if (rval == 0)
+		return -1;
+	stats_phase(&req->trace, PHASE_LINE);
 
-	if ((req->method_line = calloc(1, strlen(buf)+1)) == NULL) {
-		fprintf(stderr, "calloc error\n");
+	if ((req->method_line = arena_strdup(&req->arena, line)) == NULL) {
 		http_status = STATUS_500;
-		sws_response_headers(sock, req, resp);
-		return;
+		return sws_response_headers(conn, req, resp);
 	}
-	strncpy(req->method_line, buf, strlen(buf));
 
 	//parse method
-	if (sws_parse_method(req, buf, __sws_dir) < 0) {
-		sws_response_headers(sock, req, resp);
-		return;
-	}
+	if (sws_parse_method(req, line, __sws_dir) < 0)
+		return sws_response_headers(conn, req, resp);
 
 	//parse headers
 	while(1) {
-		memset(buf, 0, sizeof(buf));
 		if (req->simple)
 			break;
-		if ((rval = sws_recv_line(sock, buf, BUFF_SIZE)) < 0) {
-			sws_response_headers(sock, req, resp);
-			return;
+		if ((rval = conn_recv_line(conn, &line)) < 0) {
+			return sws_response_headers(conn, req, resp);
 		} else if (rval == 0) {
 			fprintf(stderr, "Connection closed by client\n");
-			return;
-		} else if ((strlen(buf) == 2) &&
-				(strcmp(buf, CRLF) == 0)) {
+			return -1;
+		} else if (*line == '\0') {
 			break;
 		} else {
-			if (sws_parse_header(req, buf) < 0) {
-				sws_response_headers(sock, req, resp);
-				return;
-			}
+			if (sws_parse_header(req, line) < 0)
+				return sws_response_headers(conn, req, resp);
 		}
 
 	}
+	stats_phase(&req->trace, PHASE_PARSE);
 	rval = 0;
 
+	if (__sws_status && strcmp(req->path, STATUS_PATH) == 0)
+		return sws_server_status(conn, req, resp);
+
 	printf("%s\n", req->realpath);
-	if (stat(req->realpath, &stat_buf) < 0) {
+	cgi = req->method == 2 || (__sws_cgidir &&
+		strncmp(req->realpath, __sws_cgidir, strlen(__sws_cgidir)) == 0);
+
+	/*
+	 * A cached path is known to be a regular file, or a directory without
+	 * an index.html; skip the stat.
+	 */
+	if (!cgi && (fce = fcache_lookup(req->realpath)) != NULL) {
+		if (!fce->isdir)
+			return sws_serve_file(conn, req, resp);
+		if (fce->response != NULL &&
+			fce->homedir == (req->path[1] == '~'))
+			return sws_index_cached(conn, req, resp, fce);
+	}
+
+	stats_mark(&req->trace);
+	rval = stat(req->realpath, &stat_buf);
+	stats_phase(&req->trace, PHASE_STAT);
+	if (rval < 0) {
+		rval = errno;
 		perror("stat");
+		errno = rval;
 		if (errno == EACCES)
 			http_status = STATUS_403;
 		else if (errno == ENOENT || errno == ENOTDIR)
 			http_status = STATUS_404;
 		else
 			http_status = STATUS_500;
-		sws_response_headers(sock, req, resp);
-		return;
+		return sws_response_headers(conn, req, resp);
 	}
 
 	//sws_verify_file(path);
@@ -324,156 +458,281 @@ sws_handle_request(int sock) {
 		if ((dp = opendir(req->realpath)) == NULL) {
 			perror("opendir");
 			http_status = STATUS_500;
-			return;
+			return sws_response_headers(conn, req, resp);
 		}
 
 		while ((dir = readdir(dp)) != NULL) {
 			if (strcmp(dir->d_name, "index.html") == 0) {
-				if ((index_path =
-					malloc(strlen(req->realpath)+strlen("index.html")+1)) == NULL) {
-					fprintf(stderr, "malloc error\n");
+				if ((index_path = arena_alloc(&req->arena,
+					strlen(req->realpath)+strlen("index.html")+2)) == NULL) {
 					http_status = STATUS_500;
-					sws_response_headers(sock, req, resp);
-					return;
+					closedir(dp);
+					return sws_response_headers(conn, req, resp);
 				}
 				index = 0;
 				sprintf(index_path, "%s/index.html", req->realpath);
-				free(req->realpath);
 				req->realpath = index_path;
-				sws_serve_file(sock, req, resp);
+				rval = sws_serve_file(conn, req, resp);
 				break;
 			}
 		}
+		closedir(dp);
 
 		if (index)
-			sws_create_index(sock, req, resp, __sws_dir);
+			rval = sws_create_index(conn, req, resp, __sws_dir);
 	} else {
-		if (req->method == 2) //POST, need to read req body
-			sws_execute_cgi(sock, req, resp);
-		if (__sws_cgidir &&
-			strncmp(req->realpath, __sws_cgidir, strlen(__sws_cgidir)) == 0)
-			sws_execute_cgi(sock, req, resp);
+		if (cgi)
+			rval = sws_execute_cgi(conn, req, resp);
 		else
-			sws_serve_file(sock, req, resp);
+			rval = sws_serve_file(conn, req, resp);
 	}
 
-	printf("destroying req\n");
-	destroy_request(req);
-	printf("destroying resp\n");
-	destroy_response(resp);
+	return rval;
 }
 
-int
-sws_recv_line(int sock, char *buf, int len) {
+/*
+ * Answer with the statistics of all processes, as plain text.
+ */
+static int
+sws_server_status(struct conn *conn, struct request *req,
+	struct response *resp) {
 
-	int i, n;
-	char c;
+	char *body;
+	size_t len;
+	int rval;
 
-	i = 0;
-	for (; i < len - 1;) {
-		if ((n = recv(sock, &c, 1, 0)) < 0) {
-			perror("recv");
-			http_status = STATUS_500;
-			return -1;
-		}
-		if (n > 0) {
-			if (c == '\r') {
-				buf[i] = c;
-				i++;
-				if ((n = recv(sock, &c, 1, MSG_PEEK)) < 0) {
-					perror("recv");
-					http_status = STATUS_500;
-					return -1;
-				}
-				if ((n > 0) && (c == '\n')) {
-					if (recv(sock, &c, 1, 0) < 0) {
-						perror("recv");
-						http_status = STATUS_500;
-						return -1;
-					}
-				} else {
-					http_status = STATUS_400;
-					return -1;
-				}
-			}
-			buf[i] = c;
-			i++;
-			if (c == '\n')
-				break;
-		} else {
-			break;
-		}
+	if ((body = stats_report(&len)) == NULL) {
+		http_status = STATUS_500;
+		return sws_response_headers(conn, req, resp);
+	}
+
+	resp->content_type = "text/plain";
+	resp->length = len;
+	if ((rval = sws_response_headers(conn, req, resp)) == 0
+		&& req->method != 1)
+		rval = conn_write(conn, body, len);
+	free(body);
+
+	return rval;
+}
+
+/*
+ * Keep the connection open only if the client wants it, it has requests
+ * left, the rest of the request, body included, was read cleanly, and the
+ * end of the response body can be told without closing. The server's own
+ * error pages have a length; a script's are framed like its other output.
+ */
+static int
+sws_keepalive(struct conn *conn, struct request *req, struct response *resp) {
+
+	return req->keepalive && !req->simple && !req->unread
+		&& conn->nrequests < __sws_max_requests
+		&& (resp->chunked || resp->length != (unsigned long)-1
+		|| (resp->status_line[0] != '\0' ? sws_cgi_bodyless(resp)
+		: http_status != STATUS_200))
+		&& (http_status == STATUS_200 || http_status == STATUS_206
+		|| http_status == STATUS_304 || http_status == STATUS_403
+		|| http_status == STATUS_404 || http_status == STATUS_416);
+}
+
+/*
+ * Copy the status line and headers shared by all responses into buf and
+ * return the end of what was written.
+ */
+static char*
+put_status(char *p, struct conn *conn, struct request *req,
+	struct response *resp) {
+
+	p = PUT_LITERAL(p, "HTTP/");
+	p = put(p, (req->version != NULL)? req->version : "1.0", 3);
+	if (resp->status_line[0] != '\0')
+		p = put(p, resp->status_line, strlen(resp->status_line));
+	else
+		p = put(p, status_lines[http_status].line,
+			status_lines[http_status].len);
+	p = PUT_LITERAL(p, "Date: ");
+	p = put(p, http_date(), HTTP_DATE_LEN);
+	p = PUT_LITERAL(p, "\r\nServer: SWS\r\nConnection: ");
+	if (conn->keepalive)
+		p = PUT_LITERAL(p, "keep-alive\r\n");
+	else
+		p = PUT_LITERAL(p, "close\r\n");
+
+	return p;
+}
+
+/*
+ * Format the status line and headers of a 200, 206 or 304 response into
+ * buf, which holds BUFF_SIZE bytes, and return their length.
+ */
+static int
+sws_format_headers(struct conn *conn, struct request *req,
+	struct response *resp, char *buf) {
+
+	char *p;
+
+	p = put_status(buf, conn, req, resp);
+	if (resp->last_modified[0] != '\0') {
+		p = PUT_LITERAL(p, "Last-Modified: ");
+		p = put(p, resp->last_modified, strlen(resp->last_modified));
+		p = PUT_LITERAL(p, "\r\n");
 	}
-	buf[i] = '\0';
+	if (resp->etag[0] != '\0') {
+		p = PUT_LITERAL(p, "ETag: ");
+		p = put(p, resp->etag, strlen(resp->etag));
+		p = PUT_LITERAL(p, "\r\n");
+	}
+	if (resp->ranges)
+		p = PUT_LITERAL(p, "Accept-Ranges: bytes\r\n");
+	if (resp->content_range[0] != '\0') {
+		p = PUT_LITERAL(p, "Content-Range: ");
+		p = put(p, resp->content_range, strlen(resp->content_range));
+		p = PUT_LITERAL(p, "\r\n");
+	}
+	p = PUT_LITERAL(p, "Content-Type: ");
+	p = put(p, resp->content_type, strlen(resp->content_type));
+	p = PUT_LITERAL(p, "\r\n");
+	if (resp->content_encoding != NULL) {
+		p = PUT_LITERAL(p, "Content-Encoding: ");
+		p = put(p, resp->content_encoding,
+			strlen(resp->content_encoding));
+		p = PUT_LITERAL(p, "\r\n");
+	}
+	if (resp->vary)
+		p = PUT_LITERAL(p, "Vary: Accept-Encoding\r\n");
+	if (resp->extra_headers != NULL)
+		p = put(p, resp->extra_headers, strlen(resp->extra_headers));
+	if (resp->chunked) {
+		p = PUT_LITERAL(p, "Transfer-Encoding: chunked\r\n");
+	} else if ((http_status == STATUS_200 || http_status == STATUS_206
+		|| resp->status_line[0] != '\0')
+		&& resp->length != (unsigned long)-1) {
+		p = PUT_LITERAL(p, "Content-Length: ");
+		p = put_ulong(p, resp->length);
+		p = PUT_LITERAL(p, "\r\n");
+	}
+	p = PUT_LITERAL(p, "\r\n");
 
-	return i;
+	return p - buf;
 }
 
 int
-sws_response_headers(int sock, struct request *req, struct response *resp) {
+sws_response_headers(struct conn *conn, struct request *req, struct response *resp) {
 
-	time_t now;
+	const struct status_line *sl;
 	char buf[BUFF_SIZE];
-	char timestr[64];
-	char html_msg[BUFF_SIZE];
-	char len[32];
-
-	memset(html_msg, 0, sizeof(html_msg));
-	now = time(NULL);
-	strftime(timestr, sizeof(timestr), RFC1123_DATE, gmtime(&now));
-
-	if (strcmp(http_status, STATUS_200) == 0 ||
-		strcmp(http_status, STATUS_304) == 0) {
-		sprintf(buf, "HTTP/%s %s\r\n"
-			"Date: %s\r\n"
-			"Server: SWS\r\n"
-			"%s%s%s"
-			"Content-Type: %s\r\n",
-			//"%s%lu%s"
-			//"Content-Length: %lu\r\n"
-			//"\r\n",
-			(req->simple == 1)? "0.9" : "1.0",
-			http_status, timestr,
-			(resp->last_modified != NULL)? "Last-Modified: " : "",
-			(resp->last_modified != NULL)? resp->last_modified : "",
-			(resp->last_modified != NULL)? "\r\n" : "",
-			resp->content_type);
-			/*(strcmp(http_status, STATUS_200) == 0)? "Content-Length: " : "",
-			(strcmp(http_status, STATUS_200) == 0)? resp->length : atoi(""),
-			(strcmp(http_status, STATUS_200) == 0)? "\r\n" : "");*/
-			if (strcmp(http_status, STATUS_200) == 0) {
-				sprintf(len, "Content-Length: %lu\r\n\r\n", resp->length);
-				strncat(buf, len, strlen(len));
-			} else {
-				strncat(buf, "\r\n", strlen("\r\n"));
-			}
+	char *p, *body;
+	int rval;
+
+	stats_mark(&req->trace);
+	conn->keepalive = sws_keepalive(conn, req, resp);
+
+	if (http_status == STATUS_200 || http_status == STATUS_206
+		|| http_status == STATUS_304 || resp->status_line[0] != '\0') {
+		p = buf + sws_format_headers(conn, req, resp, buf);
 	} else {
-		sprintf(html_msg, "<html><h1>%s</h1></html>", http_status);
-		sprintf(buf, "HTTP/%s %s\r\n"
-			"Date: %s\r\n"
-			"Server: SWS\r\n"
-			"Content-Type: text/html\r\n"
-			"Content-Length: %lu\r\n"
-			"\r\n", (req->simple == 1)? "0.9" : "1.0",
-			http_status, timestr,
-			(unsigned long)strlen(html_msg));
-		resp->length = (unsigned long)strlen(html_msg);
+		/* Error page, the status text less its CRLF */
+		sl = &status_lines[http_status];
+		resp->length = sizeof("<html><h1></h1></html>") - 1
+			+ sl->len - 3;
+		p = put_status(buf, conn, req, resp);
+		if (resp->content_range[0] != '\0') {
+			p = PUT_LITERAL(p, "Content-Range: ");
+			p = put(p, resp->content_range,
+				strlen(resp->content_range));
+			p = PUT_LITERAL(p, "\r\n");
+		}
+		p = PUT_LITERAL(p, "Content-Type: text/html\r\n"
+			"Content-Length: ");
+		p = put_ulong(p, resp->length);
+		p = PUT_LITERAL(p, "\r\n\r\n");
+		if (req->method != 1) {
+			body = p;
+			p = PUT_LITERAL(p, "<html><h1>");
+			p = put(p, sl->line + 1, sl->len - 3);
+			p = PUT_LITERAL(p, "</h1></html>");
+			resp->length = p - body;
+		}
 	}
 
 	if (__sws_logfile)
 		sws_log(logfile_fd, req, resp, __sws_debug);
 
-	if (send(sock, buf, strlen(buf), 0) < 0) {
-		perror("send");
-		return -1;
-	}
+	rval = conn_write(conn, buf, p - buf);
+	stats_phase(&req->trace, PHASE_HEADERS);
 
-	if (strlen(html_msg) > 0) {
-		if (send(sock, html_msg, strlen(html_msg), 0) < 0) {
-			perror("send");
-			return -1;
+	return rval;
+}
+
+/*
+ * Answer a GET or HEAD for a small cached file with its complete
+ * prebuilt response, building it on the first request. Only the version
+ * and date are patched in per hit, so the whole response goes out as one
+ * contiguous chunk. Returns 1, having queued nothing, if the response
+ * cannot be cached, in which case the caller falls back to headers and
+ * sendfile().
+ */
+int
+sws_response_cached(struct conn *conn, struct request *req,
+	struct response *resp, struct fcache_entry *fce) {
+
+	size_t hlen, len, tail;
+	char *blob, *p;
+	int keepalive;
+	char buf[BUFF_SIZE];
+
+	stats_mark(&req->trace);
+	keepalive = sws_keepalive(conn, req, resp);
+
+	if (fce->response == NULL) {
+		fcache_stats.misses++;
+
+		/* Kept with keep-alive, which hits patch to close if need be */
+		conn->keepalive = 1;
+		hlen = sws_format_headers(conn, req, resp, buf);
+		len = hlen + fce->size;
+		if ((blob = malloc(len)) == NULL) {
+			fprintf(stderr, "malloc error\n");
+			return 1;
+		}
+		memcpy(blob, buf, hlen);
+		if (pread(fce->fd, blob + hlen, fce->size, 0) != fce->size) {
+			free(blob);
+			return 1;
 		}
+		if (fcache_store_response(fce, blob, len, hlen,
+			strstr(buf, "Date: ") + 6 - buf,
+			strstr(buf, "Connection: ") + 12 - buf) < 0) {
+			free(blob);
+			return 1;
+		}
+	} else
+		fcache_stats.hits++;
+	conn->keepalive = keepalive;
+
+	len = (req->method == 0) ? fce->response_len : fce->header_len;
+	if (keepalive) {
+		if ((p = conn_reserve(conn, len)) == NULL)
+			return -1;
+		memcpy(p, fce->response, len);
+	} else {
+		/* The same, with "close" for "keep-alive" */
+		tail = fce->conn_off + sizeof("keep-alive") - 1;
+		if ((p = conn_reserve(conn, fce->conn_off + sizeof("close") - 1
+			+ len - tail)) == NULL)
+			return -1;
+		memcpy(p, fce->response, fce->conn_off);
+		blob = PUT_LITERAL(p + fce->conn_off, "close");
+		memcpy(blob, fce->response + tail, len - tail);
 	}
 
+	/* "HTTP/1.x", then the date, which always has the same length */
+	memcpy(p + 5, (req->version != NULL)? req->version : "1.0", 3);
+	memcpy(p + fce->date_off, http_date(), HTTP_DATE_LEN);
+
+	if (__sws_logfile)
+		sws_log(logfile_fd, req, resp, __sws_debug);
+
+	stats_phase(&req->trace, PHASE_HEADERS);
 	return 0;
 }
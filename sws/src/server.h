@@ -1,6 +1,8 @@
 #ifndef _SERVER_H_
 #define _SERVER_H_
 
+#include "conn.h"
+#include "fcache.h"
 #include "request.h"
 #include "response.h"
 
@@ -8,21 +10,42 @@ struct swsopts {
 	char *cgidir;
 	int debug;
 	char *dir;
+	int event;
 	char *ip;
 	char *logfile;
 	int port;
 	char *secdir;
 	char *key;
+	int max_requests;
+	int timeout;
+	int workers;
+	int cache_size;
+	int gzip_level;
+	int gzcache_size;
+	int fcgi_procs;
+	int status;
+	int trace;
 } opts;
 
+extern int __sws_timeout;
+extern int __sws_max_requests;
+extern int __sws_cache_size;
+extern int __sws_gzip_level;
+extern int __sws_gzcache_size;
+extern int __sws_fcgi_procs;
+extern int __sws_status;
+extern int __sws_trace;
+
 void sws_cleanup(int);
 
 void sws_init(const struct swsopts);
 
-int sws_recv_line(int, char*, int);
-
 void sws_handle_request(const int);
+int sws_process_request(struct conn*);
+int sws_process_pipeline(struct conn*);
 
-int sws_response_headers(int, struct request*, struct response*);
+int sws_response_headers(struct conn*, struct request*, struct response*);
+int sws_response_cached(struct conn*, struct request*, struct response*,
+	struct fcache_entry*);
 
 #endif
@@ -0,0 +1,413 @@
+/*
+ * stats.c - Server statistics
+ *
+ * Each process counts requests, bytes sent, connections, statuses and
+ * request latencies in a private struct stats, with plain increments.
+ * Now and then (once a second in the event loop, after every request in a
+ * forked process) the counts are added into the process's slot in a
+ * shared mapping and cleared, and the event loop also publishes its cache
+ * statistics there. The status page sums the slots only when it is asked
+ * for, so the counting itself needs no locks or atomic operations.
+ *
+ * Workers each own a slot; processes forked per connection share the
+ * first one, which is why slots are added to atomically.
+ *
+ * With the status page or tracing enabled, requests are also timed phase
+ * by phase, from accept() to the last byte of the response leaving, into
+ * a histogram per phase. Tracing logs the phases of every nth request.
+ */
+#define _GNU_SOURCE
+
+#include <sys/mman.h>
+#include <sys/types.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "defines.h"
+#include "fcache.h"
+#include "gzcache.h"
+#include "hist.h"
+#include "log.h"
+#include "stats.h"
+
+/* What one worker, or all forked processes, have done */
+struct stats_slot {
+	struct stats totals;
+	struct fcache_stats fcache;
+	struct gzcache_stats gzip;
+	pid_t pid;
+};
+
+struct stats_shared {
+	time_t started;
+	/* Requests at the previous report, for the current rate */
+	time_t last_report;
+	unsigned long last_requests;
+	int nslots;
+	struct stats_slot slots[];
+};
+
+static const char *phase_names[PHASE_COUNT] = {
+	"accept", "line", "parse", "realpath", "stat", "open", "headers", "send"
+};
+
+struct stats stats;
+
+static struct stats_shared *shared;
+static struct stats_slot *slot;
+static int attached;
+
+/* Whether phases are timed, and every how many responses one is traced */
+static int timing;
+static int trace_every;
+static unsigned long traced;
+
+/*
+ * Map slots for n workers, shared with every process forked later.
+ * Returns -1 if the mapping fails.
+ */
+int
+stats_init(int n) {
+
+	size_t size;
+
+	size = sizeof(struct stats_shared) + n * sizeof(struct stats_slot);
+	if ((shared = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_ANONYMOUS, -1, 0)) == MAP_FAILED) {
+		perror("mmap");
+		shared = NULL;
+		return -1;
+	}
+
+	shared->started = shared->last_report = time(NULL);
+	shared->nslots = n;
+	slot = &shared->slots[0];
+	timing = 1;
+
+	return 0;
+}
+
+/*
+ * Make this process the owner of slot n, which it alone updates from now
+ * on.
+ */
+void
+stats_attach(int n) {
+
+	if (shared == NULL)
+		return;
+
+	slot = &shared->slots[n];
+	slot->pid = getpid();
+	attached = 1;
+
+	/* The connections of a worker this one replaces are gone */
+	__atomic_store_n(&slot->totals.closed,
+		__atomic_load_n(&slot->totals.opened, __ATOMIC_RELAXED),
+		__ATOMIC_RELAXED);
+}
+
+/*
+ * Log the phases of every nth response; 0 turns tracing off.
+ */
+void
+stats_set_trace(int n) {
+
+	trace_every = n;
+	if (n > 0)
+		timing = 1;
+}
+
+static void
+add(unsigned long *to, unsigned long *from) {
+
+	if (*from != 0) {
+		__atomic_fetch_add(to, *from, __ATOMIC_RELAXED);
+		*from = 0;
+	}
+}
+
+/*
+ * Move this process's counts into its slot.
+ */
+void
+stats_flush(void) {
+
+	int i, j;
+
+	if (slot == NULL)
+		return;
+
+	add(&slot->totals.requests, &stats.requests);
+	add(&slot->totals.bytes, &stats.bytes);
+	add(&slot->totals.opened, &stats.opened);
+	add(&slot->totals.closed, &stats.closed);
+	for (i = 0; i < STATUS_COUNT; i++)
+		add(&slot->totals.status[i], &stats.status[i]);
+	for (i = 0; i < HIST_BUCKETS; i++)
+		add(&slot->totals.latency[i], &stats.latency[i]);
+	for (i = 0; i < PHASE_COUNT; i++)
+		for (j = 0; j < HIST_BUCKETS; j++)
+			add(&slot->totals.phases[i][j], &stats.phases[i][j]);
+
+	/* A report may catch these half copied, which it can live with */
+	if (attached) {
+		slot->fcache = fcache_stats;
+		slot->gzip = gzcache_stats;
+	}
+}
+
+/*
+ * Return the monotonic time in nanoseconds. CLOCK_MONOTONIC_COARSE would
+ * be cheaper, but its ticks are longer than most phases take.
+ */
+unsigned long
+stats_now(void) {
+
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+/*
+ * Start timing a request on a connection accepted at the given time, or
+ * 0 if it is not the connection's first request.
+ */
+void
+stats_begin(struct stats_trace *t, unsigned long accepted) {
+
+	t->start = t->mark = stats_now();
+	t->seen = 0;
+	t->pending = 0;
+	if (timing && accepted != 0) {
+		t->phase[PHASE_ACCEPT] = t->start - accepted;
+		t->seen = 1 << PHASE_ACCEPT;
+	}
+}
+
+/*
+ * Start the next phase now, leaving what came before unaccounted.
+ */
+void
+stats_mark(struct stats_trace *t) {
+
+	if (timing)
+		t->mark = stats_now();
+}
+
+/*
+ * End phase, which began at the mark.
+ */
+void
+stats_phase(struct stats_trace *t, int phase) {
+
+	unsigned long now;
+
+	if (!timing)
+		return;
+
+	now = stats_now();
+	if (t->seen & (1 << phase))
+		t->phase[phase] += now - t->mark;
+	else
+		t->phase[phase] = now - t->mark;
+	t->seen |= 1 << phase;
+	t->mark = now;
+}
+
+/*
+ * Count a request whose response, with http_status, is now queued. The
+ * time until it is sent is left to stats_sent().
+ */
+void
+stats_request(struct stats_trace *t) {
+
+	int i;
+
+	t->mark = stats_now();
+	stats.requests++;
+	stats.status[http_status]++;
+	stats.latency[hist_bucket(t->mark - t->start)]++;
+
+	if (!timing)
+		return;
+	for (i = 0; i < PHASE_COUNT; i++)
+		if (t->seen & (1 << i))
+			stats.phases[i][hist_bucket(t->phase[i])]++;
+	t->pending = 1;
+}
+
+/*
+ * Finish timing a request once the last of its response has been sent,
+ * logging its phases if it is one of those traced.
+ */
+void
+stats_sent(struct stats_trace *t, const char *method_line) {
+
+	char buf[LOG_RECORD_SIZE];
+	size_t len;
+	int i;
+
+	if (!t->pending)
+		return;
+	t->pending = 0;
+
+	stats_phase(t, PHASE_SEND);
+	stats.phases[PHASE_SEND][hist_bucket(t->phase[PHASE_SEND])]++;
+
+	if (trace_every == 0 || ++traced % trace_every != 0)
+		return;
+
+	len = snprintf(buf, sizeof(buf), "trace \"%.200s\"",
+		(method_line != NULL) ? method_line : "-");
+	for (i = 0; i < PHASE_COUNT; i++)
+		if (t->seen & (1 << i))
+			len += snprintf(buf + len, sizeof(buf) - len,
+				" %s=%.1f", phase_names[i], t->phase[i] / 1000.0);
+	len += snprintf(buf + len, sizeof(buf) - len, " total=%.1f us\n",
+		(t->mark - t->start) / 1000.0);
+
+	log_write(buf, len);
+}
+
+static void
+sum(struct stats *to, struct stats *from) {
+
+	int i, j;
+
+	to->requests += __atomic_load_n(&from->requests, __ATOMIC_RELAXED);
+	to->bytes += __atomic_load_n(&from->bytes, __ATOMIC_RELAXED);
+	to->opened += __atomic_load_n(&from->opened, __ATOMIC_RELAXED);
+	to->closed += __atomic_load_n(&from->closed, __ATOMIC_RELAXED);
+	for (i = 0; i < STATUS_COUNT; i++)
+		to->status[i] += __atomic_load_n(&from->status[i],
+			__ATOMIC_RELAXED);
+	for (i = 0; i < HIST_BUCKETS; i++)
+		to->latency[i] += __atomic_load_n(&from->latency[i],
+			__ATOMIC_RELAXED);
+	for (i = 0; i < PHASE_COUNT; i++)
+		for (j = 0; j < HIST_BUCKETS; j++)
+			to->phases[i][j] += __atomic_load_n(
+				&from->phases[i][j], __ATOMIC_RELAXED);
+}
+
+static void
+report_histogram(FILE *fp, const char *name, const unsigned long *h) {
+
+	unsigned long count;
+	int b;
+
+	for (b = 0, count = 0; b < HIST_BUCKETS; b++)
+		count += h[b];
+
+	fprintf(fp, "%s: %lu, p50 %.1f us, p90 %.1f us, p99 %.1f us, "
+		"p99.9 %.1f us\n", name, count,
+		hist_percentile(h, count, 0.5) / 1000.0,
+		hist_percentile(h, count, 0.9) / 1000.0,
+		hist_percentile(h, count, 0.99) / 1000.0,
+		hist_percentile(h, count, 0.999) / 1000.0);
+}
+
+static void
+report_cache(FILE *fp, const char *name, unsigned long hits,
+	unsigned long misses) {
+
+	if (hits + misses > 0)
+		fprintf(fp, "%s: %lu hits, %lu misses (%.1f%%)\n", name,
+			hits, misses, 100.0 * hits / (hits + misses));
+}
+
+/*
+ * Format the status page: the counts of all slots, this process's
+ * included up to now. Returns a malloc'd buffer holding *len bytes, or
+ * NULL on error.
+ */
+char*
+stats_report(size_t *len) {
+
+	static struct stats total, worker;
+	struct fcache_stats fc;
+	struct gzcache_stats gz;
+	unsigned long requests;
+	time_t now, uptime, elapsed;
+	FILE *fp;
+	char *buf;
+	char name[32];
+	int i;
+
+	if (shared == NULL)
+		return NULL;
+
+	stats_flush();
+
+	memset(&total, 0, sizeof(total));
+	memset(&fc, 0, sizeof(fc));
+	memset(&gz, 0, sizeof(gz));
+	for (i = 0; i < shared->nslots; i++) {
+		sum(&total, &shared->slots[i].totals);
+		fc.hits += shared->slots[i].fcache.hits;
+		fc.misses += shared->slots[i].fcache.misses;
+		fc.listing_hits += shared->slots[i].fcache.listing_hits;
+		fc.listing_misses += shared->slots[i].fcache.listing_misses;
+		gz.hits += shared->slots[i].gzip.hits;
+		gz.misses += shared->slots[i].gzip.misses;
+	}
+
+	now = time(NULL);
+	uptime = now - shared->started;
+	elapsed = now - shared->last_report;
+	requests = shared->last_requests;
+	shared->last_report = now;
+	shared->last_requests = total.requests;
+
+	if ((fp = open_memstream(&buf, len)) == NULL) {
+		perror("open_memstream");
+		return NULL;
+	}
+
+	fprintf(fp, "Uptime: %ld\n", (long)uptime);
+	fprintf(fp, "Requests: %lu\n", total.requests);
+	fprintf(fp, "Requests per second: %.2f\n", (uptime > 0) ?
+		(double)total.requests / uptime : 0.0);
+	if (elapsed > 0)
+		fprintf(fp, "Requests per second since last report: %.2f\n",
+			(double)(total.requests - requests) / elapsed);
+	fprintf(fp, "Bytes sent: %lu\n", total.bytes);
+	fprintf(fp, "Active connections: %lu\n", total.opened - total.closed);
+
+	for (i = 0; i < STATUS_COUNT; i++)
+		fprintf(fp, "Status %.*s: %lu\n", (int)status_lines[i].len - 3,
+			status_lines[i].line + 1, total.status[i]);
+
+	report_histogram(fp, "Latency", total.latency);
+	for (i = 0; i < PHASE_COUNT; i++) {
+		snprintf(name, sizeof(name), "Phase %s", phase_names[i]);
+		report_histogram(fp, name, total.phases[i]);
+	}
+
+	report_cache(fp, "Response cache", fc.hits, fc.misses);
+	report_cache(fp, "Listing cache", fc.listing_hits, fc.listing_misses);
+	report_cache(fp, "Gzip cache", gz.hits, gz.misses);
+
+	for (i = 0; i < shared->nslots && shared->nslots > 1; i++) {
+		memset(&worker, 0, sizeof(worker));
+		sum(&worker, &shared->slots[i].totals);
+		fprintf(fp, "Worker %d: pid %ld, %lu requests, "
+			"%lu active connections\n", i,
+			(long)shared->slots[i].pid, worker.requests,
+			worker.opened - worker.closed);
+	}
+
+	if (fclose(fp) != 0) {
+		perror("fclose");
+		free(buf);
+		return NULL;
+	}
+
+	return buf;
+}
@@ -0,0 +1,62 @@
+#ifndef _STATS_H_
+#define _STATS_H_
+
+#include "defines.h"
+#include "hist.h"
+
+/* Path of the status page, when it is enabled */
+#define STATUS_PATH "/server-status"
+
+/* Phases of a request, timed separately */
+#define PHASE_ACCEPT 0
+#define PHASE_LINE 1
+#define PHASE_PARSE 2
+#define PHASE_REALPATH 3
+#define PHASE_STAT 4
+#define PHASE_OPEN 5
+#define PHASE_HEADERS 6
+#define PHASE_SEND 7
+#define PHASE_COUNT 8
+
+/* Counters of one process, or their sum over a worker's lifetime */
+struct stats {
+	unsigned long requests;
+	unsigned long bytes;
+	unsigned long opened;
+	unsigned long closed;
+	unsigned long status[STATUS_COUNT];
+	unsigned long latency[HIST_BUCKETS];
+	unsigned long phases[PHASE_COUNT][HIST_BUCKETS];
+};
+
+/*
+ * Where the time of one request went. Each phase is the time from the
+ * mark to the end of the phase, which moves the mark; a phase met more
+ * than once, like stat, adds up.
+ */
+struct stats_trace {
+	unsigned long start;
+	unsigned long mark;
+	unsigned long phase[PHASE_COUNT];
+	/* Phases met, by bit */
+	unsigned int seen;
+	/* The response is queued but not yet sent */
+	int pending;
+};
+
+/* Updated only by the process it belongs to */
+extern struct stats stats;
+
+int stats_init(int);
+void stats_attach(int);
+void stats_set_trace(int);
+void stats_flush(void);
+unsigned long stats_now(void);
+void stats_begin(struct stats_trace*, unsigned long);
+void stats_mark(struct stats_trace*);
+void stats_phase(struct stats_trace*, int);
+void stats_request(struct stats_trace*);
+void stats_sent(struct stats_trace*, const char*);
+char* stats_report(size_t*);
+
+#endif
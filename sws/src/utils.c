@@ -1,3 +1,5 @@
+#include <sys/stat.h>
+
 #include <limits.h>
 #include <stdarg.h>
 #include <stdio.h>
@@ -5,6 +7,8 @@
 #include <string.h>
 #include <unistd.h>
 
+#include "utils.h"
+
 int
 strchr_pos(char *str, char c) {
 
@@ -25,6 +29,90 @@ strrchr_pos(char *str, char c) {
 	return (int)(ptr - str);
 }
 
+/*
+ * FNV-1a hash of a string, for hash tables keyed by paths.
+ */
+unsigned int
+str_hash(const char *str) {
+
+	unsigned int hash;
+
+	for (hash = 2166136261u; *str != '\0'; str++) {
+		hash ^= (unsigned char)*str;
+		hash *= 16777619u;
+	}
+
+	return hash;
+}
+
+/*
+ * Copy len bytes of s to p and return the end of the copy, for building
+ * strings whose parts' lengths are known without formatting calls.
+ */
+char*
+put(char *p, const char *s, size_t len) {
+
+	memcpy(p, s, len);
+	return p + len;
+}
+
+/*
+ * Write n in decimal to p and return the end of what was written.
+ */
+char*
+put_ulong(char *p, unsigned long n) {
+
+	char digits[32];
+	int i;
+
+	i = sizeof(digits);
+	do {
+		digits[--i] = '0' + n % 10;
+		n /= 10;
+	} while (n > 0);
+
+	return put(p, digits + i, sizeof(digits) - i);
+}
+
+/*
+ * Write n in lowercase hexadecimal to p and return the end of what was
+ * written.
+ */
+char*
+put_hex(char *p, unsigned long n) {
+
+	char digits[32];
+	int i;
+
+	i = sizeof(digits);
+	do {
+		digits[--i] = "0123456789abcdef"[n & 0xf];
+		n >>= 4;
+	} while (n > 0);
+
+	return put(p, digits + i, sizeof(digits) - i);
+}
+
+/*
+ * Format the strong entity tag of a version of a file, made from its
+ * inode, size and mtime, into buf, which holds ETAG_MAX bytes.
+ */
+void
+make_etag(char *buf, const struct stat *st) {
+
+	char *p;
+
+	p = buf;
+	*p++ = '"';
+	p = put_hex(p, (unsigned long)st->st_ino);
+	*p++ = '-';
+	p = put_hex(p, (unsigned long)st->st_size);
+	*p++ = '-';
+	p = put_hex(p, (unsigned long)st->st_mtime);
+	*p++ = '"';
+	*p = '\0';
+}
+
 void
 concat(char *str, int n, ...) {
 
@@ -58,8 +146,12 @@ conncat(char *str, int n, ...) {
 	va_end(args);
 }
 
+/*
+ * Resolve "." and ".." in path, relative to the working directory unless
+ * it is absolute, into a new string allocated from arena.
+ */
 char*
-my_realpath(char *path) {
+my_realpath(struct arena *arena, char *path) {
 
 	int alloc_size, abs;
 	char *ret, *tmp;
@@ -84,10 +176,8 @@ my_realpath(char *path) {
 	 * path length (or in relative path case, that plus the length of the
 	 * cwd)
 	 */
-	if ((ret = calloc(1, alloc_size)) == NULL) {
-		fprintf(stderr, "calloc error\n");
+	if ((ret = arena_calloc(arena, alloc_size)) == NULL)
 		return NULL;
-	}
 
 	/* If not absolute, append cwd */
 	if (!abs)
@@ -111,7 +201,6 @@ my_realpath(char *path) {
 			} else {
 				//we should never end up here, congrats if you do
 				fprintf(stderr, "my_realpath: Unknown error\n");
-				free(ret);
 				return NULL;
 			}
 			path += 2;
@@ -129,11 +218,5 @@ my_realpath(char *path) {
 	if (ret[strlen(ret)-1] == '/' && strlen(ret) > 1)
 		ret[strlen(ret)-1] = '\0';
 
-	//Resize allocated memory to actual string length
-	if ((ret = realloc(ret, strlen(ret)+1)) == NULL) {
-		fprintf(stderr, "realloc error\n");
-		return NULL;
-	}
-
 	return ret;
 }
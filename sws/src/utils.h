@@ -1,8 +1,24 @@
 #ifndef _UTILS_H_
 #define _UTILS_H_
 
-char* my_realpath(char*);
+#include <sys/stat.h>
+
+#include <stddef.h>
+
+#include "arena.h"
+
+#define PUT_LITERAL(p, s) put((p), (s), sizeof(s) - 1)
+
+/* Room for an entity tag, quotes included, and a coding suffix */
+#define ETAG_MAX 64
+
+char* my_realpath(struct arena*, char*);
 void concat(char*, int, ...);
 void conncat(char*, int, ...);
+unsigned int str_hash(const char*);
+char* put(char*, const char*, size_t);
+char* put_ulong(char*, unsigned long);
+char* put_hex(char*, unsigned long);
+void make_etag(char*, const struct stat*);
 
 #endif